@@ -20,6 +20,6 @@ LOCAL_C_INCLUDES := bionic/libc/dns/include system/netd/include
 LOCAL_CLANG := true
 LOCAL_CPPFLAGS := -std=c++11 -Wall -Werror
 LOCAL_MODULE := libnetd_client
-LOCAL_SRC_FILES := FwmarkClient.cpp NetdClient.cpp
+LOCAL_SRC_FILES := FwmarkChannel.cpp FwmarkClient.cpp NetdClient.cpp
 
 include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FwmarkChannel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+const sockaddr_un FwmarkChannel::SERVER_ADDRESS = {AF_UNIX, "/dev/socket/fwmarkd"};
+
+FwmarkChannel* FwmarkChannel::get() {
+    // Never destroyed, so that threads can still use it while the process exits.
+    static FwmarkChannel* channel = [] {
+        pthread_atfork([] { get()->prepareFork(); }, [] { get()->parentFork(); },
+                       [] { get()->childFork(); });
+        return new FwmarkChannel(SERVER_ADDRESS);
+    }();
+    return channel;
+}
+
+FwmarkChannel::FwmarkChannel(const sockaddr_un& serverAddress) : mServerAddress(serverAddress),
+        mSocket(-1), mUid(-1), mBroken(false), mReading(false), mFailures(0), mNextRequestId(0) {
+}
+
+FwmarkChannel::~FwmarkChannel() {
+    if (mSocket != -1) {
+        close(mSocket);
+    }
+}
+
+int FwmarkChannel::sendWithFds(int socket, iovec* iov, size_t iovlen, const int* fds,
+                               size_t numFds, bool withCredentials, int flags) {
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovlen;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(FwmarkBatchHeader::MAX_COMMANDS * sizeof(*fds)) +
+                  CMSG_SPACE(sizeof(ucred))];
+    } cmsgu;
+
+    if (numFds > FwmarkBatchHeader::MAX_COMMANDS) {
+        return -EINVAL;
+    }
+    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+    size_t controlLength = 0;
+    if (numFds) {
+        cmsghdr* const cmsgh = reinterpret_cast<cmsghdr*>(cmsgu.cmsg + controlLength);
+        const size_t length = numFds * sizeof(*fds);
+        cmsgh->cmsg_len = CMSG_LEN(length);
+        cmsgh->cmsg_level = SOL_SOCKET;
+        cmsgh->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsgh), fds, length);
+        controlLength += CMSG_SPACE(length);
+    }
+    if (withCredentials) {
+        // The kernel only lets a process send credentials that it has.
+        cmsghdr* const cmsgh = reinterpret_cast<cmsghdr*>(cmsgu.cmsg + controlLength);
+        const ucred credentials = { getpid(), geteuid(), getegid() };
+        cmsgh->cmsg_len = CMSG_LEN(sizeof(credentials));
+        cmsgh->cmsg_level = SOL_SOCKET;
+        cmsgh->cmsg_type = SCM_CREDENTIALS;
+        memcpy(CMSG_DATA(cmsgh), &credentials, sizeof(credentials));
+        controlLength += CMSG_SPACE(sizeof(credentials));
+    }
+    if (controlLength) {
+        message.msg_control = cmsgu.cmsg;
+        message.msg_controllen = controlLength;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < iovlen; i++) {
+        length += iov[i].iov_len;
+    }
+    const ssize_t sent = TEMP_FAILURE_RETRY(sendmsg(socket, &message, MSG_NOSIGNAL | flags));
+    if (sent == -1) {
+        return -errno;
+    }
+    if (static_cast<size_t>(sent) != length) {
+        return -EIO;
+    }
+    return 0;
+}
+
+bool FwmarkChannel::send(FwmarkRequest* request, int fd, int* error) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!connectLocked() || !sendLocked(request, fd)) {
+        return false;
+    }
+    return waitLocked(lock, request->requestId, error, 1);
+}
+
+bool FwmarkChannel::sendBatch(const FwmarkCommand* commands, size_t numCommands, const int* fds,
+                              size_t numFds, int* errors) {
+    FwmarkBatchHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FwmarkBatchHeader::MAGIC;
+    header.version = FwmarkBatchHeader::VERSION;
+    header.numCommands = numCommands;
+    const size_t commandsLength = numCommands * sizeof(*commands);
+    header.length = sizeof(header) + commandsLength;
+
+    // Pad short batches to the length of a FwmarkRequest.
+    char padding[sizeof(FwmarkRequest)] = {};
+    size_t paddingLength = 0;
+    if (header.length < sizeof(FwmarkRequest)) {
+        paddingLength = sizeof(FwmarkRequest) - header.length;
+        header.length = sizeof(FwmarkRequest);
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!connectLocked()) {
+        return false;
+    }
+    header.requestId = mNextRequestId++;
+    iovec iov[3] = {
+        { &header, sizeof(header) },
+        { const_cast<FwmarkCommand*>(commands), commandsLength },
+        { padding, paddingLength },
+    };
+    if (!sendIovLocked(iov, ARRAY_SIZE(iov), fds, numFds)) {
+        return false;
+    }
+    return waitLocked(lock, header.requestId, errors, numCommands);
+}
+
+// Waits until all the responses to |requestId| have arrived, and stores them in |errors|. Returns
+// false if the connection failed first.
+bool FwmarkChannel::waitLocked(std::unique_lock<std::mutex>& lock, uint32_t requestId,
+                               int* errors, size_t numResults) {
+    Pending& pending = mPending[requestId];
+    pending = { false, false, errors, numResults, 0 };
+    while (!pending.done) {
+        if (mReading) {
+            mResponseReceived.wait(lock);
+        } else {
+            readResponseLocked(lock);
+        }
+    }
+
+    const bool answered = !pending.failed;
+    mPending.erase(requestId);
+    return answered;
+}
+
+bool FwmarkChannel::sendOneWay(FwmarkRequest* request, int fd) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!connectLocked()) {
+        return false;
+    }
+    request->flags |= FwmarkRequest::NO_RESPONSE;
+    return sendLocked(request, fd);
+}
+
+// Gives up on the connection if the command can't be sent.
+bool FwmarkChannel::sendLocked(FwmarkRequest* request, int fd) {
+    request->magic = FwmarkRequest::MAGIC;
+    request->requestId = mNextRequestId++;
+    iovec iov = { request, sizeof(*request) };
+    return sendIovLocked(&iov, 1, &fd, fd != -1 ? 1 : 0);
+}
+
+// Doesn't wait if the server is so far behind that the socket's send buffer is full: the command
+// is sent on a connection of its own instead, and the connection stays up for later commands.
+bool FwmarkChannel::sendIovLocked(iovec* iov, size_t iovlen, const int* fds, size_t numFds) {
+    const int ret = sendWithFds(mSocket, iov, iovlen, fds, numFds, true, MSG_DONTWAIT);
+    if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+        return false;
+    }
+    if (ret) {
+        failLocked(true);
+        closeIfIdleLocked();
+        return false;
+    }
+    return true;
+}
+
+bool FwmarkChannel::connectLocked() {
+    const uid_t uid = geteuid();
+    if (mSocket != -1 && !mBroken && mUid == uid) {
+        return true;
+    }
+    if (mSocket != -1 && !mBroken) {
+        failLocked(false);
+    }
+    closeIfIdleLocked();
+    if (mSocket != -1 || mFailures >= MAX_FAILURES) {
+        return false;
+    }
+
+    // Connecting to a UNIX socket whose listen backlog is full blocks, unless the socket is
+    // non-blocking. The socket goes back to blocking once connected, for readResponseLocked().
+    mSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (mSocket == -1) {
+        return false;
+    }
+    if (TEMP_FAILURE_RETRY(connect(mSocket, reinterpret_cast<const sockaddr*>(&mServerAddress),
+                                   sizeof(mServerAddress))) == -1 ||
+            fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) & ~O_NONBLOCK) == -1) {
+        close(mSocket);
+        mSocket = -1;
+        return false;
+    }
+    mUid = uid;
+    return true;
+}
+
+void FwmarkChannel::readResponseLocked(std::unique_lock<std::mutex>& lock) {
+    const int sock = mSocket;
+    mReading = true;
+    lock.unlock();
+
+    FwmarkResponse response;
+    const ssize_t length = TEMP_FAILURE_RETRY(recv(sock, &response, sizeof(response),
+                                                   MSG_WAITALL));
+
+    lock.lock();
+    mReading = false;
+    if (!mBroken) {
+        auto it = mPending.end();
+        if (length == sizeof(response)) {
+            it = mPending.find(response.requestId);
+        }
+        if (it != mPending.end() && !it->second.done) {
+            Pending& pending = it->second;
+            pending.errors[pending.received++] = response.error;
+            pending.done = (pending.received == pending.numResults);
+        } else {
+            failLocked(true);
+        }
+    }
+    closeIfIdleLocked();
+    mResponseReceived.notify_all();
+}
+
+// Fails all the requests waiting for a response, and shuts down the connection so that the thread
+// reading from it, if any, returns.
+void FwmarkChannel::failLocked(bool error) {
+    if (error) {
+        mFailures++;
+    }
+    for (auto& it : mPending) {
+        if (!it.second.done) {
+            it.second.done = true;
+            it.second.failed = true;
+        }
+    }
+    shutdown(mSocket, SHUT_RDWR);
+    mBroken = true;
+    mResponseReceived.notify_all();
+}
+
+void FwmarkChannel::closeIfIdleLocked() {
+    if (mBroken && !mReading) {
+        close(mSocket);
+        mSocket = -1;
+        mBroken = false;
+    }
+}
+
+void FwmarkChannel::prepareFork() {
+    mMutex.lock();
+}
+
+void FwmarkChannel::parentFork() {
+    mMutex.unlock();
+}
+
+// The child has a copy of the connection, but the server thinks it belongs to the parent, and the
+// threads waiting for responses on it don't exist in the child.
+void FwmarkChannel::childFork() {
+    if (mSocket != -1) {
+        close(mSocket);
+    }
+    mSocket = -1;
+    mBroken = false;
+    mReading = false;
+    mPending.clear();
+    mMutex.unlock();
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef NETD_CLIENT_FWMARK_CHANNEL_H
+#define NETD_CLIENT_FWMARK_CHANNEL_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include "FwmarkCommand.h"
+
+// A connection to the fwmark server that is kept open and shared by all the threads in the
+// process. Each command carries a request ID, so that several threads can have commands in flight
+// at once: whichever thread is waiting for a response reads the next one from the socket and hands
+// it to the thread that sent the matching request.
+//
+// The server identifies clients by the credentials they had when they connected, so the connection
+// is only used while the process has the same effective UID, and is not inherited by children.
+// Each message also carries the process's current credentials, which the server checks against
+// those of the connection, in case the effective UID changes while a command is being sent.
+class FwmarkChannel {
+public:
+    static const sockaddr_un SERVER_ADDRESS;
+
+    // The channel to SERVER_ADDRESS.
+    static FwmarkChannel* get();
+
+    // Only tests need a channel to another address. Unlike get(), this doesn't install fork
+    // handlers: the caller must call prepareFork(), parentFork() and childFork() around fork().
+    explicit FwmarkChannel(const sockaddr_un& serverAddress);
+    ~FwmarkChannel();
+
+    // Sends |iov| on |socket|, along with the |numFds| file descriptors in |fds|, and the
+    // credentials of the process if |withCredentials| is true, as ancillary data. |flags| are
+    // passed to sendmsg(). Returns 0 on success or a negative errno value on failure, including
+    // -EIO if only part of |iov| was sent.
+    static int sendWithFds(int socket, iovec* iov, size_t iovlen, const int* fds, size_t numFds,
+                           bool withCredentials, int flags = 0);
+
+    // Sends |request|, along with |fd| if it is not -1, and waits for the response. Returns false
+    // if the command could not be sent or answered on this connection, in which case it should be
+    // sent on a connection of its own. The server may have processed it anyway, which is harmless:
+    // all commands can be repeated, and at worst a connect is reported twice.
+    bool send(FwmarkRequest* request, int fd, int* error);
+
+    // Sends |request| like send() does, but doesn't wait for the server to process it. Returns
+    // false if the command should be sent on a connection of its own instead.
+    bool sendOneWay(FwmarkRequest* request, int fd);
+
+    // Sends the |numCommands| commands in |commands| in one message, along with |fds|, and waits
+    // for the server to process them all. Returns false, like send(), if they should be sent one
+    // at a time instead. See FwmarkBatchHeader for the requirements on |commands| and |fds|.
+    bool sendBatch(const FwmarkCommand* commands, size_t numCommands, const int* fds,
+                   size_t numFds, int* errors);
+
+    // prepareFork() takes the lock that guards the connection, so that the child gets a consistent
+    // copy of it. Nothing blocks while holding that lock, so this never waits for the server.
+    void prepareFork();
+    void parentFork();
+    void childFork();
+
+    // Stop trying after this many connections have failed, e.g., because the server does not
+    // support persistent connections or already has too many of them.
+    static const int MAX_FAILURES = 3;
+
+private:
+    // A request waiting for its responses: one for each of |numResults| commands.
+    struct Pending {
+        bool done;
+        bool failed;
+        int* errors;
+        size_t numResults;
+        size_t received;
+    };
+
+    bool connectLocked();
+    bool sendLocked(FwmarkRequest* request, int fd);
+    bool sendIovLocked(iovec* iov, size_t iovlen, const int* fds, size_t numFds);
+    bool waitLocked(std::unique_lock<std::mutex>& lock, uint32_t requestId, int* errors,
+                    size_t numResults);
+    void readResponseLocked(std::unique_lock<std::mutex>& lock);
+    void failLocked(bool error);
+    void closeIfIdleLocked();
+
+    const sockaddr_un mServerAddress;
+    std::mutex mMutex;
+    std::condition_variable mResponseReceived;
+    int mSocket;
+    uid_t mUid;
+    // mSocket has been shut down, but the thread reading from it still needs it to stay open.
+    bool mBroken;
+    // A thread is waiting for a response on mSocket without holding mMutex.
+    bool mReading;
+    int mFailures;
+    uint32_t mNextRequestId;
+    std::map<uint32_t, Pending> mPending;
+};
+
+#endif  // NETD_CLIENT_FWMARK_CHANNEL_H
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FwmarkChannel.h"
+#include "FwmarkCommand.h"
+
+// Plays the fwmark server for a FwmarkChannel, on an abstract UNIX socket of its own.
+class FwmarkChannelTest : public ::testing::Test {
+protected:
+    sockaddr_un mAddress;
+    int mListenSocket;
+    FwmarkChannel* mChannel;
+
+    void SetUp() override {
+        memset(&mAddress, 0, sizeof(mAddress));
+        mAddress.sun_family = AF_UNIX;
+        // Leaves sun_path[0] 0, which makes the address abstract.
+        snprintf(mAddress.sun_path + 1, sizeof(mAddress.sun_path) - 1, "FwmarkChannelTest.%d",
+                 getpid());
+        mListenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ASSERT_NE(-1, mListenSocket);
+        ASSERT_EQ(0, bind(mListenSocket, reinterpret_cast<sockaddr*>(&mAddress),
+                          sizeof(mAddress)));
+        ASSERT_EQ(0, listen(mListenSocket, 10));
+        mChannel = new FwmarkChannel(mAddress);
+    }
+
+    void TearDown() override {
+        delete mChannel;
+        close(mListenSocket);
+    }
+
+    // Returns the next connection from the channel, with SO_PASSCRED set like fwmarkd does.
+    int acceptClient() {
+        const int fd = accept4(mListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        const int on = 1;
+        EXPECT_EQ(0, setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)));
+        return fd;
+    }
+
+    // Returns true if the channel has opened a connection that wasn't accepted yet.
+    bool hasPendingClient() {
+        pollfd fd = { mListenSocket, POLLIN, 0 };
+        return poll(&fd, 1, 0) == 1;
+    }
+
+    // Reads |length| bytes from |fd|, closes any file descriptors received with them, and checks
+    // that they came with the credentials of this process.
+    static void readMessage(int fd, void* data, size_t length) {
+        iovec iov = { data, length };
+        union {
+            cmsghdr cmh;
+            char cmsg[CMSG_SPACE(FwmarkBatchHeader::MAX_COMMANDS * sizeof(int)) +
+                      CMSG_SPACE(sizeof(ucred))];
+        } cmsgu;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsgu.cmsg;
+        msg.msg_controllen = sizeof(cmsgu.cmsg);
+        ASSERT_EQ(static_cast<ssize_t>(length), recvmsg(fd, &msg, MSG_WAITALL));
+
+        bool hasCredentials = false;
+        for (cmsghdr* cmsgh = CMSG_FIRSTHDR(&msg); cmsgh; cmsgh = CMSG_NXTHDR(&msg, cmsgh)) {
+            if (cmsgh->cmsg_type == SCM_RIGHTS) {
+                const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsgh));
+                for (size_t i = 0; i < (cmsgh->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                    close(fds[i]);
+                }
+            } else if (cmsgh->cmsg_type == SCM_CREDENTIALS) {
+                ucred credentials;
+                memcpy(&credentials, CMSG_DATA(cmsgh), sizeof(credentials));
+                EXPECT_EQ(geteuid(), credentials.uid);
+                EXPECT_EQ(getpid(), credentials.pid);
+                hasCredentials = true;
+            }
+        }
+        EXPECT_TRUE(hasCredentials);
+    }
+
+    static FwmarkRequest readRequest(int fd) {
+        FwmarkRequest request;
+        readMessage(fd, &request, sizeof(request));
+        EXPECT_EQ(uint32_t(FwmarkRequest::MAGIC), request.magic);
+        return request;
+    }
+
+    static void respond(int fd, uint32_t requestId, int error) {
+        const FwmarkResponse response = { requestId, error };
+        EXPECT_EQ(static_cast<ssize_t>(sizeof(response)),
+                  send(fd, &response, sizeof(response), 0));
+    }
+
+    static FwmarkRequest makeRequest(unsigned netId) {
+        FwmarkRequest request;
+        memset(&request, 0, sizeof(request));
+        request.command.cmdId = FwmarkCommand::SELECT_NETWORK;
+        request.command.netId = netId;
+        return request;
+    }
+
+    // Sends a request for |netId| on the channel, and expects the server to answer -netId.
+    static void expectAnswered(FwmarkChannel* channel, unsigned netId) {
+        FwmarkRequest request = makeRequest(netId);
+        int error = 0;
+        EXPECT_TRUE(channel->send(&request, -1, &error));
+        EXPECT_EQ(-static_cast<int>(netId), error);
+    }
+};
+
+TEST_F(FwmarkChannelTest, TestSendsRequests) {
+    std::thread client([this] {
+        expectAnswered(mChannel, 100);
+        expectAnswered(mChannel, 101);
+    });
+
+    // Both requests use the same connection.
+    const int fd = acceptClient();
+    FwmarkRequest request = readRequest(fd);
+    EXPECT_EQ(100U, request.command.netId);
+    respond(fd, request.requestId, -100);
+    request = readRequest(fd);
+    EXPECT_EQ(101U, request.command.netId);
+    respond(fd, request.requestId, -101);
+    client.join();
+
+    EXPECT_FALSE(hasPendingClient());
+    close(fd);
+}
+
+TEST_F(FwmarkChannelTest, TestDemultiplexesResponses) {
+    const unsigned kNumThreads = 4;
+    std::vector<std::thread> clients;
+    for (unsigned i = 0; i < kNumThreads; i++) {
+        clients.emplace_back([this, i] { expectAnswered(mChannel, 100 + i); });
+    }
+
+    // Answer the requests in the opposite order to the one they came in.
+    const int fd = acceptClient();
+    std::vector<FwmarkRequest> requests;
+    for (unsigned i = 0; i < kNumThreads; i++) {
+        requests.push_back(readRequest(fd));
+    }
+    for (auto it = requests.rbegin(); it != requests.rend(); ++it) {
+        respond(fd, it->requestId, -static_cast<int>(it->command.netId));
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    close(fd);
+}
+
+TEST_F(FwmarkChannelTest, TestSendsBatches) {
+    const size_t kNumCommands = 3;
+    FwmarkCommand commands[kNumCommands];
+    for (size_t i = 0; i < kNumCommands; i++) {
+        commands[i] = { FwmarkCommand::QUERY_USER_ACCESS, static_cast<unsigned>(100 + i), 0 };
+    }
+    int errors[kNumCommands] = {};
+    std::thread client([this, &commands, &errors] {
+        EXPECT_TRUE(mChannel->sendBatch(commands, kNumCommands, nullptr, 0, errors));
+    });
+
+    const int fd = acceptClient();
+    struct {
+        FwmarkBatchHeader header;
+        FwmarkCommand commands[kNumCommands];
+        char padding[sizeof(FwmarkRequest) - sizeof(FwmarkBatchHeader) -
+                     kNumCommands * sizeof(FwmarkCommand)];
+    } batch;
+    static_assert(sizeof(batch) == sizeof(FwmarkRequest), "batch should be padded");
+    readMessage(fd, &batch, sizeof(batch));
+    EXPECT_EQ(uint32_t(FwmarkBatchHeader::MAGIC), batch.header.magic);
+    EXPECT_EQ(kNumCommands, batch.header.numCommands);
+    EXPECT_EQ(sizeof(FwmarkRequest), batch.header.length);
+    for (size_t i = 0; i < kNumCommands; i++) {
+        respond(fd, batch.header.requestId, -static_cast<int>(batch.commands[i].netId));
+    }
+    client.join();
+
+    for (size_t i = 0; i < kNumCommands; i++) {
+        EXPECT_EQ(-static_cast<int>(100 + i), errors[i]);
+    }
+    close(fd);
+}
+
+TEST_F(FwmarkChannelTest, TestFailsOnUnexpectedResponses) {
+    std::thread client([this] {
+        FwmarkRequest request = makeRequest(100);
+        int error;
+        EXPECT_FALSE(mChannel->send(&request, -1, &error));
+    });
+
+    const int fd = acceptClient();
+    const FwmarkRequest request = readRequest(fd);
+    respond(fd, request.requestId + 1, 0);
+    client.join();
+
+    // The connection can't be trusted any more, so the next command uses a new one.
+    std::thread nextClient([this] { expectAnswered(mChannel, 101); });
+    const int nextFd = acceptClient();
+    const FwmarkRequest nextRequest = readRequest(nextFd);
+    respond(nextFd, nextRequest.requestId, -101);
+    nextClient.join();
+    close(fd);
+    close(nextFd);
+}
+
+TEST_F(FwmarkChannelTest, TestGivesUpAfterRepeatedFailures) {
+    // A server that doesn't support persistent connections closes them after the first command.
+    std::thread client([this] {
+        for (int i = 0; i < FwmarkChannel::MAX_FAILURES; i++) {
+            FwmarkRequest request = makeRequest(100);
+            int error;
+            EXPECT_FALSE(mChannel->send(&request, -1, &error));
+        }
+    });
+    for (int i = 0; i < FwmarkChannel::MAX_FAILURES; i++) {
+        const int fd = acceptClient();
+        readRequest(fd);
+        close(fd);
+    }
+    client.join();
+
+    // From then on, commands fall back to one-shot connections right away.
+    FwmarkRequest request = makeRequest(100);
+    int error;
+    EXPECT_FALSE(mChannel->send(&request, -1, &error));
+    EXPECT_FALSE(mChannel->sendOneWay(&request, -1));
+    EXPECT_FALSE(hasPendingClient());
+}
+
+TEST_F(FwmarkChannelTest, TestDoesNotBlockWhenServerIsBehind) {
+    std::thread client([this] { expectAnswered(mChannel, 100); });
+    const int fd = acceptClient();
+    FwmarkRequest request = readRequest(fd);
+    respond(fd, request.requestId, -100);
+    client.join();
+
+    // The server stops reading. Once the socket's buffers are full, commands are sent on
+    // connections of their own instead of waiting, so that prepareFork() doesn't have to wait
+    // either.
+    size_t sent = 0;
+    request = makeRequest(100);
+    while (mChannel->sendOneWay(&request, -1)) {
+        sent++;
+    }
+    ASSERT_NE(0U, sent);
+    mChannel->prepareFork();
+    mChannel->parentFork();
+
+    // The connection still works once the server catches up.
+    for (size_t i = 0; i < sent; i++) {
+        readRequest(fd);
+    }
+    std::thread laterClient([this] { expectAnswered(mChannel, 101); });
+    request = readRequest(fd);
+    EXPECT_EQ(101U, request.command.netId);
+    respond(fd, request.requestId, -101);
+    laterClient.join();
+    EXPECT_FALSE(hasPendingClient());
+    close(fd);
+}
+
+TEST_F(FwmarkChannelTest, TestChildDoesNotUseParentConnection) {
+    std::thread client([this] { expectAnswered(mChannel, 100); });
+    const int fd = acceptClient();
+    FwmarkRequest request = readRequest(fd);
+    respond(fd, request.requestId, -100);
+    client.join();
+
+    mChannel->prepareFork();
+    const pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (pid == 0) {
+        mChannel->childFork();
+        FwmarkRequest childRequest = makeRequest(200);
+        int error = 0;
+        const bool sent = mChannel->send(&childRequest, -1, &error);
+        _exit(sent && error == -200 ? 0 : 1);
+    }
+    mChannel->parentFork();
+
+    // The child opens a connection of its own, and the parent keeps using its connection.
+    const int childFd = accept4(mListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+    ASSERT_NE(-1, childFd);
+    FwmarkRequest childRequest;
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(childRequest)),
+              recv(childFd, &childRequest, sizeof(childRequest), MSG_WAITALL));
+    EXPECT_EQ(200U, childRequest.command.netId);
+    respond(childFd, childRequest.requestId, -200);
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+
+    std::thread parentClient([this] { expectAnswered(mChannel, 101); });
+    request = readRequest(fd);
+    EXPECT_EQ(101U, request.command.netId);
+    respond(fd, request.requestId, -101);
+    parentClient.join();
+    close(fd);
+    close(childFd);
+}
@@ -16,20 +16,29 @@
 
 #include "FwmarkClient.h"
 
+#include "FwmarkChannel.h"
 #include "FwmarkCommand.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 
 namespace {
 
-const sockaddr_un FWMARK_SERVER_PATH = {AF_UNIX, "/dev/socket/fwmarkd"};
+void fillRequest(FwmarkRequest* request, const FwmarkCommand* data,
+                 const FwmarkConnectInfo* connectInfo) {
+    memset(request, 0, sizeof(*request));
+    request->command = *data;
+    if (connectInfo) {
+        request->connectInfo = *connectInfo;
+    }
+}
 
 }  // namespace
 
@@ -52,14 +61,67 @@ FwmarkClient::~FwmarkClient() {
     }
 }
 
+void FwmarkClient::sendOneWay(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo) {
+    FwmarkRequest request;
+    fillRequest(&request, data, connectInfo);
+    if (!FwmarkChannel::get()->sendOneWay(&request, fd)) {
+        send(data, fd, connectInfo);
+    }
+}
+
+void FwmarkClient::sendBatch(FwmarkCommand* data, const int* fds, size_t numCommands,
+                             int* errors) {
+    while (numCommands) {
+        const size_t numBatched = std::min<size_t>(numCommands, FwmarkBatchHeader::MAX_COMMANDS);
+        // Every command but QUERY_USER_ACCESS takes a socket. If one of them doesn't have a valid
+        // one, send the commands one at a time, so that it fails like it would on its own.
+        int batchFds[FwmarkBatchHeader::MAX_COMMANDS];
+        size_t numFds = 0;
+        bool batchable = true;
+        for (size_t i = 0; i < numBatched; i++) {
+            if (data[i].cmdId == FwmarkCommand::QUERY_USER_ACCESS) {
+                continue;
+            }
+            if (data[i].cmdId == FwmarkCommand::ON_CONNECT_COMPLETE || fds[i] < 0) {
+                batchable = false;
+            } else {
+                batchFds[numFds++] = fds[i];
+            }
+        }
+
+        if (!batchable || numBatched == 1 ||
+                !FwmarkChannel::get()->sendBatch(data, numBatched, batchFds, numFds, errors)) {
+            for (size_t i = 0; i < numBatched; i++) {
+                errors[i] = FwmarkClient().send(&data[i], fds[i], nullptr);
+            }
+        }
+        data += numBatched;
+        fds += numBatched;
+        errors += numBatched;
+        numCommands -= numBatched;
+    }
+}
+
 int FwmarkClient::send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo) {
+    if (data->cmdId == FwmarkCommand::QUERY_USER_ACCESS) {
+        fd = -1;
+    }
+
+    FwmarkRequest request;
+    fillRequest(&request, data, connectInfo);
+    int error;
+    if (FwmarkChannel::get()->send(&request, fd, &error)) {
+        return error;
+    }
+
     mChannel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (mChannel == -1) {
         return -errno;
     }
 
-    if (TEMP_FAILURE_RETRY(connect(mChannel, reinterpret_cast<const sockaddr*>(&FWMARK_SERVER_PATH),
-                                   sizeof(FWMARK_SERVER_PATH))) == -1) {
+    const sockaddr_un& server = FwmarkChannel::SERVER_ADDRESS;
+    if (TEMP_FAILURE_RETRY(connect(mChannel, reinterpret_cast<const sockaddr*>(&server),
+                                   sizeof(server))) == -1) {
         // If we are unable to connect to the fwmark server, assume there's no error. This protects
         // against future changes if the fwmark server goes away.
         return 0;
@@ -69,33 +131,12 @@ int FwmarkClient::send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectIn
         { data, sizeof(*data) },
         { connectInfo, (connectInfo ? sizeof(*connectInfo) : 0) },
     };
-    msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = iov;
-    message.msg_iovlen = ARRAY_SIZE(iov);
-
-    union {
-        cmsghdr cmh;
-        char cmsg[CMSG_SPACE(sizeof(fd))];
-    } cmsgu;
-
-    if (data->cmdId != FwmarkCommand::QUERY_USER_ACCESS) {
-        memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
-        message.msg_control = cmsgu.cmsg;
-        message.msg_controllen = sizeof(cmsgu.cmsg);
-
-        cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
-        cmsgh->cmsg_len = CMSG_LEN(sizeof(fd));
-        cmsgh->cmsg_level = SOL_SOCKET;
-        cmsgh->cmsg_type = SCM_RIGHTS;
-        memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
-    }
-
-    if (TEMP_FAILURE_RETRY(sendmsg(mChannel, &message, 0)) == -1) {
-        return -errno;
+    if (int ret = FwmarkChannel::sendWithFds(mChannel, iov, ARRAY_SIZE(iov), &fd,
+                                             fd != -1 ? 1 : 0, false)) {
+        return ret;
     }
 
-    int error = 0;
+    error = 0;
 
     if (TEMP_FAILURE_RETRY(recv(mChannel, &error, sizeof(error), 0)) == -1) {
         return -errno;
@@ -38,8 +38,24 @@ public:
     // Sends |data| to the fwmark server, along with |fd| as ancillary data using cmsg(3).
     // For ON_CONNECT_COMPLETE |data| command, |connectInfo| should be provided.
     // Returns 0 on success or a negative errno value on failure.
+    //
+    // Commands are sent on a connection that is shared by all threads in the process and kept
+    // open between calls. If that connection can't be used, the command is sent on a connection of
+    // its own, which this object closes when it is destroyed.
     int send(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo);
 
+    // Like send(), but for commands whose result doesn't matter, such as ON_CONNECT_COMPLETE: on
+    // the shared connection, returns as soon as the command is sent, without waiting for the
+    // server to process it.
+    void sendOneWay(FwmarkCommand* data, int fd, FwmarkConnectInfo* connectInfo);
+
+    // Sends the |numCommands| commands in |data| to the fwmark server, each along with the
+    // corresponding entry of |fds|, and stores their results in |errors|. The commands are sent in
+    // as few messages as possible on the shared connection, and processed against a consistent
+    // view of the network configuration, or else sent one at a time. ON_CONNECT_COMPLETE can't be
+    // batched.
+    void sendBatch(FwmarkCommand* data, const int* fds, size_t numCommands, int* errors);
+
     // Env flag to control whether FwmarkClient sends any information at all about network events
     // back to the system server through FwmarkServer.
     static constexpr const char* ANDROID_NO_USE_FWMARK_CLIENT = "ANDROID_NO_USE_FWMARK_CLIENT";
@@ -23,6 +23,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <vector>
 
 #include "Fwmark.h"
 #include "FwmarkClient.h"
@@ -52,6 +53,25 @@ int closeFdAndSetErrno(int fd, int error) {
     return -1;
 }
 
+// connect() on a UDP socket only sets its default destination, which isn't worth reporting.
+bool isUdpSocket(int fd) {
+    int protocol;
+    socklen_t protocolLen = sizeof(protocol);
+    return getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &protocolLen) == -1 ||
+            protocol == IPPROTO_UDP;
+}
+
+// Returns true if there's no need to send ON_CONNECT for |sockfd| because the fwmark server would
+// leave its mark unchanged. Only the server knows the permission of the calling UID, so this
+// assumes PERMISSION_NONE: if the UID has more, skipping the command leaves the socket with fewer
+// permission bits than the server would have given it, never more.
+bool isMarkUnchangedByConnect(int sockfd) {
+    Fwmark fwmark;
+    socklen_t fwmarkLen = sizeof(fwmark.intValue);
+    return getsockopt(sockfd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == 0 &&
+            fwmark.isUnchangedByConnect(PERMISSION_NONE);
+}
+
 int netdClientAccept4(int sockfd, sockaddr* addr, socklen_t* addrlen, int flags) {
     int acceptedSocket = libcAccept4(sockfd, addr, addrlen, flags);
     if (acceptedSocket == -1) {
@@ -78,7 +98,7 @@ int netdClientAccept4(int sockfd, sockaddr* addr, socklen_t* addrlen, int flags)
 int netdClientConnect(int sockfd, const sockaddr* addr, socklen_t addrlen) {
     const bool shouldSetFwmark = (sockfd >= 0) && addr
             && FwmarkClient::shouldSetFwmark(addr->sa_family);
-    if (shouldSetFwmark) {
+    if (shouldSetFwmark && !isMarkUnchangedByConnect(sockfd)) {
         FwmarkCommand command = {FwmarkCommand::ON_CONNECT, 0, 0};
         if (int error = FwmarkClient().send(&command, sockfd, nullptr)) {
             errno = -error;
@@ -92,13 +112,14 @@ int netdClientConnect(int sockfd, const sockaddr* addr, socklen_t addrlen) {
     const int connectErrno = errno;
     const unsigned latencyMs = lround(s.timeTaken());
     // Send an ON_CONNECT_COMPLETE command that includes sockaddr and connect latency for reporting
-    if (shouldSetFwmark && FwmarkClient::shouldReportConnectComplete(addr->sa_family)) {
+    if (shouldSetFwmark && FwmarkClient::shouldReportConnectComplete(addr->sa_family) &&
+            !isUdpSocket(sockfd)) {
         FwmarkConnectInfo connectInfo(ret == 0 ? 0 : connectErrno, latencyMs, addr);
         // TODO: get the netId from the socket mark once we have continuous benchmark runs
         FwmarkCommand command = {FwmarkCommand::ON_CONNECT_COMPLETE, /* netId (ignored) */ 0,
                 /* uid (filled in by the server) */ 0};
-        // Ignore return value since it's only used for logging
-        FwmarkClient().send(&command, sockfd, &connectInfo);
+        // Don't wait for the result, since it's only used for logging
+        FwmarkClient().sendOneWay(&command, sockfd, &connectInfo);
     }
     errno = connectErrno;
     return ret;
@@ -209,6 +230,18 @@ extern "C" int setNetworkForSocket(unsigned netId, int socketFd) {
     return FwmarkClient().send(&command, socketFd, nullptr);
 }
 
+extern "C" int setNetworkForSockets(unsigned netId, const int* socketFds, size_t numSockets,
+                                    int* errors) {
+    std::vector<FwmarkCommand> commands(numSockets, {FwmarkCommand::SELECT_NETWORK, netId, 0});
+    FwmarkClient().sendBatch(commands.data(), socketFds, numSockets, errors);
+    for (size_t i = 0; i < numSockets; i++) {
+        if (errors[i]) {
+            return errors[i];
+        }
+    }
+    return 0;
+}
+
 extern "C" int setNetworkForProcess(unsigned netId) {
     return setNetworkForTarget(netId, &netIdForProcess);
 }
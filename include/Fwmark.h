@@ -30,6 +30,14 @@ union Fwmark {
         Permission permission   :  2;
     };
     Fwmark() : intValue(0) {}
+
+    // Returns true if an ON_CONNECT command from a UID that has |uidPermission| would leave this
+    // mark unchanged: FwmarkServer keeps the NetId of a socket whose network was explicitly
+    // selected, and only sets its permission bits to |uidPermission|. Shared by FwmarkServer and
+    // NetdClient, so that the client only skips commands that the server would ignore.
+    bool isUnchangedByConnect(Permission uidPermission) const {
+        return explicitlySelected && permission == uidPermission;
+    }
 };
 
 static const unsigned FWMARK_NET_ID_MASK = 0xffff;
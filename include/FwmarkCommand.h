@@ -66,4 +66,63 @@ struct FwmarkCommand {
                 // ignored otherwise.
 };
 
+// Clients may also keep a connection to the fwmark server open and send several commands over it,
+// possibly from several threads at once. Each command on such a connection is wrapped in a
+// FwmarkRequest, and the server answers each one with a FwmarkResponse carrying the same
+// requestId instead of the int error code that ends a one-shot connection. A FwmarkRequest is
+// always sent whole, even if connectInfo is unused, so that it is larger than any one-shot message
+// and the server can tell the two apart.
+//
+// Each FwmarkRequest, and each batch below, must carry the sender's effective UID as
+// SCM_CREDENTIALS. The server closes the connection without a response if it doesn't match the UID
+// that the connection was opened with, e.g., because the process has dropped privileges since, and
+// likewise if anything but a FwmarkRequest or a batch follows one on the same connection.
+struct FwmarkRequest {
+    static constexpr uint32_t MAGIC = 0x464d524b;  // "FMRK".
+
+    enum : uint32_t {
+        // The server sends no response, and the client doesn't wait for one. Used for commands
+        // whose result the client ignores, such as ON_CONNECT_COMPLETE.
+        NO_RESPONSE = 1 << 0,
+    };
+
+    uint32_t magic;
+    uint32_t requestId;
+    uint32_t flags;
+    FwmarkCommand command;
+    FwmarkConnectInfo connectInfo;
+};
+
+// Several commands can also be sent in one message on a persistent connection, e.g., to select the
+// network of all the sockets that a connection pool opens at once. Such a message is a
+// FwmarkBatchHeader followed by |numCommands| FwmarkCommands, and carries the sockets of the
+// commands as SCM_RIGHTS file descriptors, in the same order: one for each command other than
+// QUERY_USER_ACCESS. ON_CONNECT_COMPLETE can't be batched. The server processes the commands in
+// order against a single view of the network configuration, and answers with one FwmarkResponse
+// per command, all carrying the batch's requestId, unless the NO_RESPONSE flag is set.
+//
+// |length| is the length of the whole message, which is padded to at least sizeof(FwmarkRequest)
+// and sent with a single sendmsg(), so that the server can read the first sizeof(FwmarkRequest)
+// bytes of any message without reading into the next one, and never waits for the rest. The server
+// closes the connection if it can't parse a batch, e.g., because it doesn't support |version|, and
+// the client then sends the commands one at a time.
+struct FwmarkBatchHeader {
+    static constexpr uint32_t MAGIC = 0x464d5242;  // "FMRB".
+    static constexpr uint16_t VERSION = 1;
+    // Well below the number of file descriptors that one message can carry (SCM_MAX_FD).
+    static constexpr uint16_t MAX_COMMANDS = 64;
+
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numCommands;
+    uint32_t length;
+    uint32_t requestId;
+    uint32_t flags;  // Same as FwmarkRequest::flags.
+};
+
+struct FwmarkResponse {
+    uint32_t requestId;
+    int error;
+};
+
 #endif  // NETD_INCLUDE_FWMARK_COMMAND_H
@@ -18,6 +18,7 @@
 #define NETD_INCLUDE_NETD_CLIENT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
 
@@ -27,6 +28,10 @@ __BEGIN_DECLS
 
 int getNetworkForSocket(unsigned* netId, int socketFd);
 int setNetworkForSocket(unsigned netId, int socketFd);
+// Same as setNetworkForSocket(), for |numSockets| sockets at once, e.g., those of a connection
+// pool. Stores the result for each socket in |errors|, and returns the first of them that failed,
+// if any.
+int setNetworkForSockets(unsigned netId, const int* socketFds, size_t numSockets, int* errors);
 
 unsigned getNetworkForProcess(void);
 int setNetworkForProcess(unsigned netId);
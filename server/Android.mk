@@ -76,10 +76,12 @@ LOCAL_SRC_FILES := \
         CommandListener.cpp \
         Controllers.cpp \
         DnsProxyListener.cpp \
+        DnsProxyResponse.cpp \
         DummyNetwork.cpp \
         DumpWriter.cpp \
         EventReporter.cpp \
         FirewallController.cpp \
+        FwmarkMessage.cpp \
         FwmarkServer.cpp \
         IdletimerController.cpp \
         InterfaceController.cpp \
@@ -101,6 +103,7 @@ LOCAL_SRC_FILES := \
         SoftapController.cpp \
         StrictController.cpp \
         TetherController.cpp \
+        ThreadPool.cpp \
         UidRanges.cpp \
         VirtualNetwork.cpp \
         main.cpp \
@@ -147,21 +150,34 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := netd_unit_test
 LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
 LOCAL_C_INCLUDES := \
+        system/netd/client \
         system/netd/include \
         system/netd/server \
         system/netd/server/binder \
         system/core/logwrapper/include \
+        system/netd/tests/benchmarks \
+        bionic/libc/dns/include \
 
 LOCAL_SRC_FILES := \
         NetdConstants.cpp IptablesBaseTest.cpp \
         BandwidthController.cpp BandwidthControllerTest.cpp \
         FirewallControllerTest.cpp FirewallController.cpp \
+        DnsProxyResponse.cpp DnsProxyResponseTest.cpp \
+        FwmarkMessage.cpp FwmarkMessageTest.cpp \
+        FwmarkTest.cpp \
+        ../client/FwmarkChannel.cpp ../client/FwmarkChannelTest.cpp \
         NatControllerTest.cpp NatController.cpp \
+        QueryCoalescerTest.cpp \
+        RingBufferTest.cpp \
+        DummyNetwork.cpp Network.cpp \
+        RouteController.cpp RouteControllerTest.cpp \
+        ../tests/benchmarks/fake_netlink_route.cpp \
         SockDiagTest.cpp SockDiag.cpp \
         StrictController.cpp StrictControllerTest.cpp \
+        DumpWriter.cpp ThreadPool.cpp ThreadPoolTest.cpp \
         UidRanges.cpp \
 
 LOCAL_MODULE_TAGS := tests
-LOCAL_SHARED_LIBRARIES := liblog libbase libcutils liblogwrap libsysutils
+LOCAL_SHARED_LIBRARIES := liblog libbase libcutils liblogwrap libnetutils libsysutils libutils
 include $(BUILD_NATIVE_TEST)
 
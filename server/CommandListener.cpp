@@ -55,7 +55,10 @@
 #include "qsap_api.h"
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <string>
+#include <thread>
 #include <vector>
 
 using android::net::gCtls;
@@ -64,6 +67,15 @@ namespace {
 
 const unsigned NUM_OEM_IDS = NetworkController::MAX_OEM_ID - NetworkController::MIN_OEM_ID + 1;
 
+// How long the framework has to go without asking for a rule or route after a warm restart before
+// the rules and routes it didn't ask for are removed. The framework replays its networks one
+// command at a time, so this only has to cover the gaps between commands, not the whole replay.
+const std::chrono::seconds WARM_RESTART_GRACE_PERIOD(30);
+
+// How long the rules and routes of the previous instance of netd may stay in place in any case, so
+// that a steady trickle of requests can't keep them there forever.
+const std::chrono::seconds WARM_RESTART_MAX_DURATION(120);
+
 Permission stringToPermission(const char* arg) {
     if (!strcmp(arg, "NETWORK")) {
         return PERMISSION_NETWORK;
@@ -253,6 +265,23 @@ CommandListener::CommandListener() :
     if (int ret = RouteController::Init(NetworkController::LOCAL_NET_ID)) {
         ALOGE("failed to initialize RouteController (%s)", strerror(-ret));
     }
+
+    if (RouteController::isWarmRestartPending()) {
+        std::thread([] {
+            const auto latest = std::chrono::steady_clock::now() + WARM_RESTART_MAX_DURATION;
+            auto deadline = std::min(RouteController::getWarmRestartLastRequest() +
+                                     WARM_RESTART_GRACE_PERIOD, latest);
+            while (std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_until(deadline);
+                deadline = std::min(RouteController::getWarmRestartLastRequest() +
+                                    WARM_RESTART_GRACE_PERIOD, latest);
+            }
+            android::RWLock::AutoWLock lock(android::net::gBigNetdLock);
+            if (int ret = RouteController::finishWarmRestart()) {
+                ALOGE("failed to finish RouteController warm restart (%s)", strerror(-ret));
+            }
+        }).detach();
+    }
 }
 
 CommandListener::InterfaceCmd::InterfaceCmd() :
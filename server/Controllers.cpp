@@ -16,10 +16,36 @@
 
 #include "Controllers.h"
 
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+
 namespace android {
 namespace net {
 
-Controllers::Controllers() : clatdCtrl(&netCtrl) {
+namespace {
+
+// DNS queries can take seconds each if servers are slow or unreachable, so allow quite a few to
+// run at once. Devices that see heavier DNS load can raise the limits with these properties.
+const char DNS_QUERY_THREADS_PROPERTY[] = "persist.netd.dns_query_threads";
+const char DNS_QUERY_QUEUE_PROPERTY[] = "persist.netd.dns_query_queue";
+const size_t DEFAULT_DNS_QUERY_THREADS = 64;
+const size_t DEFAULT_DNS_QUERY_QUEUE = 256;
+
+size_t getSizeProperty(const char* name, size_t defaultValue) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(name, value, "");
+    const unsigned long size = strtoul(value, nullptr, 10);
+    return size ? size : defaultValue;
+}
+
+}  // namespace
+
+Controllers::Controllers() : clatdCtrl(&netCtrl),
+        dnsQueryPool("DNS query",
+                     getSizeProperty(DNS_QUERY_THREADS_PROPERTY, DEFAULT_DNS_QUERY_THREADS),
+                     getSizeProperty(DNS_QUERY_QUEUE_PROPERTY, DEFAULT_DNS_QUERY_QUEUE)),
+        getAddrInfoCoalescer("getaddrinfo") {
     InterfaceController::initializeAll();
 }
 
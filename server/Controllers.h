@@ -30,8 +30,10 @@
 #include "ResolverController.h"
 #include "FirewallController.h"
 #include "ClatdController.h"
+#include "DnsProxyListener.h"
 #include "StrictController.h"
 #include "EventReporter.h"
+#include "ThreadPool.h"
 
 namespace android {
 namespace net {
@@ -51,6 +53,10 @@ struct Controllers {
     ClatdController clatdCtrl;
     StrictController strictCtrl;
     EventReporter eventReporter;
+    // Resolves the queries of DnsProxyListener.
+    ThreadPool dnsQueryPool;
+    // Shares the results of identical getaddrinfo queries that are in progress at the same time.
+    GetAddrInfoCoalescer getAddrInfoCoalescer;
 };
 
 extern Controllers* gCtls;
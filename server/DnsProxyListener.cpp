@@ -25,7 +25,6 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <string.h>
-#include <pthread.h>
 #include <resolv_netid.h>
 #include <net/if.h>
 
@@ -36,24 +35,31 @@
 #include <chrono>
 #include <vector>
 
+#include <android-base/stringprintf.h>
 #include <cutils/log.h>
 #include <utils/String16.h>
 #include <sysutils/SocketClient.h>
 
 #include "Fwmark.h"
 #include "DnsProxyListener.h"
+#include "DnsProxyResponse.h"
 #include "NetdConstants.h"
 #include "NetworkController.h"
 #include "ResponseCode.h"
 #include "QtiDataController.h"
 #include "Stopwatch.h"
+#include "ThreadPool.h"
 #include "android/net/metrics/INetdEventListener.h"
 
 using android::String16;
+using android::base::StringAppendF;
 using android::net::metrics::INetdEventListener;
 
-DnsProxyListener::DnsProxyListener(const NetworkController* netCtrl, EventReporter* eventReporter) :
-        FrameworkListener("dnsproxyd"), mNetCtrl(netCtrl), mEventReporter(eventReporter) {
+DnsProxyListener::DnsProxyListener(const NetworkController* netCtrl, EventReporter* eventReporter,
+                                   ThreadPool* queryPool,
+                                   GetAddrInfoCoalescer* getAddrInfoCoalescer) :
+        FrameworkListener("dnsproxyd"), mNetCtrl(netCtrl), mEventReporter(eventReporter),
+        mQueryPool(queryPool), mGetAddrInfoCoalescer(getAddrInfoCoalescer) {
     registerCmd(new GetAddrInfoCmd(this));
     registerCmd(new GetHostByAddrCmd(this));
     registerCmd(new GetHostByNameCmd(this));
@@ -69,7 +75,8 @@ DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(
           mHints(hints),
           mNetContext(netcontext),
           mReportingLevel(reportingLevel),
-          mNetdEventListener(netdEventListener) {
+          mNetdEventListener(netdEventListener),
+          mCoalescer(nullptr) {
 }
 
 DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
@@ -78,94 +85,47 @@ DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
     free(mHints);
 }
 
-void DnsProxyListener::GetAddrInfoHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetAddrInfoHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetAddrInfoHandler::threadStart(void* obj) {
-    GetAddrInfoHandler* handler = reinterpret_cast<GetAddrInfoHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
-}
-
-static bool sendBE32(SocketClient* c, uint32_t data) {
-    uint32_t be_data = htonl(data);
-    return c->sendData(&be_data, sizeof(be_data)) == 0;
+// Two queries are identical if they would send the same packets from the same socket, i.e., the
+// UID is part of the key because the resolver charges the query's traffic to it.
+std::string DnsProxyListener::GetAddrInfoHandler::key() const {
+    std::string key;
+    key.append(mHost ? mHost : "^");
+    key.push_back('\0');
+    key.append(mService ? mService : "^");
+    key.push_back('\0');
+    if (mHints) {
+        StringAppendF(&key, "%d %d %d %d", mHints->ai_flags, mHints->ai_family,
+                      mHints->ai_socktype, mHints->ai_protocol);
+    }
+    key.push_back('\0');
+    StringAppendF(&key, "%u %u %u %u %u", mNetContext.app_netid, mNetContext.app_mark,
+                  mNetContext.dns_netid, mNetContext.dns_mark, mNetContext.uid);
+    return key;
 }
 
-// Sends 4 bytes of big-endian length, followed by the data.
-// Returns true on success.
-static bool sendLenAndData(SocketClient* c, const int len, const void* data) {
-    return sendBE32(c, len) && (len == 0 || c->sendData(data, len) == 0);
-}
-
-// Returns true on success
-static bool sendhostent(SocketClient *c, struct hostent *hp) {
-    bool success = true;
-    int i;
-    if (hp->h_name != NULL) {
-        success &= sendLenAndData(c, strlen(hp->h_name)+1, hp->h_name);
-    } else {
-        success &= sendLenAndData(c, 0, "") == 0;
-    }
-
-    for (i=0; hp->h_aliases[i] != NULL; i++) {
-        success &= sendLenAndData(c, strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
-    }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
-
-    uint32_t buf = htonl(hp->h_addrtype);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
-
-    buf = htonl(hp->h_length);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
-
-    for (i=0; hp->h_addr_list[i] != NULL; i++) {
-        success &= sendLenAndData(c, 16, hp->h_addr_list[i]);
-    }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
-    return success;
-}
-
-static bool sendaddrinfo(SocketClient* c, struct addrinfo* ai) {
-    // struct addrinfo {
-    //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
-    //      int     ai_family;      /* PF_xxx */
-    //      int     ai_socktype;    /* SOCK_xxx */
-    //      int     ai_protocol;    /* 0 or IPPROTO_xxx for IPv4 and IPv6 */
-    //      socklen_t ai_addrlen;   /* length of ai_addr */
-    //      char    *ai_canonname;  /* canonical name for hostname */
-    //      struct  sockaddr *ai_addr;      /* binary address */
-    //      struct  addrinfo *ai_next;      /* next structure in linked list */
-    // };
-
-    // Write the struct piece by piece because we might be a 64-bit netd
-    // talking to a 32-bit process.
-    bool success =
-            sendBE32(c, ai->ai_flags) &&
-            sendBE32(c, ai->ai_family) &&
-            sendBE32(c, ai->ai_socktype) &&
-            sendBE32(c, ai->ai_protocol);
-    if (!success) {
-        return false;
-    }
-
-    // ai_addrlen and ai_addr.
-    if (!sendLenAndData(c, ai->ai_addrlen, ai->ai_addr)) {
-        return false;
-    }
-
-    // strlen(ai_canonname) and ai_canonname.
-    if (!sendLenAndData(c, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname)) {
-        return false;
+void DnsProxyListener::GetAddrInfoHandler::start(ThreadPool* pool,
+                                                 GetAddrInfoCoalescer* coalescer) {
+    const std::string key = this->key();
+    const Stopwatch s;
+    if (coalescer->join(key, [this, s](uint32_t rv, const addrinfo* result) {
+            sendResult(rv, result, lround(s.timeTaken()));
+            delete this;
+        })) {
+        // An identical query is in progress; its result is sent to this client too.
+        return;
+    }
+
+    mCoalescer = coalescer;
+    mKey = key;
+    if (!pool->enqueue([this] { run(); delete this; })) {
+        // Too many queries are waiting already. Fail this one right away instead of adding to the
+        // backlog; the caller may retry later.
+        uint32_t rv = EAI_AGAIN;
+        mCoalescer->finish(mKey, rv, nullptr);
+        mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
+        mClient->decRef();
+        delete this;
     }
-
-    return true;
 }
 
 void DnsProxyListener::GetAddrInfoHandler::run() {
@@ -181,18 +141,25 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
     uint32_t rv = android_getaddrinfofornetcontext(mHost, mService, mHints, &mNetContext, &result);
     const int latencyMs = lround(s.timeTaken());
 
+    sendResult(rv, result, latencyMs);
+    // Identical queries that arrived in the meantime get the same result.
+    mCoalescer->finish(mKey, rv, result);
+    if (result) {
+        freeaddrinfo(result);
+    }
+}
+
+// Sends the result of the query to the client and reports it, but doesn't free it: it may be
+// shared with identical queries.
+void DnsProxyListener::GetAddrInfoHandler::sendResult(uint32_t rv, const addrinfo* result,
+                                                      int latencyMs) {
     if (rv) {
         // getaddrinfo failed
         mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
     } else {
-        bool success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        struct addrinfo* ai = result;
-        while (ai && success) {
-            success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
-            ai = ai->ai_next;
-        }
-        success = success && sendBE32(mClient, 0);
-        if (!success) {
+        DnsProxyResponse response(ResponseCode::DnsProxyQueryResult);
+        response.appendAddrInfoList(result);
+        if (!response.send(mClient)) {
             ALOGW("Error writing DNS result to client");
         }
     }
@@ -201,15 +168,14 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
     if (result) {
         if (mNetdEventListener != nullptr
                 && mReportingLevel == INetdEventListener::REPORTING_LEVEL_FULL) {
-            for (addrinfo* ai = result; ai; ai = ai->ai_next) {
-                sockaddr* ai_addr = ai->ai_addr;
+            for (const addrinfo* ai = result; ai; ai = ai->ai_next) {
+                const sockaddr* ai_addr = ai->ai_addr;
                 if (ai_addr) {
                     addIpAddrWithinLimit(ip_addrs, ai_addr, ai->ai_addrlen);
                     total_ip_addr_count++;
                 }
             }
         }
-        freeaddrinfo(result);
     }
     mClient->decRef();
     if (mNetdEventListener != nullptr) {
@@ -328,7 +294,7 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
     DnsProxyListener::GetAddrInfoHandler* handler =
             new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints, netcontext,
                     metricsLevel, mDnsProxyListener->mEventReporter->getNetdEventListener());
-    handler->start();
+    handler->start(mDnsProxyListener->mQueryPool, mDnsProxyListener->mGetAddrInfoCoalescer);
 
     return 0;
 }
@@ -385,7 +351,7 @@ int DnsProxyListener::GetHostByNameCmd::runCommand(SocketClient *cli,
     DnsProxyListener::GetHostByNameHandler* handler =
             new DnsProxyListener::GetHostByNameHandler(cli, name, af, netId, mark, metricsLevel,
                     mDnsProxyListener->mEventReporter->getNetdEventListener());
-    handler->start();
+    handler->start(mDnsProxyListener->mQueryPool);
 
     return 0;
 }
@@ -406,19 +372,13 @@ DnsProxyListener::GetHostByNameHandler::~GetHostByNameHandler() {
     free(mName);
 }
 
-void DnsProxyListener::GetHostByNameHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-            DnsProxyListener::GetHostByNameHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByNameHandler::threadStart(void* obj) {
-    GetHostByNameHandler* handler = reinterpret_cast<GetHostByNameHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+void DnsProxyListener::GetHostByNameHandler::start(ThreadPool* pool) {
+    if (!pool->enqueue([this] { run(); delete this; })) {
+        // See GetAddrInfoHandler::start().
+        mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        mClient->decRef();
+        delete this;
+    }
 }
 
 void DnsProxyListener::GetHostByNameHandler::run() {
@@ -439,8 +399,9 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        DnsProxyResponse response(ResponseCode::DnsProxyQueryResult);
+        response.appendHostent(hp);
+        success = response.send(mClient);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
@@ -548,7 +509,7 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetHostByAddrHandler* handler =
             new DnsProxyListener::GetHostByAddrHandler(cli, addr, addrLen, addrFamily, netId, mark);
-    handler->start();
+    handler->start(mDnsProxyListener->mQueryPool);
 
     return 0;
 }
@@ -571,19 +532,13 @@ DnsProxyListener::GetHostByAddrHandler::~GetHostByAddrHandler() {
     free(mAddress);
 }
 
-void DnsProxyListener::GetHostByAddrHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetHostByAddrHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByAddrHandler::threadStart(void* obj) {
-    GetHostByAddrHandler* handler = reinterpret_cast<GetHostByAddrHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+void DnsProxyListener::GetHostByAddrHandler::start(ThreadPool* pool) {
+    if (!pool->enqueue([this] { run(); delete this; })) {
+        // See GetAddrInfoHandler::start().
+        mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        mClient->decRef();
+        delete this;
+    }
 }
 
 void DnsProxyListener::GetHostByAddrHandler::run() {
@@ -604,8 +559,9 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        DnsProxyResponse response(ResponseCode::DnsProxyQueryResult);
+        response.appendHostent(hp);
+        success = response.send(mClient);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
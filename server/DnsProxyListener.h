@@ -17,6 +17,7 @@
 #ifndef _DNSPROXYLISTENER_H__
 #define _DNSPROXYLISTENER_H__
 
+#include <netdb.h>
 #include <resolv_netid.h>  // struct android_net_context
 #include <binder/IServiceManager.h>
 #include <sysutils/FrameworkListener.h>
@@ -24,17 +25,28 @@
 #include "android/net/metrics/INetdEventListener.h"
 #include "EventReporter.h"
 #include "NetdCommand.h"
+#include "QueryCoalescer.h"
 
 class NetworkController;
+class ThreadPool;
+
+// Passes the result of a getaddrinfo query, which the callee must not free, to identical queries.
+typedef QueryCoalescer<std::string, uint32_t, const addrinfo*> GetAddrInfoCoalescer;
 
 class DnsProxyListener : public FrameworkListener {
 public:
-    explicit DnsProxyListener(const NetworkController* netCtrl, EventReporter* eventReporter);
+    // Queries are resolved on the threads of |queryPool|. Queries that don't fit in its queue fail
+    // right away. getaddrinfo queries that are identical to one in progress wait for its result
+    // through |getAddrInfoCoalescer| instead of being resolved.
+    explicit DnsProxyListener(const NetworkController* netCtrl, EventReporter* eventReporter,
+                              ThreadPool* queryPool, GetAddrInfoCoalescer* getAddrInfoCoalescer);
     virtual ~DnsProxyListener() {}
 
 private:
     const NetworkController *mNetCtrl;
     EventReporter *mEventReporter;
+    ThreadPool *mQueryPool;
+    GetAddrInfoCoalescer *mGetAddrInfoCoalescer;
     static void addIpAddrWithinLimit(std::vector<android::String16>& ip_addrs, const sockaddr* addr,
             socklen_t addrlen);
 
@@ -59,11 +71,14 @@ private:
                            const android::sp<android::net::metrics::INetdEventListener>& listener);
         ~GetAddrInfoHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        // Runs the query on |pool|, or waits for the result of an identical query in progress,
+        // and deletes this handler when done.
+        void start(ThreadPool* pool, GetAddrInfoCoalescer* coalescer);
 
     private:
         void run();
+        void sendResult(uint32_t rv, const addrinfo* result, int latencyMs);
+        std::string key() const;
         SocketClient* mClient;  // ref counted
         char* mHost;    // owned
         char* mService; // owned
@@ -71,6 +86,9 @@ private:
         struct android_net_context mNetContext;
         const int mReportingLevel;
         android::sp<android::net::metrics::INetdEventListener> mNetdEventListener;
+        // Set if this query is resolved rather than waiting for an identical one.
+        GetAddrInfoCoalescer* mCoalescer;
+        std::string mKey;
     };
 
     /* ------ gethostbyname ------*/
@@ -93,8 +111,8 @@ private:
                             int reportingLevel,
                             const android::sp<android::net::metrics::INetdEventListener>& listener);
         ~GetHostByNameHandler();
-        static void* threadStart(void* handler);
-        void start();
+        // Runs the query on |pool|, and deletes this handler when done.
+        void start(ThreadPool* pool);
     private:
         void run();
         SocketClient* mClient; //ref counted
@@ -126,8 +144,8 @@ private:
                             uint32_t mark);
         ~GetHostByAddrHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        // Runs the query on |pool|, and deletes this handler when done.
+        void start(ThreadPool* pool);
 
     private:
         void run();
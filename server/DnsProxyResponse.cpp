@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "DnsProxyResponse.h"
+
+DnsProxyResponse::DnsProxyResponse(int code) {
+    // Room for the code and a handful of addresses, which covers most responses.
+    mData.reserve(256);
+    append(&code, sizeof(code));
+}
+
+void DnsProxyResponse::append(const void* data, size_t len) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    mData.insert(mData.end(), bytes, bytes + len);
+}
+
+void DnsProxyResponse::appendBE32(uint32_t data) {
+    uint32_t be_data = htonl(data);
+    append(&be_data, sizeof(be_data));
+}
+
+void DnsProxyResponse::appendLenAndData(int len, const void* data) {
+    appendBE32(len);
+    if (len > 0) {
+        append(data, len);
+    }
+}
+
+void DnsProxyResponse::appendHostent(const hostent* hp) {
+    if (hp->h_name != NULL) {
+        appendLenAndData(strlen(hp->h_name) + 1, hp->h_name);
+    } else {
+        appendLenAndData(0, "");
+    }
+
+    for (int i = 0; hp->h_aliases[i] != NULL; i++) {
+        appendLenAndData(strlen(hp->h_aliases[i]) + 1, hp->h_aliases[i]);
+    }
+    appendLenAndData(0, "");  // null to indicate we're done
+
+    appendBE32(hp->h_addrtype);
+    appendBE32(hp->h_length);
+
+    // Each address takes 16 bytes on the wire, whatever the address family.
+    for (int i = 0; hp->h_addr_list[i] != NULL; i++) {
+        appendLenAndData(16, hp->h_addr_list[i]);
+    }
+    appendLenAndData(0, "");  // null to indicate we're done
+}
+
+void DnsProxyResponse::appendAddrInfo(const addrinfo* ai) {
+    // Write the struct piece by piece because we might be a 64-bit netd
+    // talking to a 32-bit process.
+    appendBE32(ai->ai_flags);
+    appendBE32(ai->ai_family);
+    appendBE32(ai->ai_socktype);
+    appendBE32(ai->ai_protocol);
+
+    // ai_addrlen and ai_addr.
+    appendLenAndData(ai->ai_addrlen, ai->ai_addr);
+
+    // strlen(ai_canonname) and ai_canonname.
+    appendLenAndData(ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname);
+}
+
+void DnsProxyResponse::appendAddrInfoList(const addrinfo* ai) {
+    for (; ai; ai = ai->ai_next) {
+        appendBE32(1);
+        appendAddrInfo(ai);
+    }
+    appendBE32(0);
+}
+
+bool DnsProxyResponse::send(SocketClient* c) const {
+    return c->sendData(mData.data(), mData.size()) == 0;
+}
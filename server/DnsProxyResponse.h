@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef NETD_SERVER_DNS_PROXY_RESPONSE_H
+#define NETD_SERVER_DNS_PROXY_RESPONSE_H
+
+#include <netdb.h>
+#include <stdint.h>
+
+#include <vector>
+
+class SocketClient;
+
+// Builds a DnsProxyListener response in memory, so that it can be sent to the client with one
+// write instead of one per field. The format is the one that bionic's resolver expects: the
+// response code in host byte order, followed by big-endian 32-bit integers and length-prefixed
+// data.
+class DnsProxyResponse {
+public:
+    explicit DnsProxyResponse(int code);
+
+    void appendBE32(uint32_t data);
+    // Appends 4 bytes of big-endian length, followed by the data.
+    void appendLenAndData(int len, const void* data);
+    // Appends all the entries in the list, each preceded by a 1, followed by a 0.
+    void appendAddrInfoList(const addrinfo* ai);
+    void appendHostent(const hostent* hp);
+
+    const std::vector<uint8_t>& data() const { return mData; }
+
+    // Returns true on success.
+    bool send(SocketClient* c) const;
+
+private:
+    void appendAddrInfo(const addrinfo* ai);
+    void append(const void* data, size_t len);
+
+    std::vector<uint8_t> mData;
+};
+
+#endif  // NETD_SERVER_DNS_PROXY_RESPONSE_H
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <sysutils/SocketClient.h>
+
+#include "DnsProxyResponse.h"
+
+namespace {
+
+const int kCode = 222;  // ResponseCode::DnsProxyQueryResult
+
+// The field-by-field writers that DnsProxyListener used before DnsProxyResponse, kept as the
+// reference for the wire format.
+bool sendBE32(SocketClient* c, uint32_t data) {
+    uint32_t be_data = htonl(data);
+    return c->sendData(&be_data, sizeof(be_data)) == 0;
+}
+
+bool sendLenAndData(SocketClient* c, const int len, const void* data) {
+    return sendBE32(c, len) && (len == 0 || c->sendData(data, len) == 0);
+}
+
+bool sendhostent(SocketClient *c, const hostent *hp) {
+    bool success = true;
+    int i;
+    if (hp->h_name != NULL) {
+        success &= sendLenAndData(c, strlen(hp->h_name)+1, hp->h_name);
+    } else {
+        success &= sendLenAndData(c, 0, "") == 0;
+    }
+
+    for (i=0; hp->h_aliases[i] != NULL; i++) {
+        success &= sendLenAndData(c, strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
+    }
+    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
+
+    uint32_t buf = htonl(hp->h_addrtype);
+    success &= c->sendData(&buf, sizeof(buf)) == 0;
+
+    buf = htonl(hp->h_length);
+    success &= c->sendData(&buf, sizeof(buf)) == 0;
+
+    for (i=0; hp->h_addr_list[i] != NULL; i++) {
+        success &= sendLenAndData(c, 16, hp->h_addr_list[i]);
+    }
+    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
+    return success;
+}
+
+bool sendaddrinfo(SocketClient* c, const addrinfo* ai) {
+    return sendBE32(c, ai->ai_flags) &&
+            sendBE32(c, ai->ai_family) &&
+            sendBE32(c, ai->ai_socktype) &&
+            sendBE32(c, ai->ai_protocol) &&
+            sendLenAndData(c, ai->ai_addrlen, ai->ai_addr) &&
+            sendLenAndData(c, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                           ai->ai_canonname);
+}
+
+bool sendAddrInfoResult(SocketClient* c, const addrinfo* result) {
+    bool success = !c->sendCode(kCode);
+    const addrinfo* ai = result;
+    while (ai && success) {
+        success = sendBE32(c, 1) && sendaddrinfo(c, ai);
+        ai = ai->ai_next;
+    }
+    return success && sendBE32(c, 0);
+}
+
+bool sendHostentResult(SocketClient* c, const hostent* hp) {
+    bool success = c->sendCode(kCode) == 0;
+    success &= sendhostent(c, hp);
+    return success;
+}
+
+}  // namespace
+
+class DnsProxyResponseTest : public ::testing::Test {
+protected:
+    int mFds[2];
+    SocketClient* mClient;
+
+    void SetUp() override {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, mFds));
+        mClient = new SocketClient(mFds[0], false);
+    }
+
+    void TearDown() override {
+        delete mClient;
+        close(mFds[0]);
+        close(mFds[1]);
+    }
+
+    // Returns everything the client has sent so far.
+    std::vector<uint8_t> received() {
+        std::vector<uint8_t> data;
+        uint8_t buf[4096];
+        ssize_t n;
+        while ((n = recv(mFds[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            data.insert(data.end(), buf, buf + n);
+        }
+        return data;
+    }
+
+    void expectSameAddrInfo(const addrinfo* result) {
+        ASSERT_TRUE(sendAddrInfoResult(mClient, result));
+        const std::vector<uint8_t> expected = received();
+
+        DnsProxyResponse response(kCode);
+        response.appendAddrInfoList(result);
+        EXPECT_EQ(expected, response.data());
+        ASSERT_TRUE(response.send(mClient));
+        EXPECT_EQ(expected, received());
+    }
+
+    void expectSameHostent(const hostent* hp) {
+        // Not checking the result: the old code reported a failure for a null h_name even though
+        // it sent the right bytes.
+        sendHostentResult(mClient, hp);
+        const std::vector<uint8_t> expected = received();
+
+        DnsProxyResponse response(kCode);
+        response.appendHostent(hp);
+        EXPECT_EQ(expected, response.data());
+        ASSERT_TRUE(response.send(mClient));
+        EXPECT_EQ(expected, received());
+    }
+};
+
+TEST_F(DnsProxyResponseTest, TestAddrInfoMatchesFieldByField) {
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(443);
+    sin.sin_addr.s_addr = htonl(0xc0000201);  // 192.0.2.1
+    sockaddr_in6 sin6 = {};
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(443);
+    inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+    char canonname[] = "www.example.com";
+
+    addrinfo ai4 = {};
+    ai4.ai_family = AF_INET;
+    ai4.ai_socktype = SOCK_STREAM;
+    ai4.ai_protocol = IPPROTO_TCP;
+    ai4.ai_addrlen = sizeof(sin);
+    ai4.ai_addr = reinterpret_cast<sockaddr*>(&sin);
+    addrinfo ai6 = {};
+    ai6.ai_flags = AI_CANONNAME;
+    ai6.ai_family = AF_INET6;
+    ai6.ai_socktype = SOCK_DGRAM;
+    ai6.ai_protocol = IPPROTO_UDP;
+    ai6.ai_addrlen = sizeof(sin6);
+    ai6.ai_addr = reinterpret_cast<sockaddr*>(&sin6);
+    ai6.ai_canonname = canonname;
+    ai6.ai_next = &ai4;
+
+    expectSameAddrInfo(&ai6);
+    expectSameAddrInfo(&ai4);
+    expectSameAddrInfo(nullptr);
+}
+
+TEST_F(DnsProxyResponseTest, TestHostentMatchesFieldByField) {
+    // The addresses are sent as 16 bytes each, so give each one that much room.
+    uint8_t addr1[16] = { 192, 0, 2, 1 };
+    uint8_t addr2[16] = { 192, 0, 2, 2 };
+    char name[] = "www.example.com";
+    char alias1[] = "example.com";
+    char alias2[] = "www.example.net";
+    char* aliases[] = { alias1, alias2, nullptr };
+    char* noAliases[] = { nullptr };
+    char* addrs[] = { (char*) addr1, (char*) addr2, nullptr };
+    char* noAddrs[] = { nullptr };
+
+    hostent hp = {};
+    hp.h_name = name;
+    hp.h_aliases = aliases;
+    hp.h_addrtype = AF_INET;
+    hp.h_length = 4;
+    hp.h_addr_list = addrs;
+    expectSameHostent(&hp);
+
+    hp.h_name = nullptr;
+    hp.h_aliases = noAliases;
+    hp.h_addr_list = noAddrs;
+    expectSameHostent(&hp);
+}
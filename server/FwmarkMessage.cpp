@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FwmarkMessage.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+int FwmarkMessage::read(int socket, uid_t peerUid) {
+    // Large enough for the largest batch. At first, read no more than a FwmarkRequest, which is as
+    // long as or longer than any one-shot message (FwmarkCommand, followed by FwmarkConnectInfo for
+    // ON_CONNECT_COMPLETE), and no longer than any batch, so that we never read past the end of a
+    // message into the next one.
+    char buffer[sizeof(FwmarkBatchHeader) +
+                FwmarkBatchHeader::MAX_COMMANDS * sizeof(FwmarkCommand)];
+    static_assert(sizeof(buffer) >= sizeof(FwmarkRequest), "buffer too small for FwmarkRequest");
+
+    iovec iov = { buffer, sizeof(FwmarkRequest) };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(FwmarkBatchHeader::MAX_COMMANDS * sizeof(int)) +
+                  CMSG_SPACE(sizeof(ucred))];
+    } cmsgu;
+
+    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+    msg.msg_control = cmsgu.cmsg;
+    msg.msg_controllen = sizeof(cmsgu.cmsg);
+
+    magic = 0;
+    const int messageLength = TEMP_FAILURE_RETRY(recvmsg(socket, &msg, 0));
+    if (messageLength == -1) {
+        return -errno;
+    }
+    if (messageLength == 0) {
+        // The client closed the connection, e.g., a process exited with a persistent one open.
+        return -ECONNRESET;
+    }
+
+    bool hasCredentials = false;
+    ucred credentials;
+    for (cmsghdr* cmsgh = CMSG_FIRSTHDR(&msg); cmsgh; cmsgh = CMSG_NXTHDR(&msg, cmsgh)) {
+        if (cmsgh->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cmsgh->cmsg_type == SCM_RIGHTS) {
+            const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsgh));
+            const size_t numFds = (cmsgh->cmsg_len - CMSG_LEN(0)) / sizeof(*received);
+            fds.insert(fds.end(), received, received + numFds);
+        } else if (cmsgh->cmsg_type == SCM_CREDENTIALS &&
+                cmsgh->cmsg_len == CMSG_LEN(sizeof(credentials))) {
+            memcpy(&credentials, CMSG_DATA(cmsgh), sizeof(credentials));
+            hasCredentials = true;
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        return -EBADMSG;
+    }
+
+    uint32_t messageMagic = 0;
+    if (messageLength == sizeof(FwmarkRequest)) {
+        memcpy(&messageMagic, buffer, sizeof(messageMagic));
+    }
+
+    if (messageMagic == FwmarkRequest::MAGIC || messageMagic == FwmarkBatchHeader::MAGIC) {
+        magic = messageMagic;
+        // The peer credentials of a socket are those it had when it connected, so a process that
+        // has dropped privileges since could use a persistent connection to act with its former
+        // UID. The kernel checks the credentials sent with each message instead.
+        if (!hasCredentials || credentials.uid != peerUid) {
+            return -EPERM;
+        }
+    }
+
+    if (messageMagic == FwmarkRequest::MAGIC) {
+        FwmarkRequest request;
+        memcpy(&request, buffer, sizeof(request));
+        requestId = request.requestId;
+        flags = request.flags;
+        commands.push_back(request.command);
+        connectInfo = request.connectInfo;
+        return 0;
+    }
+
+    if (messageMagic == FwmarkBatchHeader::MAGIC) {
+        return readBatch(socket, buffer);
+    }
+
+    FwmarkCommand command;
+    memcpy(&command, buffer, sizeof(command));
+    memcpy(&connectInfo, buffer + sizeof(command), sizeof(connectInfo));
+    commands.push_back(command);
+
+    if (!((command.cmdId != FwmarkCommand::ON_CONNECT_COMPLETE &&
+            messageLength == sizeof(command))
+            || (command.cmdId == FwmarkCommand::ON_CONNECT_COMPLETE
+            && messageLength == sizeof(command) + sizeof(connectInfo)))) {
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+int FwmarkMessage::readBatch(int socket, char* buffer) {
+    FwmarkBatchHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    requestId = header.requestId;
+    flags = header.flags;
+
+    const size_t length = std::max(sizeof(FwmarkRequest),
+                                   sizeof(header) + header.numCommands * sizeof(FwmarkCommand));
+    if (header.version != FwmarkBatchHeader::VERSION || header.numCommands == 0 ||
+            header.numCommands > FwmarkBatchHeader::MAX_COMMANDS || header.length != length) {
+        return -EBADMSG;
+    }
+
+    // The client sends the whole batch at once, so the rest of it must already be there.
+    const ssize_t remaining = length - sizeof(FwmarkRequest);
+    if (remaining > 0 && TEMP_FAILURE_RETRY(recv(socket, buffer + sizeof(FwmarkRequest),
+                                                 remaining, MSG_DONTWAIT)) != remaining) {
+        return -EBADMSG;
+    }
+
+    size_t numFds = 0;
+    commands.resize(header.numCommands);
+    for (size_t i = 0; i < header.numCommands; i++) {
+        FwmarkCommand& command = commands[i];
+        memcpy(&command, buffer + sizeof(header) + i * sizeof(command), sizeof(command));
+        if (command.cmdId == FwmarkCommand::ON_CONNECT_COMPLETE) {
+            return -EBADMSG;
+        }
+        if (command.cmdId != FwmarkCommand::QUERY_USER_ACCESS) {
+            numFds++;
+        }
+    }
+    return numFds == fds.size() ? 0 : -EBADMSG;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef NETD_SERVER_FWMARK_MESSAGE_H
+#define NETD_SERVER_FWMARK_MESSAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "FwmarkCommand.h"
+#include "NetdConstants.h"
+
+// A message from a fwmarkd client: one command, either on a connection of its own or in a
+// FwmarkRequest, or a batch of them.
+struct FwmarkMessage {
+    FwmarkMessage() : magic(0), requestId(0), flags(0) {}
+
+    // Whether the message came on a connection that is kept open between commands, i.e., it's a
+    // FwmarkRequest or a batch.
+    bool isPersistent() const {
+        return magic == FwmarkRequest::MAGIC || magic == FwmarkBatchHeader::MAGIC;
+    }
+
+    // Reads one message from |socket|, which must have SO_PASSCRED set, and whose peer had the
+    // effective UID |peerUid| when it connected. Returns 0 on success or a negative errno value if
+    // the message is malformed. Received file descriptors are stored in |fds| even on failure, so
+    // that the caller can close them.
+    int read(int socket, uid_t peerUid) WARN_UNUSED_RESULT;
+
+    // FwmarkRequest::MAGIC, FwmarkBatchHeader::MAGIC, or 0 for a one-shot command.
+    uint32_t magic;
+    uint32_t requestId;
+    uint32_t flags;
+    std::vector<FwmarkCommand> commands;
+    // Only used by ON_CONNECT_COMPLETE, which can't be batched.
+    FwmarkConnectInfo connectInfo;
+    // All the file descriptors received with the message, in order.
+    std::vector<int> fds;
+
+private:
+    int readBatch(int socket, char* buffer);
+};
+
+#endif  // NETD_SERVER_FWMARK_MESSAGE_H
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FwmarkChannel.h"
+#include "FwmarkCommand.h"
+#include "FwmarkMessage.h"
+
+class FwmarkMessageTest : public ::testing::Test {
+protected:
+    // mFds[0] is the client end, mFds[1] the server end.
+    int mFds[2];
+    // A socket to pass along with commands.
+    int mSocket;
+
+    void SetUp() override {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, mFds));
+        const int on = 1;
+        ASSERT_EQ(0, setsockopt(mFds[1], SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)));
+        mSocket = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ASSERT_NE(-1, mSocket);
+    }
+
+    void TearDown() override {
+        close(mFds[0]);
+        close(mFds[1]);
+        close(mSocket);
+    }
+
+    void sendMessage(const void* data, size_t length, size_t numFds, bool withCredentials) {
+        iovec iov = { const_cast<void*>(data), length };
+        std::vector<int> fds(numFds, mSocket);
+        ASSERT_EQ(0, FwmarkChannel::sendWithFds(mFds[0], &iov, 1, fds.data(), numFds,
+                                                withCredentials));
+    }
+
+    // Reads a message sent by the peer, and closes the file descriptors that came with it.
+    int readMessage(FwmarkMessage* message, uid_t peerUid = geteuid()) {
+        const int ret = message->read(mFds[1], peerUid);
+        for (int fd : message->fds) {
+            close(fd);
+        }
+        return ret;
+    }
+
+    static FwmarkRequest makeRequest(uint32_t requestId) {
+        FwmarkRequest request;
+        memset(&request, 0, sizeof(request));
+        request.magic = FwmarkRequest::MAGIC;
+        request.requestId = requestId;
+        request.command.cmdId = FwmarkCommand::SELECT_NETWORK;
+        request.command.netId = 100;
+        return request;
+    }
+
+    // Returns a batch of |numCommands| SELECT_NETWORK commands, padded like FwmarkChannel does.
+    static std::vector<char> makeBatch(size_t numCommands) {
+        FwmarkBatchHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = FwmarkBatchHeader::MAGIC;
+        header.version = FwmarkBatchHeader::VERSION;
+        header.numCommands = numCommands;
+        header.length = std::max(sizeof(FwmarkRequest),
+                                 sizeof(header) + numCommands * sizeof(FwmarkCommand));
+        header.requestId = 7;
+
+        std::vector<char> batch(header.length);
+        memcpy(batch.data(), &header, sizeof(header));
+        for (size_t i = 0; i < numCommands; i++) {
+            FwmarkCommand command = { FwmarkCommand::SELECT_NETWORK, 100, 0 };
+            memcpy(batch.data() + sizeof(header) + i * sizeof(command), &command,
+                   sizeof(command));
+        }
+        return batch;
+    }
+
+    static void setCommand(std::vector<char>* batch, size_t i, const FwmarkCommand& command) {
+        memcpy(batch->data() + sizeof(FwmarkBatchHeader) + i * sizeof(command), &command,
+               sizeof(command));
+    }
+};
+
+TEST_F(FwmarkMessageTest, TestReadsOneShotCommands) {
+    FwmarkCommand command = { FwmarkCommand::ON_ACCEPT, 0, 0 };
+    sendMessage(&command, sizeof(command), 1, false);
+    FwmarkMessage message;
+    EXPECT_EQ(0, readMessage(&message));
+    EXPECT_FALSE(message.isPersistent());
+    ASSERT_EQ(1U, message.commands.size());
+    EXPECT_EQ(FwmarkCommand::ON_ACCEPT, message.commands[0].cmdId);
+    EXPECT_EQ(1U, message.fds.size());
+
+    struct {
+        FwmarkCommand command;
+        FwmarkConnectInfo connectInfo;
+    } connectComplete;
+    memset(&connectComplete, 0, sizeof(connectComplete));
+    connectComplete.command.cmdId = FwmarkCommand::ON_CONNECT_COMPLETE;
+    connectComplete.connectInfo.latencyMs = 42;
+    sendMessage(&connectComplete, sizeof(connectComplete), 1, false);
+    FwmarkMessage completeMessage;
+    EXPECT_EQ(0, readMessage(&completeMessage));
+    EXPECT_EQ(42U, completeMessage.connectInfo.latencyMs);
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsShortMessages) {
+    const char garbage[3] = { 1, 2, 3 };
+    sendMessage(garbage, sizeof(garbage), 0, false);
+    FwmarkMessage message;
+    EXPECT_EQ(-EBADMSG, readMessage(&message));
+    EXPECT_FALSE(message.isPersistent());
+
+    // ON_CONNECT_COMPLETE without its FwmarkConnectInfo.
+    FwmarkCommand command = { FwmarkCommand::ON_CONNECT_COMPLETE, 0, 0 };
+    sendMessage(&command, sizeof(command), 1, false);
+    FwmarkMessage completeMessage;
+    EXPECT_EQ(-EBADMSG, readMessage(&completeMessage));
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsOversizedMessages) {
+    // Reads no more than a FwmarkRequest, and doesn't take what's left for a request.
+    std::vector<char> garbage(sizeof(FwmarkRequest) + 100, 'x');
+    sendMessage(garbage.data(), garbage.size(), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(-EBADMSG, readMessage(&message));
+    EXPECT_FALSE(message.isPersistent());
+    EXPECT_EQ(1U, message.fds.size());
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsGarbage) {
+    // As long as a FwmarkRequest, but without its magic number.
+    FwmarkRequest request = makeRequest(1);
+    request.magic = 0xdeadbeef;
+    sendMessage(&request, sizeof(request), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(-EBADMSG, readMessage(&message));
+    EXPECT_FALSE(message.isPersistent());
+}
+
+TEST_F(FwmarkMessageTest, TestReadsRequests) {
+    FwmarkRequest request = makeRequest(1234);
+    request.flags = FwmarkRequest::NO_RESPONSE;
+    sendMessage(&request, sizeof(request), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(0, readMessage(&message));
+    EXPECT_TRUE(message.isPersistent());
+    EXPECT_EQ(1234U, message.requestId);
+    EXPECT_EQ(uint32_t(FwmarkRequest::NO_RESPONSE), message.flags);
+    ASSERT_EQ(1U, message.commands.size());
+    EXPECT_EQ(100U, message.commands[0].netId);
+    EXPECT_EQ(1U, message.fds.size());
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsRequestsWithOtherCredentials) {
+    // Credentials that don't match those the connection was opened with.
+    FwmarkRequest request = makeRequest(1);
+    sendMessage(&request, sizeof(request), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(-EPERM, readMessage(&message, geteuid() + 1));
+    EXPECT_TRUE(message.isPersistent());
+
+    // No credentials at all.
+    const int off = 0;
+    ASSERT_EQ(0, setsockopt(mFds[1], SOL_SOCKET, SO_PASSCRED, &off, sizeof(off)));
+    sendMessage(&request, sizeof(request), 1, true);
+    FwmarkMessage otherMessage;
+    EXPECT_EQ(-EPERM, readMessage(&otherMessage));
+}
+
+TEST_F(FwmarkMessageTest, TestReadsBatches) {
+    // Padded to the length of a FwmarkRequest.
+    std::vector<char> batch = makeBatch(2);
+    setCommand(&batch, 0, { FwmarkCommand::QUERY_USER_ACCESS, 100, 10000 });
+    sendMessage(batch.data(), batch.size(), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(0, readMessage(&message));
+    EXPECT_TRUE(message.isPersistent());
+    EXPECT_EQ(7U, message.requestId);
+    ASSERT_EQ(2U, message.commands.size());
+    EXPECT_EQ(FwmarkCommand::QUERY_USER_ACCESS, message.commands[0].cmdId);
+    EXPECT_EQ(FwmarkCommand::SELECT_NETWORK, message.commands[1].cmdId);
+    EXPECT_EQ(1U, message.fds.size());
+
+    // Longer than a FwmarkRequest.
+    batch = makeBatch(FwmarkBatchHeader::MAX_COMMANDS);
+    sendMessage(batch.data(), batch.size(), FwmarkBatchHeader::MAX_COMMANDS, true);
+    FwmarkMessage longMessage;
+    EXPECT_EQ(0, readMessage(&longMessage));
+    const size_t maxCommands = FwmarkBatchHeader::MAX_COMMANDS;
+    EXPECT_EQ(maxCommands, longMessage.commands.size());
+    EXPECT_EQ(maxCommands, longMessage.fds.size());
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsMalformedBatches) {
+    // Wrong number of file descriptors.
+    std::vector<char> batch = makeBatch(2);
+    sendMessage(batch.data(), batch.size(), 1, true);
+    FwmarkMessage message;
+    EXPECT_EQ(-EBADMSG, readMessage(&message));
+    EXPECT_TRUE(message.isPersistent());
+
+    // ON_CONNECT_COMPLETE can't be batched.
+    batch = makeBatch(2);
+    setCommand(&batch, 1, { FwmarkCommand::ON_CONNECT_COMPLETE, 0, 0 });
+    sendMessage(batch.data(), batch.size(), 2, true);
+    FwmarkMessage completeMessage;
+    EXPECT_EQ(-EBADMSG, readMessage(&completeMessage));
+
+    // Unsupported version.
+    batch = makeBatch(2);
+    reinterpret_cast<FwmarkBatchHeader*>(batch.data())->version++;
+    sendMessage(batch.data(), batch.size(), 2, true);
+    FwmarkMessage versionMessage;
+    EXPECT_EQ(-EBADMSG, readMessage(&versionMessage));
+
+    // More commands than a batch can hold.
+    batch = makeBatch(FwmarkBatchHeader::MAX_COMMANDS + 1);
+    sendMessage(batch.data(), sizeof(FwmarkRequest), 0, true);
+    FwmarkMessage oversizedMessage;
+    EXPECT_EQ(-EBADMSG, readMessage(&oversizedMessage));
+}
+
+TEST_F(FwmarkMessageTest, TestRejectsTruncatedBatches) {
+    // The header promises more than the message holds.
+    std::vector<char> batch = makeBatch(10);
+    sendMessage(batch.data(), sizeof(FwmarkRequest), 10, true);
+    FwmarkMessage message;
+    EXPECT_EQ(-EBADMSG, readMessage(&message));
+    EXPECT_TRUE(message.isPersistent());
+}
+
+TEST_F(FwmarkMessageTest, TestReportsClosedConnections) {
+    close(mFds[0]);
+    mFds[0] = -1;
+    FwmarkMessage message;
+    EXPECT_EQ(-ECONNRESET, readMessage(&message));
+}
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "FwmarkServer"
+
 #include "FwmarkServer.h"
 
 #include "Fwmark.h"
@@ -22,28 +24,266 @@
 #include "NetworkController.h"
 #include "resolv_netid.h"
 
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <cutils/sockets.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sysutils/SocketClient.h>
 #include <unistd.h>
 #include <utils/String16.h>
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 using android::String16;
 using android::net::metrics::INetdEventListener;
 
+namespace {
+
+// Enough for the bursts of connections that happen when many apps start at once, e.g., at boot.
+const int LISTEN_BACKLOG = 64;
+const int MAX_EVENTS = 32;
+
+const auto CONNECT_EVENT_BATCH_INTERVAL = std::chrono::milliseconds(500);
+
+// INetdEventListener::onConnectEvents() is implemented by the framework, which sets this property
+// to "1" once it does. Until then, connect events are reported one by one with onConnectEvent():
+// the interface is oneway, so a call to a method the framework doesn't know fails silently.
+const char* const BATCH_CONNECT_EVENTS_PROPERTY = "persist.netd.batch_connect_events";
+
+bool batchConnectEvents() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(BATCH_CONNECT_EVENTS_PROPERTY, value, "0");
+    return !strcmp(value, "1");
+}
+
+// Reports a single connect with INetdEventListener::onConnectEvent().
+void reportOneConnectEvent(INetdEventListener* listener, unsigned netId, uid_t uid,
+                           const FwmarkConnectInfo& info) {
+    char addrstr[INET6_ADDRSTRLEN];
+    char portstr[sizeof("65536")];
+    const int ret = getnameinfo(&info.addr.s, sizeof(info.addr), addrstr, sizeof(addrstr),
+                                portstr, sizeof(portstr), NI_NUMERICHOST | NI_NUMERICSERV);
+
+    listener->onConnectEvent(netId, info.error, info.latencyMs,
+            (ret == 0) ? String16(addrstr) : String16(""),
+            (ret == 0) ? strtoul(portstr, NULL, 10) : 0, uid);
+}
+
+// Appends the destination address of |info| to |addrs| in the format of
+// INetdEventListener::onConnectEvents(), and returns its port.
+int appendAddress(const FwmarkConnectInfo& info, std::vector<int8_t>* addrs) {
+    in6_addr addr = IN6ADDR_ANY_INIT;
+    int port = 0;
+    if (info.addr.s.sa_family == AF_INET6) {
+        addr = info.addr.sin6.sin6_addr;
+        port = ntohs(info.addr.sin6.sin6_port);
+    } else if (info.addr.s.sa_family == AF_INET) {
+        addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+        memcpy(&addr.s6_addr[12], &info.addr.sin.sin_addr, sizeof(info.addr.sin.sin_addr));
+        port = ntohs(info.addr.sin.sin_port);
+    }
+    const int8_t* bytes = reinterpret_cast<const int8_t*>(addr.s6_addr);
+    addrs->insert(addrs->end(), bytes, bytes + sizeof(addr.s6_addr));
+    return port;
+}
+
+}  // namespace
+
 FwmarkServer::FwmarkServer(NetworkController* networkController, EventReporter* eventReporter) :
-        SocketListener("fwmarkd", true), mNetworkController(networkController),
-        mEventReporter(eventReporter) {
+        mNetworkController(networkController), mEventReporter(eventReporter), mListenSocket(-1),
+        mEpollFd(-1), mConnectEvents(MAX_PENDING_CONNECT_EVENTS), mDroppedConnectEvents(0) {
+}
+
+int FwmarkServer::startListener() {
+    mListenSocket = android_get_control_socket("fwmarkd");
+    if (mListenSocket < 0) {
+        ALOGE("Obtaining file descriptor socket 'fwmarkd' failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Accept connections until there are none left, without blocking.
+    const int flags = fcntl(mListenSocket, F_GETFL);
+    if (flags == -1 || fcntl(mListenSocket, F_SETFL, flags | O_NONBLOCK) == -1 ||
+            listen(mListenSocket, LISTEN_BACKLOG) == -1) {
+        ALOGE("Unable to listen on fwmarkd socket: %s", strerror(errno));
+        return -1;
+    }
+
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd == -1) {
+        ALOGE("epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mListenSocket, &event) == -1) {
+        ALOGE("Unable to poll fwmarkd socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // netd never stops serving fwmarkd, so the threads run until the process exits.
+    std::thread(&FwmarkServer::runListener, this).detach();
+    for (int i = 0; i < NUM_WORKERS; i++) {
+        std::thread(&FwmarkServer::runWorker, this).detach();
+    }
+    std::thread(&FwmarkServer::runReporter, this).detach();
+    return 0;
+}
+
+// Waits for new connections and for commands on existing ones. A client's socket is polled with
+// EPOLLONESHOT, so it is not polled again until a worker has processed the command and rearmed it.
+void FwmarkServer::runListener() {
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        const int n = epoll_wait(mEpollFd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                ALOGE("epoll_wait failed: %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            SocketClient* client = static_cast<SocketClient*>(events[i].data.ptr);
+            if (client == nullptr) {
+                acceptClients();
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mLock);
+            std::deque<SocketClient*>& queue = mReadyClients[client->getUid()];
+            if (queue.empty()) {
+                mReadyUids.push_back(client->getUid());
+            }
+            queue.push_back(client);
+            mClientReady.notify_one();
+        }
+    }
+}
+
+void FwmarkServer::acceptClients() {
+    while (true) {
+        const int fd = accept4(mListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE("accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // Have the kernel attach the sender's credentials to each message, so that they can be
+        // checked for every command on persistent connections. See FwmarkMessage::read().
+        const int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == -1) {
+            ALOGE("Unable to set SO_PASSCRED on fwmarkd client: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        SocketClient* client = new SocketClient(fd, true);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = client;
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            ALOGE("Unable to poll fwmarkd client: %s", strerror(errno));
+            client->decRef();
+        }
+    }
+}
+
+void FwmarkServer::runWorker() {
+    while (true) {
+        SocketClient* client;
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            while (mReadyUids.empty()) {
+                mClientReady.wait(lock);
+            }
+            const uid_t uid = mReadyUids.front();
+            mReadyUids.pop_front();
+            auto it = mReadyClients.find(uid);
+            client = it->second.front();
+            it->second.pop_front();
+            if (it->second.empty()) {
+                mReadyClients.erase(it);
+            } else {
+                mReadyUids.push_back(uid);
+            }
+        }
+
+        if (onDataAvailable(client)) {
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = client;
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, client->getSocket(), &event) == 0) {
+                continue;
+            }
+            ALOGE("Unable to poll fwmarkd client: %s", strerror(errno));
+            std::lock_guard<std::mutex> lock(mLock);
+            mPersistentClients.erase(client);
+        }
+        closeClient(client);
+    }
+}
+
+void FwmarkServer::closeClient(SocketClient* client) {
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, client->getSocket(), nullptr);
+    client->decRef();
 }
 
 bool FwmarkServer::onDataAvailable(SocketClient* client) {
-    int socketFd = -1;
-    int error = processClient(client, &socketFd);
-    if (socketFd >= 0) {
-        close(socketFd);
+    FwmarkMessage message;
+    std::vector<int> errors;
+    int error = message.read(client->getSocket(), client->getUid());
+    if (!error) {
+        processMessage(client->getUid(), message, &errors);
+    }
+    for (int fd : message.fds) {
+        close(fd);
+    }
+
+    bool wasPersistent;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        wasPersistent = mPersistentClients.count(client);
+    }
+    if (message.isPersistent() || wasPersistent) {
+        // Keep the connection open for further requests, unless there are too many open already or
+        // the client isn't reading its responses. In either case the client falls back to one-shot
+        // connections. A message that can't be parsed also closes the connection, without a
+        // response, because there's no telling where the next message starts, and the one-shot
+        // response would need a blocking write: a client that stopped reading could then hold up
+        // a worker forever.
+        const bool wantsResponse = !(message.flags & FwmarkRequest::NO_RESPONSE);
+        if (!error && message.isPersistent() &&
+                (!wantsResponse || sendResponses(client, message.requestId, errors))) {
+            std::lock_guard<std::mutex> lock(mLock);
+            if (wasPersistent || mPersistentClients.size() < MAX_PERSISTENT_CLIENTS) {
+                mPersistentClients.insert(client);
+                return true;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mLock);
+        mPersistentClients.erase(client);
+        return false;
     }
 
     // Always send a response even if there were connection errors or read errors, so that we don't
     // inadvertently cause the client to hang (which always waits for a response).
+    if (!error) {
+        error = errors[0];
+    }
     client->sendData(&error, sizeof(error));
 
     // Always close the client connection (by returning false). This prevents a DoS attack where
@@ -52,61 +292,52 @@ bool FwmarkServer::onDataAvailable(SocketClient* client) {
     return false;
 }
 
-int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
-    FwmarkCommand command;
-    FwmarkConnectInfo connectInfo;
-
-    iovec iov[2] = {
-        { &command, sizeof(command) },
-        { &connectInfo, sizeof(connectInfo) },
-    };
-    msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = iov;
-    message.msg_iovlen = ARRAY_SIZE(iov);
-
-    union {
-        cmsghdr cmh;
-        char cmsg[CMSG_SPACE(sizeof(*socketFd))];
-    } cmsgu;
-
-    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
-    message.msg_control = cmsgu.cmsg;
-    message.msg_controllen = sizeof(cmsgu.cmsg);
-
-    int messageLength = TEMP_FAILURE_RETRY(recvmsg(client->getSocket(), &message, 0));
-    if (messageLength <= 0) {
-        return -errno;
+bool FwmarkServer::sendResponses(SocketClient* client, uint32_t requestId,
+                                 const std::vector<int>& errors) {
+    // Unlike client->sendData(), never block: a client that issues commands on a persistent
+    // connection without reading the responses only gets its connection closed.
+    std::vector<FwmarkResponse> responses;
+    responses.reserve(errors.size());
+    for (int error : errors) {
+        responses.push_back({requestId, error});
     }
+    const ssize_t length = responses.size() * sizeof(responses[0]);
+    return TEMP_FAILURE_RETRY(send(client->getSocket(), responses.data(), length,
+                                   MSG_DONTWAIT | MSG_NOSIGNAL)) == length;
+}
 
-    if (!((command.cmdId != FwmarkCommand::ON_CONNECT_COMPLETE && messageLength == sizeof(command))
-            || (command.cmdId == FwmarkCommand::ON_CONNECT_COMPLETE
-            && messageLength == sizeof(command) + sizeof(connectInfo)))) {
-        return -EBADMSG;
+void FwmarkServer::processMessage(uid_t uid, const FwmarkMessage& message,
+                                  std::vector<int>* errors) {
+    const NetworkController::Snapshot snapshot(*mNetworkController);
+    size_t nextFd = 0;
+    for (const FwmarkCommand& command : message.commands) {
+        int socketFd = -1;
+        if (command.cmdId != FwmarkCommand::QUERY_USER_ACCESS && nextFd < message.fds.size()) {
+            socketFd = message.fds[nextFd++];
+        }
+        errors->push_back(processCommand(snapshot, uid, command, message.connectInfo, socketFd));
     }
+}
 
-    Permission permission = mNetworkController->getPermissionForUser(client->getUid());
+int FwmarkServer::processCommand(const NetworkController::Snapshot& networkController, uid_t uid,
+                                 const FwmarkCommand& command,
+                                 const FwmarkConnectInfo& connectInfo, int socketFd) {
+    Permission permission = networkController.getPermissionForUser(uid);
 
     if (command.cmdId == FwmarkCommand::QUERY_USER_ACCESS) {
         if ((permission & PERMISSION_SYSTEM) != PERMISSION_SYSTEM) {
             return -EPERM;
         }
-        return mNetworkController->checkUserNetworkAccess(command.uid, command.netId);
+        return networkController.checkUserNetworkAccess(command.uid, command.netId);
     }
 
-    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
-    if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS &&
-        cmsgh->cmsg_len == CMSG_LEN(sizeof(*socketFd))) {
-        memcpy(socketFd, CMSG_DATA(cmsgh), sizeof(*socketFd));
-    }
-
-    if (*socketFd < 0) {
+    if (socketFd < 0) {
         return -EBADF;
     }
 
     Fwmark fwmark;
     socklen_t fwmarkLen = sizeof(fwmark.intValue);
-    if (getsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1) {
+    if (getsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1) {
         return -errno;
     }
 
@@ -152,11 +383,15 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
             //
             // So, overall (when the explicit bit is not set but the protect bit is set), if the
             // existing NetId is a VPN, don't reset it. Else, set the default network's NetId.
+            if (fwmark.isUnchangedByConnect(permission)) {
+                // Nothing to do. NetdClient doesn't even send the command in some of these cases.
+                return 0;
+            }
             if (!fwmark.explicitlySelected) {
                 if (!fwmark.protectedFromVpn) {
-                    fwmark.netId = mNetworkController->getNetworkForConnect(client->getUid());
-                } else if (!mNetworkController->isVirtualNetwork(fwmark.netId)) {
-                    fwmark.netId = mNetworkController->getDefaultNetwork();
+                    fwmark.netId = networkController.getNetworkForConnect(uid);
+                } else if (!networkController.isVirtualNetwork(fwmark.netId)) {
+                    fwmark.netId = networkController.getDefaultNetwork();
                 }
             }
             break;
@@ -165,31 +400,9 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         case FwmarkCommand::ON_CONNECT_COMPLETE: {
             // Called after a socket connect() completes.
             // This reports connect event including netId, destination IP address, destination port,
-            // uid, connect latency, and connect errno if any.
-
-            // Skip reporting if connect() happened on a UDP socket.
-            int socketProto;
-            socklen_t intSize = sizeof(socketProto);
-            const int ret = getsockopt(*socketFd, SOL_SOCKET, SO_PROTOCOL, &socketProto, &intSize);
-            if ((ret != 0) || (socketProto == IPPROTO_UDP)) {
-                break;
-            }
-
-            android::sp<android::net::metrics::INetdEventListener> netdEventListener =
-                    mEventReporter->getNetdEventListener();
-
-            if (netdEventListener != nullptr) {
-                char addrstr[INET6_ADDRSTRLEN];
-                char portstr[sizeof("65536")];
-                const int ret = getnameinfo((sockaddr*) &connectInfo.addr, sizeof(connectInfo.addr),
-                        addrstr, sizeof(addrstr), portstr, sizeof(portstr),
-                        NI_NUMERICHOST | NI_NUMERICSERV);
-
-                netdEventListener->onConnectEvent(fwmark.netId, connectInfo.error,
-                        connectInfo.latencyMs,
-                        (ret == 0) ? String16(addrstr) : String16(""),
-                        (ret == 0) ? strtoul(portstr, NULL, 10) : 0, client->getUid());
-            }
+            // uid, connect latency, and connect errno if any. Clients don't send this command for
+            // UDP sockets, so there's no need to check the socket's protocol here.
+            reportConnectEvent(fwmark.netId, uid, connectInfo);
             break;
         }
 
@@ -200,18 +413,17 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
                 fwmark.protectedFromVpn = false;
                 permission = PERMISSION_NONE;
             } else {
-                if (int ret = mNetworkController->checkUserNetworkAccess(client->getUid(),
-                                                                         command.netId)) {
+                if (int ret = networkController.checkUserNetworkAccess(uid, command.netId)) {
                     return ret;
                 }
                 fwmark.explicitlySelected = true;
-                fwmark.protectedFromVpn = mNetworkController->canProtect(client->getUid());
+                fwmark.protectedFromVpn = networkController.canProtect(uid);
             }
             break;
         }
 
         case FwmarkCommand::PROTECT_FROM_VPN: {
-            if (!mNetworkController->canProtect(client->getUid())) {
+            if (!networkController.canProtect(uid)) {
                 return -EPERM;
             }
             // If a bypassable VPN's provider app calls connect() and then protect(), it will end up
@@ -220,8 +432,8 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
             //
             // In any case, it's appropriate that if the socket has an implicit VPN NetId mark, the
             // PROTECT_FROM_VPN command should unset it.
-            if (!fwmark.explicitlySelected && mNetworkController->isVirtualNetwork(fwmark.netId)) {
-                fwmark.netId = mNetworkController->getDefaultNetwork();
+            if (!fwmark.explicitlySelected && networkController.isVirtualNetwork(fwmark.netId)) {
+                fwmark.netId = networkController.getDefaultNetwork();
             }
             fwmark.protectedFromVpn = true;
             permission = static_cast<Permission>(permission | fwmark.permission);
@@ -232,7 +444,7 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
             if ((permission & PERMISSION_SYSTEM) != PERMISSION_SYSTEM) {
                 return -EPERM;
             }
-            fwmark.netId = mNetworkController->getNetworkForUser(command.uid);
+            fwmark.netId = networkController.getNetworkForUser(command.uid);
             fwmark.protectedFromVpn = true;
             break;
         }
@@ -245,10 +457,76 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
 
     fwmark.permission = permission;
 
-    if (setsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
+    if (setsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
                    sizeof(fwmark.intValue)) == -1) {
         return -errno;
     }
 
     return 0;
 }
+
+void FwmarkServer::reportConnectEvent(unsigned netId, uid_t uid, const FwmarkConnectInfo& info) {
+    if (!mConnectEvents.push({netId, uid, info})) {
+        mDroppedConnectEvents++;
+        return;
+    }
+    // Notifying without holding mEventsLock may miss the reporter thread just as it goes to sleep,
+    // but then it wakes up after CONNECT_EVENT_BATCH_INTERVAL anyway.
+    if (mConnectEvents.size() >= CONNECT_EVENT_BATCH_SIZE) {
+        mEventsAvailable.notify_one();
+    }
+}
+
+void FwmarkServer::runReporter() {
+    std::vector<int32_t> netIds, errors, latenciesMs, ports, uids;
+    std::vector<int8_t> addrs;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mEventsLock);
+            mEventsAvailable.wait_for(lock, CONNECT_EVENT_BATCH_INTERVAL, [this] {
+                return mConnectEvents.size() >= CONNECT_EVENT_BATCH_SIZE;
+            });
+        }
+
+        if (const unsigned dropped = mDroppedConnectEvents.exchange(0)) {
+            ALOGW("Dropped %u connect events", dropped);
+        }
+
+        ConnectEvent event;
+        if (!batchConnectEvents()) {
+            android::sp<INetdEventListener> netdEventListener =
+                    mEventReporter->getNetdEventListener();
+            while (mConnectEvents.pop(&event)) {
+                if (netdEventListener != nullptr) {
+                    reportOneConnectEvent(netdEventListener.get(), event.netId, event.uid,
+                                          event.info);
+                }
+            }
+            continue;
+        }
+        while (true) {
+            netIds.clear();
+            errors.clear();
+            latenciesMs.clear();
+            addrs.clear();
+            ports.clear();
+            uids.clear();
+            while (netIds.size() < CONNECT_EVENT_BATCH_SIZE && mConnectEvents.pop(&event)) {
+                netIds.push_back(event.netId);
+                errors.push_back(event.info.error);
+                latenciesMs.push_back(event.info.latencyMs);
+                ports.push_back(appendAddress(event.info, &addrs));
+                uids.push_back(event.uid);
+            }
+            if (netIds.empty()) {
+                break;
+            }
+
+            android::sp<INetdEventListener> netdEventListener =
+                    mEventReporter->getNetdEventListener();
+            if (netdEventListener != nullptr) {
+                netdEventListener->onConnectEvents(netIds, errors, latenciesMs, addrs, ports, uids);
+            }
+        }
+    }
+}
@@ -19,23 +19,102 @@
 
 #include "android/net/metrics/INetdEventListener.h"
 #include "EventReporter.h"
-#include "sysutils/SocketListener.h"
+#include "FwmarkCommand.h"
+#include "FwmarkMessage.h"
+#include "NetworkController.h"
+#include "RingBuffer.h"
 
-class NetworkController;
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
 
-class FwmarkServer : public SocketListener {
+class SocketClient;
+
+// Marks sockets on behalf of libnetd_client. One thread waits for connections and commands on the
+// fwmarkd socket, and hands the commands to a pool of worker threads, so that a slow command
+// doesn't hold up the others. Connect events are reported to the framework from yet another
+// thread, so that marking sockets never waits for a binder call. They are sent in batches if the
+// framework supports it.
+class FwmarkServer {
 public:
     explicit FwmarkServer(NetworkController* networkController, EventReporter* eventReporter);
 
+    // Starts serving the fwmarkd socket created by init. Returns 0 on success, or -1 with errno
+    // set on failure.
+    int startListener();
+
 private:
-    // Overridden from SocketListener:
+    static const int NUM_WORKERS = 4;
+
+    // Clients whose connections are kept open between commands. Each one uses up a file descriptor
+    // in netd for as long as the client process lives, so there can only be so many of them.
+    static const size_t MAX_PERSISTENT_CLIENTS = 256;
+
+    // Connect events waiting to be reported. Further events are dropped until the reporter thread
+    // catches up. Must be a power of two.
+    static const size_t MAX_PENDING_CONNECT_EVENTS = 1024;
+
+    // The reporter thread reports connect events once this many are pending, or at regular
+    // intervals, whichever comes first.
+    static const size_t CONNECT_EVENT_BATCH_SIZE = 256;
+
+    struct ConnectEvent {
+        unsigned netId;
+        uid_t uid;
+        FwmarkConnectInfo info;
+    };
+
+    void runListener();
+    void runWorker();
+    void runReporter();
+    void acceptClients();
+    void closeClient(SocketClient* client);
+
+    // Processes one message from |client|. Returns true if the connection should be kept open.
     bool onDataAvailable(SocketClient* client);
 
+    // Processes the commands in |message| in order, all against the same snapshot of the network
+    // configuration, and appends their results to |errors|.
+    void processMessage(uid_t uid, const FwmarkMessage& message, std::vector<int>* errors);
+
     // Returns 0 on success or a negative errno value on failure.
-    int processClient(SocketClient* client, int* socketFd);
+    int processCommand(const NetworkController::Snapshot& networkController, uid_t uid,
+                       const FwmarkCommand& command, const FwmarkConnectInfo& connectInfo,
+                       int socketFd);
+
+    // Sends one FwmarkResponse for each of |errors|. Returns true if the responses were sent and
+    // the connection can be kept open.
+    bool sendResponses(SocketClient* client, uint32_t requestId, const std::vector<int>& errors);
+
+    void reportConnectEvent(unsigned netId, uid_t uid, const FwmarkConnectInfo& info);
 
     NetworkController* const mNetworkController;
     EventReporter* mEventReporter;
+    int mListenSocket;
+    int mEpollFd;
+
+    // Guards the members below, up to mPersistentClients.
+    std::mutex mLock;
+    std::condition_variable mClientReady;
+    // Clients with a command waiting to be processed, by UID, and the UIDs that have such clients,
+    // in the order that the workers serve them. Workers take one client per UID in turn, so that an
+    // app that sends many commands at once delays the commands of other apps by one each at most.
+    std::map<uid_t, std::deque<SocketClient*>> mReadyClients;
+    std::deque<uid_t> mReadyUids;
+    // Clients that have sent a FwmarkRequest or a batch. Their connections are never answered in
+    // the one-shot format, and never with a blocking write.
+    std::set<SocketClient*> mPersistentClients;
+
+    // Workers push connect events without locking. mEventsLock and mEventsAvailable only serve to
+    // wake up the reporter thread when a batch is ready.
+    RingBuffer<ConnectEvent> mConnectEvents;
+    std::atomic<unsigned> mDroppedConnectEvents;
+    std::mutex mEventsLock;
+    std::condition_variable mEventsAvailable;
 };
 
 #endif  // NETD_SERVER_FWMARK_SERVER_H
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Fwmark.h"
+
+namespace {
+
+const Permission kPermissions[] = { PERMISSION_NONE, PERMISSION_NETWORK, PERMISSION_SYSTEM };
+
+std::vector<Fwmark> allMarks() {
+    std::vector<Fwmark> marks;
+    for (unsigned netId : { 0, 100, 65535 }) {
+        for (bool explicitlySelected : { false, true }) {
+            for (bool protectedFromVpn : { false, true }) {
+                for (Permission permission : kPermissions) {
+                    Fwmark fwmark;
+                    fwmark.netId = netId;
+                    fwmark.explicitlySelected = explicitlySelected;
+                    fwmark.protectedFromVpn = protectedFromVpn;
+                    fwmark.permission = permission;
+                    marks.push_back(fwmark);
+                }
+            }
+        }
+    }
+    return marks;
+}
+
+// What FwmarkServer does on ON_CONNECT for a socket whose network was explicitly selected.
+Fwmark markAfterConnectToExplicitNetwork(Fwmark fwmark, Permission uidPermission) {
+    fwmark.permission = uidPermission;
+    return fwmark;
+}
+
+}  // namespace
+
+TEST(FwmarkTest, TestIsUnchangedByConnect) {
+    for (const Fwmark& fwmark : allMarks()) {
+        for (Permission uidPermission : kPermissions) {
+            SCOPED_TRACE(testing::Message() << "mark=0x" << std::hex << fwmark.intValue
+                                            << " uidPermission=" << uidPermission);
+            if (!fwmark.explicitlySelected) {
+                // The server may pick a different network, so it must always be asked.
+                EXPECT_FALSE(fwmark.isUnchangedByConnect(uidPermission));
+                continue;
+            }
+            const Fwmark expected = markAfterConnectToExplicitNetwork(fwmark, uidPermission);
+            EXPECT_EQ(expected.intValue == fwmark.intValue,
+                      fwmark.isUnchangedByConnect(uidPermission));
+        }
+    }
+}
+
+TEST(FwmarkTest, TestClientSkipNeverGrantsPermission) {
+    // NetdClient doesn't know the permission of its UID, and skips ON_CONNECT if the mark is
+    // unchanged for PERMISSION_NONE. Check that the socket then never ends up with permission bits
+    // or a network that the server would not have given it.
+    for (const Fwmark& fwmark : allMarks()) {
+        if (!fwmark.isUnchangedByConnect(PERMISSION_NONE)) {
+            continue;
+        }
+        for (Permission uidPermission : kPermissions) {
+            const Fwmark expected = markAfterConnectToExplicitNetwork(fwmark, uidPermission);
+            EXPECT_EQ(expected.netId, fwmark.netId);
+            EXPECT_EQ(expected.explicitlySelected, fwmark.explicitlySelected);
+            EXPECT_EQ(expected.protectedFromVpn, fwmark.protectedFromVpn);
+            EXPECT_EQ(0U, fwmark.permission & ~expected.permission);
+        }
+    }
+}
@@ -112,6 +112,10 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> & /* args */) {
     dw.blankline();
     gCtls->netCtrl.dump(dw);
     dw.blankline();
+    gCtls->dnsQueryPool.dump(dw);
+    dw.blankline();
+    gCtls->getAddrInfoCoalescer.dump(dw);
+    dw.blankline();
 
     return NO_ERROR;
 }
@@ -179,7 +183,7 @@ binder::Status NetdNativeService::socketDestroy(const std::vector<UidRange>& uid
 
     UidRanges uidRanges(uids);
     int err = sd.destroySockets(uidRanges, std::set<uid_t>(skipUids.begin(), skipUids.end()),
-                                true /* excludeLoopback */);
+                                true /* excludeLoopback */, SockDiag::PROTO_ALL);
 
     if (err) {
         return binder::Status::fromServiceSpecificError(-err,
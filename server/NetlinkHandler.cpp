@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 #define LOG_TAG "Netd"
 
@@ -29,11 +30,25 @@
 #include "NetlinkHandler.h"
 #include "NetlinkManager.h"
 #include "ResponseCode.h"
-#include "SockDiag.h"
+#include "RouteController.h"
 
 static const char *kUpdated = "updated";
 static const char *kRemoved = "removed";
 
+// Returns the IFINDEX parameter of |evt|, or 0 if it doesn't have a valid one.
+static unsigned parseIfIndex(NetlinkEvent *evt) {
+    const char *ifindex = evt->findParam("IFINDEX");
+    if (!ifindex) {
+        return 0;
+    }
+    char *end;
+    unsigned long index = strtoul(ifindex, &end, 10);
+    if (*end || index > UINT_MAX) {
+        return 0;
+    }
+    return index;
+}
+
 NetlinkHandler::NetlinkHandler(NetlinkManager *nm, int listenerSocket,
                                int format) :
                         NetlinkListener(listenerSocket, format) {
@@ -62,9 +77,15 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
         NetlinkEvent::Action action = evt->getAction();
         const char *iface = evt->findParam("INTERFACE");
 
+        // Update the interface index cache before telling the framework, so that any routing
+        // changes it makes in response see the new index. The kernel's add and remove events
+        // carry the index of the interface they're about; use that rather than asking the kernel
+        // again, since by now the name may belong to a different interface.
         if (action == NetlinkEvent::Action::kAdd) {
+            RouteController::updateInterfaceIndex(iface, parseIfIndex(evt));
             notifyInterfaceAdded(iface);
         } else if (action == NetlinkEvent::Action::kRemove) {
+            RouteController::removeInterfaceIndex(iface, parseIfIndex(evt));
             notifyInterfaceRemoved(iface);
         } else if (action == NetlinkEvent::Action::kChange) {
             evt->dump();
@@ -80,22 +101,9 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
             const char *scope = evt->findParam("SCOPE");
             if (action == NetlinkEvent::Action::kAddressRemoved && iface && address) {
                 // Note: if this interface was deleted, iface is "" and we don't notify.
-                SockDiag sd;
-                if (sd.open()) {
-                    char addrstr[INET6_ADDRSTRLEN];
-                    strncpy(addrstr, address, sizeof(addrstr));
-                    char *slash = strchr(addrstr, '/');
-                    if (slash) {
-                        *slash = '\0';
-                    }
-
-                    int ret = sd.destroySockets(addrstr);
-                    if (ret < 0) {
-                        ALOGE("Error destroying sockets: %s", strerror(ret));
-                    }
-                } else {
-                    ALOGE("Error opening NETLINK_SOCK_DIAG socket: %s", strerror(errno));
-                }
+                std::string addrstr(address);
+                addrstr = addrstr.substr(0, addrstr.find('/'));
+                mNm->destroySocketsOnAddress(addrstr);
             }
             if (iface && iface[0] && address && flags && scope) {
                 notifyAddressChanged(action, address, iface, flags, scope);
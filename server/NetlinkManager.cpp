@@ -41,8 +41,12 @@
 
 #include <arpa/inet.h>
 
+#include <algorithm>
+#include <chrono>
+
 #include "NetlinkManager.h"
 #include "NetlinkHandler.h"
+#include "SockDiag.h"
 
 #include "pcap-netfilter-linux-android.h"
 
@@ -51,6 +55,17 @@ const int NetlinkManager::NETFILTER_STRICT_GROUP = 2;
 
 NetlinkManager *NetlinkManager::sInstance = NULL;
 
+namespace {
+
+// How long to wait after an address is removed for more removals, so that they can all be handled
+// in one socket sweep.
+constexpr std::chrono::milliseconds ADDRESS_SWEEP_DELAY(20);
+
+// Keeps the SOCK_DIAG bytecode for each sweep well within its 64 KiB limit.
+constexpr size_t MAX_ADDRESSES_PER_SWEEP = 256;
+
+}  // namespace
+
 NetlinkManager *NetlinkManager::Instance() {
     if (!sInstance)
         sInstance = new NetlinkManager();
@@ -59,6 +74,7 @@ NetlinkManager *NetlinkManager::Instance() {
 
 NetlinkManager::NetlinkManager() {
     mBroadcaster = NULL;
+    mStopSweeps = false;
 }
 
 NetlinkManager::~NetlinkManager() {
@@ -125,6 +141,9 @@ NetlinkHandler *NetlinkManager::setupSocket(int *sock, int netlinkFamily,
 }
 
 int NetlinkManager::start() {
+    mStopSweeps = false;
+    mSweepThread = std::thread(&NetlinkManager::runAddressSweeps, this);
+
     if ((mUeventHandler = setupSocket(&mUeventSock, NETLINK_KOBJECT_UEVENT,
          0xffffffff, NetlinkListener::NETLINK_FORMAT_ASCII, false)) == NULL) {
         return -1;
@@ -158,6 +177,15 @@ int NetlinkManager::start() {
 int NetlinkManager::stop() {
     int status = 0;
 
+    {
+        std::lock_guard<std::mutex> lock(mRemovedAddressesLock);
+        mStopSweeps = true;
+    }
+    mRemovedAddressesCv.notify_one();
+    if (mSweepThread.joinable()) {
+        mSweepThread.join();
+    }
+
     if (mUeventHandler->stop()) {
         ALOGE("Unable to stop uevent NetlinkHandler: %s", strerror(errno));
         status = -1;
@@ -208,3 +236,53 @@ int NetlinkManager::stop() {
 
     return status;
 }
+
+void NetlinkManager::destroySocketsOnAddress(const std::string& address) {
+    {
+        std::lock_guard<std::mutex> lock(mRemovedAddressesLock);
+        mRemovedAddresses.insert(address);
+    }
+    mRemovedAddressesCv.notify_one();
+}
+
+void NetlinkManager::runAddressSweeps() {
+    std::unique_lock<std::mutex> lock(mRemovedAddressesLock);
+    while (true) {
+        mRemovedAddressesCv.wait(lock, [this] {
+            return mStopSweeps || !mRemovedAddresses.empty();
+        });
+        // Give the other addresses of the same interface a chance to arrive.
+        mRemovedAddressesCv.wait_for(lock, ADDRESS_SWEEP_DELAY, [this] { return mStopSweeps; });
+        if (mStopSweeps) {
+            return;
+        }
+
+        std::vector<std::string> addresses(mRemovedAddresses.begin(), mRemovedAddresses.end());
+        mRemovedAddresses.clear();
+        lock.unlock();
+        sweepAddresses(addresses);
+        lock.lock();
+    }
+}
+
+void NetlinkManager::sweepAddresses(const std::vector<std::string>& addresses) {
+    for (size_t i = 0; i < addresses.size(); i += MAX_ADDRESSES_PER_SWEEP) {
+        if (!mSockDiag) {
+            mSockDiag.reset(new SockDiag());
+            if (!mSockDiag->open()) {
+                ALOGE("Error opening NETLINK_SOCK_DIAG socket: %s", strerror(errno));
+                mSockDiag.reset();
+                return;
+            }
+        }
+
+        const size_t end = std::min(i + MAX_ADDRESSES_PER_SWEEP, addresses.size());
+        const std::vector<std::string> batch(addresses.begin() + i, addresses.begin() + end);
+        int ret = mSockDiag->destroySockets(batch, SockDiag::PROTO_ALL);
+        if (ret < 0) {
+            ALOGE("Error destroying sockets: %s", strerror(-ret));
+            // A failed dump can leave messages unread on the socket. Start afresh next time.
+            mSockDiag.reset();
+        }
+    }
+}
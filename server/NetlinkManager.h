@@ -17,11 +17,20 @@
 #ifndef _NETLINKMANAGER_H
 #define _NETLINKMANAGER_H
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <sysutils/SocketListener.h>
 #include <sysutils/NetlinkListener.h>
 
 
 class NetlinkHandler;
+class SockDiag;
 
 class NetlinkManager {
 private:
@@ -38,6 +47,14 @@ private:
     int                  mQuotaSock;
     int                  mStrictSock;
 
+    // Addresses removed since the last socket sweep, and the SockDiag used for the sweeps.
+    std::mutex              mRemovedAddressesLock;
+    std::condition_variable mRemovedAddressesCv;
+    std::set<std::string>   mRemovedAddresses;
+    bool                    mStopSweeps;
+    std::thread             mSweepThread;
+    std::unique_ptr<SockDiag> mSockDiag;
+
 public:
     virtual ~NetlinkManager();
 
@@ -47,6 +64,12 @@ public:
     void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
     SocketListener *getBroadcaster() { return mBroadcaster; }
 
+    // Destroys the sockets on |address|, which was removed from an interface. This happens on a
+    // separate thread, which waits a short while for more addresses to be removed (e.g., all the
+    // addresses of an interface that went down) and then destroys the sockets on all of them in
+    // one sweep.
+    void destroySocketsOnAddress(const std::string& address);
+
     static NetlinkManager *Instance();
 
     /* Group used by xt_quota2 */
@@ -58,5 +81,7 @@ private:
     NetlinkManager();
     NetlinkHandler* setupSocket(int *sock, int netlinkFamily, int groups,
         int format, bool configNflog);
+    void runAddressSweeps();
+    void sweepAddresses(const std::vector<std::string>& addresses);
 };
 #endif
@@ -45,6 +45,7 @@
 #include "LocalNetwork.h"
 #include "PhysicalNetwork.h"
 #include "RouteController.h"
+#include "Stopwatch.h"
 #include "VirtualNetwork.h"
 
 namespace {
@@ -134,9 +135,41 @@ int NetworkController::DelegateImpl::modifyFallthrough(const std::string& physic
     return 0;
 }
 
+NetworkController::Snapshot::Snapshot(const NetworkController& controller) :
+        mController(controller), mLock(controller.mRWLock) {
+}
+
+unsigned NetworkController::Snapshot::getDefaultNetwork() const {
+    return mController.mDefaultNetId;
+}
+
+unsigned NetworkController::Snapshot::getNetworkForUser(uid_t uid) const {
+    return mController.getNetworkForUserLocked(uid);
+}
+
+unsigned NetworkController::Snapshot::getNetworkForConnect(uid_t uid) const {
+    return mController.getNetworkForConnectLocked(uid);
+}
+
+bool NetworkController::Snapshot::isVirtualNetwork(unsigned netId) const {
+    return mController.isVirtualNetworkLocked(netId);
+}
+
+Permission NetworkController::Snapshot::getPermissionForUser(uid_t uid) const {
+    return mController.getPermissionForUserLocked(uid);
+}
+
+int NetworkController::Snapshot::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
+    return mController.checkUserNetworkAccessLocked(uid, netId);
+}
+
+bool NetworkController::Snapshot::canProtect(uid_t uid) const {
+    return mController.canProtectLocked(uid);
+}
+
 NetworkController::NetworkController() :
         mDelegateImpl(new NetworkController::DelegateImpl(this)), mDefaultNetId(NETID_UNSET),
-        mProtectableUsers({AID_VPN}) {
+        mLastDefaultSwitchMs(0), mProtectableUsers({AID_VPN}) {
     mNetworks[LOCAL_NET_ID] = new LocalNetwork(LOCAL_NET_ID);
     mNetworks[DUMMY_NET_ID] = new DummyNetwork(DUMMY_NET_ID);
 }
@@ -153,6 +186,9 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
         return 0;
     }
 
+    Stopwatch s;
+
+    PhysicalNetwork* newDefault = nullptr;
     if (netId != NETID_UNSET) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -163,22 +199,51 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
             ALOGE("cannot set default to non-physical network with netId %u", netId);
             return -EINVAL;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->addAsDefault()) {
-            return ret;
-        }
+        newDefault = static_cast<PhysicalNetwork*>(network);
     }
 
+    PhysicalNetwork* oldDefault = nullptr;
     if (mDefaultNetId != NETID_UNSET) {
         Network* network = getNetworkLocked(mDefaultNetId);
         if (!network || network->getType() != Network::PHYSICAL) {
             ALOGE("cannot find previously set default network with netId %u", mDefaultNetId);
             return -ESRCH;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->removeAsDefault()) {
+        oldDefault = static_cast<PhysicalNetwork*>(network);
+    }
+
+    // Add the new default rules before removing the old ones, and send them to the kernel in one
+    // transaction, so that there is no window in which both or neither network is the default, and
+    // a failure leaves the old default in place.
+    RouteController::Transaction transaction;
+    if (newDefault) {
+        if (int ret = newDefault->addAsDefault()) {
             return ret;
         }
     }
+    if (oldDefault) {
+        if (int ret = oldDefault->removeAsDefault()) {
+            if (newDefault) {
+                newDefault->resetDefaultState(false);
+            }
+            return ret;
+        }
+    }
+    if (int ret = transaction.commit()) {
+        ALOGE("failed to switch default network from netId %u to %u (%s)", mDefaultNetId, netId,
+              strerror(-ret));
+        if (newDefault) {
+            newDefault->resetDefaultState(false);
+        }
+        if (oldDefault) {
+            oldDefault->resetDefaultState(true);
+        }
+        return ret;
+    }
 
+    mLastDefaultSwitchMs = s.timeTaken();
+    ALOGI("Switched default network from netId %u to %u in %.1f ms", mDefaultNetId, netId,
+          mLastDefaultSwitchMs);
     mDefaultNetId = netId;
     return 0;
 }
@@ -224,10 +289,7 @@ uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
 // the VPN that applies to the UID if any; otherwise, the default network.
 unsigned NetworkController::getNetworkForUser(uid_t uid) const {
     android::RWLock::AutoRLock lock(mRWLock);
-    if (VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid)) {
-        return virtualNetwork->getNetId();
-    }
-    return mDefaultNetId;
+    return getNetworkForUserLocked(uid);
 }
 
 // Returns the NetId that will be set when a socket connect()s. This is the bypassable VPN that
@@ -246,11 +308,7 @@ unsigned NetworkController::getNetworkForUser(uid_t uid) const {
 // will stop working.
 unsigned NetworkController::getNetworkForConnect(uid_t uid) const {
     android::RWLock::AutoRLock lock(mRWLock);
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && !virtualNetwork->isSecure()) {
-        return virtualNetwork->getNetId();
-    }
-    return mDefaultNetId;
+    return getNetworkForConnectLocked(uid);
 }
 
 void NetworkController::getNetworkContext(
@@ -307,8 +365,7 @@ unsigned NetworkController::getNetworkForInterface(const char* interface) const
 
 bool NetworkController::isVirtualNetwork(unsigned netId) const {
     android::RWLock::AutoRLock lock(mRWLock);
-    Network* network = getNetworkLocked(netId);
-    return network && network->getType() == Network::VIRTUAL;
+    return isVirtualNetworkLocked(netId);
 }
 
 int NetworkController::createPhysicalNetwork(unsigned netId, Permission permission) {
@@ -442,6 +499,10 @@ int NetworkController::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
 int NetworkController::setPermissionForNetworks(Permission permission,
                                                 const std::vector<unsigned>& netIds) {
     android::RWLock::AutoWLock lock(mRWLock);
+
+    // Validate all the networks before changing any of them, so that an invalid netId does not
+    // leave the request half-applied.
+    std::vector<PhysicalNetwork*> physicalNetworks;
     for (unsigned netId : netIds) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -452,12 +513,36 @@ int NetworkController::setPermissionForNetworks(Permission permission,
             ALOGE("cannot set permissions on non-physical network with netId %u", netId);
             return -EINVAL;
         }
+        physicalNetworks.push_back(static_cast<PhysicalNetwork*>(network));
+    }
 
-        if (int ret = static_cast<PhysicalNetwork*>(network)->setPermission(permission)) {
-            return ret;
+    // Only networks that have interfaces and whose permission actually changes have sockets that
+    // need to be destroyed.
+    std::set<unsigned> affectedNetIds;
+    for (PhysicalNetwork* network : physicalNetworks) {
+        if (network->getPermission() != permission && !network->getInterfaces().empty()) {
+            affectedNetIds.insert(network->getNetId());
         }
     }
-    return 0;
+
+    // Destroy the sockets of all affected networks in one sweep before changing the routing rules,
+    // while the sockets can still send RST packets, and then again afterwards in case any sockets
+    // were opened in between. See PhysicalNetwork::setPermission().
+    PhysicalNetwork::destroySocketsLackingPermission(affectedNetIds, permission);
+    // If a network fails to change, stop there, but still run the second sweep on the networks
+    // that did change.
+    std::set<unsigned> changedNetIds;
+    int ret = 0;
+    for (PhysicalNetwork* network : physicalNetworks) {
+        if ((ret = network->setPermissionKeepingSockets(permission))) {
+            break;
+        }
+        if (affectedNetIds.count(network->getNetId())) {
+            changedNetIds.insert(network->getNetId());
+        }
+    }
+    PhysicalNetwork::destroySocketsLackingPermission(changedNetIds, permission);
+    return ret;
 }
 
 int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRanges) {
@@ -507,8 +592,7 @@ int NetworkController::removeRoute(unsigned netId, const char* interface, const
 
 bool NetworkController::canProtect(uid_t uid) const {
     android::RWLock::AutoRLock lock(mRWLock);
-    return ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
-           mProtectableUsers.find(uid) != mProtectableUsers.end();
+    return canProtectLocked(uid);
 }
 
 void NetworkController::allowProtect(const std::vector<uid_t>& uids) {
@@ -531,6 +615,7 @@ void NetworkController::dump(DumpWriter& dw) {
 
     dw.incIndent();
     dw.println("Default network: %u", mDefaultNetId);
+    dw.println("Last default network switch: %.1f ms", mLastDefaultSwitchMs);
 
     dw.blankline();
     dw.println("Networks:");
@@ -576,6 +661,26 @@ VirtualNetwork* NetworkController::getVirtualNetworkForUserLocked(uid_t uid) con
     return NULL;
 }
 
+unsigned NetworkController::getNetworkForUserLocked(uid_t uid) const {
+    if (VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid)) {
+        return virtualNetwork->getNetId();
+    }
+    return mDefaultNetId;
+}
+
+unsigned NetworkController::getNetworkForConnectLocked(uid_t uid) const {
+    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
+    if (virtualNetwork && !virtualNetwork->isSecure()) {
+        return virtualNetwork->getNetId();
+    }
+    return mDefaultNetId;
+}
+
+bool NetworkController::isVirtualNetworkLocked(unsigned netId) const {
+    Network* network = getNetworkLocked(netId);
+    return network && network->getType() == Network::VIRTUAL;
+}
+
 Permission NetworkController::getPermissionForUserLocked(uid_t uid) const {
     auto iter = mUsers.find(uid);
     if (iter != mUsers.end()) {
@@ -611,6 +716,11 @@ int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) c
     return ((userPermission & networkPermission) == networkPermission) ? 0 : -EACCES;
 }
 
+bool NetworkController::canProtectLocked(uid_t uid) const {
+    return ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
+           mProtectableUsers.find(uid) != mProtectableUsers.end();
+}
+
 int NetworkController::modifyRoute(unsigned netId, const char* interface, const char* destination,
                                    const char* nexthop, bool add, bool legacy, uid_t uid) {
     if (!isValidNetwork(netId)) {
@@ -46,6 +46,27 @@ public:
     static const unsigned LOCAL_NET_ID;
     static const unsigned DUMMY_NET_ID;
 
+    // Holds the read lock for as long as it exists, so that a series of lookups sees one
+    // consistent view of the configuration, e.g., when marking a batch of sockets. The
+    // NetworkController can't be modified while a Snapshot exists, and the thread that holds one
+    // must not call the NetworkController's own methods, which take the lock again.
+    class Snapshot {
+    public:
+        explicit Snapshot(const NetworkController& controller);
+
+        unsigned getDefaultNetwork() const;
+        unsigned getNetworkForUser(uid_t uid) const;
+        unsigned getNetworkForConnect(uid_t uid) const;
+        bool isVirtualNetwork(unsigned netId) const;
+        Permission getPermissionForUser(uid_t uid) const;
+        int checkUserNetworkAccess(uid_t uid, unsigned netId) const;
+        bool canProtect(uid_t uid) const;
+
+    private:
+        const NetworkController& mController;
+        android::RWLock::AutoRLock mLock;
+    };
+
     NetworkController();
 
     unsigned getDefaultNetwork() const;
@@ -97,8 +118,12 @@ private:
     bool isValidNetwork(unsigned netId) const;
     Network* getNetworkLocked(unsigned netId) const;
     VirtualNetwork* getVirtualNetworkForUserLocked(uid_t uid) const;
+    unsigned getNetworkForUserLocked(uid_t uid) const;
+    unsigned getNetworkForConnectLocked(uid_t uid) const;
+    bool isVirtualNetworkLocked(unsigned netId) const;
     Permission getPermissionForUserLocked(uid_t uid) const;
     int checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const;
+    bool canProtectLocked(uid_t uid) const;
 
     int modifyRoute(unsigned netId, const char* interface, const char* destination,
                     const char* nexthop, bool add, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
@@ -107,9 +132,11 @@ private:
     class DelegateImpl;
     DelegateImpl* const mDelegateImpl;
 
-    // mRWLock guards all accesses to mDefaultNetId, mNetworks, mUsers and mProtectableUsers.
+    // mRWLock guards all accesses to mDefaultNetId, mLastDefaultSwitchMs, mNetworks, mUsers and
+    // mProtectableUsers.
     mutable android::RWLock mRWLock;
     unsigned mDefaultNetId;
+    float mLastDefaultSwitchMs;  // How long the last default network switch took.
     std::map<unsigned, Network*> mNetworks;  // Map keys are NetIds.
     std::map<uid_t, Permission> mUsers;
     std::set<uid_t> mProtectableUsers;
@@ -67,17 +67,23 @@ Permission PhysicalNetwork::getPermission() const {
 }
 
 int PhysicalNetwork::destroySocketsLackingPermission(Permission permission) {
-    if (permission == PERMISSION_NONE) return 0;
+    return destroySocketsLackingPermission(std::set<unsigned>{mNetId}, permission);
+}
+
+int PhysicalNetwork::destroySocketsLackingPermission(const std::set<unsigned>& netIds,
+                                                     Permission permission) {
+    if (permission == PERMISSION_NONE || netIds.empty()) return 0;
 
     SockDiag sd;
     if (!sd.open()) {
-       ALOGE("Error closing sockets for netId %d permission change", mNetId);
+       ALOGE("Error closing sockets for %zu network(s) permission change", netIds.size());
        return -EBADFD;
     }
-    if (int ret = sd.destroySocketsLackingPermission(mNetId, permission,
-                                                     true /* excludeLoopback */)) {
-        ALOGE("Failed to close sockets changing netId %d to permission %d: %s",
-              mNetId, permission, strerror(-ret));
+    if (int ret = sd.destroySocketsLackingPermission(netIds, permission,
+                                                     true /* excludeLoopback */,
+                                                     SockDiag::PROTO_ALL)) {
+        ALOGE("Failed to close sockets changing %zu network(s) to permission %d: %s",
+              netIds.size(), permission, strerror(-ret));
         return ret;
     }
     return 0;
@@ -93,6 +99,20 @@ int PhysicalNetwork::setPermission(Permission permission) {
     }
 
     destroySocketsLackingPermission(permission);
+    if (int ret = setPermissionKeepingSockets(permission)) {
+        return ret;
+    }
+    // Destroy sockets again in case any were opened after we called destroySocketsLackingPermission
+    // above and before we changed the permissions. These sockets won't be able to send any RST
+    // packets because they are now no longer routed, but at least the apps will get errors.
+    destroySocketsLackingPermission(permission);
+    return 0;
+}
+
+int PhysicalNetwork::setPermissionKeepingSockets(Permission permission) {
+    if (permission == mPermission) {
+        return 0;
+    }
     for (const std::string& interface : mInterfaces) {
         if (int ret = RouteController::modifyPhysicalNetworkPermission(mNetId, interface.c_str(),
                                                                        mPermission, permission)) {
@@ -111,10 +131,6 @@ int PhysicalNetwork::setPermission(Permission permission) {
             }
         }
     }
-    // Destroy sockets again in case any were opened after we called destroySocketsLackingPermission
-    // above and before we changed the permissions. These sockets won't be able to send any RST
-    // packets because they are now no longer routed, but at least the apps will get errors.
-    destroySocketsLackingPermission(permission);
     mPermission = permission;
     return 0;
 }
@@ -145,6 +161,10 @@ int PhysicalNetwork::removeAsDefault() {
     return 0;
 }
 
+void PhysicalNetwork::resetDefaultState(bool isDefault) {
+    mIsDefault = isDefault;
+}
+
 Network::Type PhysicalNetwork::getType() const {
     return PHYSICAL;
 }
@@ -20,6 +20,8 @@
 #include "Network.h"
 #include "Permission.h"
 
+#include <set>
+
 class PhysicalNetwork : public Network {
 public:
     class Delegate {
@@ -38,9 +40,20 @@ public:
     // These refer to permissions that apps must have in order to use this network.
     Permission getPermission() const;
     int setPermission(Permission permission) WARN_UNUSED_RESULT;
+    // Same as setPermission(), but does not destroy sockets that lack the new permission. The
+    // caller must do so, e.g., by calling destroySocketsLackingPermission() below before and after.
+    int setPermissionKeepingSockets(Permission permission) WARN_UNUSED_RESULT;
+
+    // Destroys sockets on any of |netIds| that lack |permission|, with one dump per address family.
+    static int destroySocketsLackingPermission(const std::set<unsigned>& netIds,
+                                               Permission permission);
 
     int addAsDefault() WARN_UNUSED_RESULT;
     int removeAsDefault() WARN_UNUSED_RESULT;
+    // Sets whether this network is the default without changing any routing. Used to roll back
+    // addAsDefault() or removeAsDefault() if the RouteController::Transaction they were part of
+    // failed.
+    void resetDefaultState(bool isDefault);
 
 private:
     Type getType() const override;
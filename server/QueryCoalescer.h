@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef NETD_SERVER_QUERY_COALESCER_H
+#define NETD_SERVER_QUERY_COALESCER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DumpWriter.h"
+#include "NetdConstants.h"
+
+// Lets identical queries that are in progress at the same time share one resolution. The first
+// query with a given key is resolved as usual, and the ones that arrive before it finishes wait
+// for its result instead of being resolved again, e.g., when many apps look up the same name at
+// once and the cache doesn't have it yet.
+template <typename Key, typename... Result>
+class QueryCoalescer {
+public:
+    typedef std::function<void(Result...)> Waiter;
+
+    struct Stats {
+        // Queries passed to join(), including the coalesced ones.
+        uint64_t queries;
+        // Queries that waited for the result of an identical one instead of being resolved.
+        uint64_t coalesced;
+        // Queries being resolved now.
+        size_t inFlight;
+    };
+
+    explicit QueryCoalescer(const std::string& name) : mName(name), mQueries(0), mCoalesced(0) {}
+
+    // Returns true if a query with |key| is already in progress, in which case |waiter| is called
+    // with its result when it finishes. Otherwise returns false, and the caller must resolve the
+    // query and then call finish(). Queries that join after that are resolved again.
+    bool join(const Key& key, const Waiter& waiter) WARN_UNUSED_RESULT {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQueries++;
+        auto it = mInFlight.find(key);
+        if (it == mInFlight.end()) {
+            mInFlight[key];
+            return false;
+        }
+        mCoalesced++;
+        it->second.push_back(waiter);
+        return true;
+    }
+
+    // Passes |result| to the queries that are waiting for the query with |key|, on the calling
+    // thread, and marks that query as no longer in progress.
+    void finish(const Key& key, Result... result) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            auto it = mInFlight.find(key);
+            if (it == mInFlight.end()) {
+                return;
+            }
+            waiters.swap(it->second);
+            mInFlight.erase(it);
+        }
+        for (const Waiter& waiter : waiters) {
+            waiter(result...);
+        }
+    }
+
+    Stats getStats() const {
+        std::lock_guard<std::mutex> lock(mLock);
+        return { mQueries, mCoalesced, mInFlight.size() };
+    }
+
+    void dump(DumpWriter& dw) const {
+        const Stats stats = getStats();
+        dw.incIndent();
+        dw.println("%s queries", mName.c_str());
+        dw.incIndent();
+        dw.println("Queries: %llu, coalesced: %llu, in flight: %zu",
+                   (unsigned long long) stats.queries, (unsigned long long) stats.coalesced,
+                   stats.inFlight);
+        dw.decIndent();
+        dw.decIndent();
+    }
+
+private:
+    const std::string mName;
+
+    // Guards all the members below.
+    mutable std::mutex mLock;
+    // The queries in progress, and the queries that wait for each of them.
+    std::map<Key, std::vector<Waiter>> mInFlight;
+    uint64_t mQueries;
+    uint64_t mCoalesced;
+};
+
+#endif  // NETD_SERVER_QUERY_COALESCER_H
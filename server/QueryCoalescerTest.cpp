@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "QueryCoalescer.h"
+
+TEST(QueryCoalescerTest, TestCoalescesIdenticalQueries) {
+    QueryCoalescer<std::string, int> coalescer("test");
+    std::vector<int> results;
+    auto waiter = [&results](int result) { results.push_back(result); };
+
+    EXPECT_FALSE(coalescer.join("a", waiter));
+    EXPECT_TRUE(coalescer.join("a", waiter));
+    EXPECT_TRUE(coalescer.join("a", waiter));
+    EXPECT_FALSE(coalescer.join("b", waiter));
+    EXPECT_TRUE(coalescer.join("b", waiter));
+
+    QueryCoalescer<std::string, int>::Stats stats = coalescer.getStats();
+    EXPECT_EQ(5U, stats.queries);
+    EXPECT_EQ(3U, stats.coalesced);
+    EXPECT_EQ(2U, stats.inFlight);
+
+    coalescer.finish("a", 1);
+    EXPECT_EQ(std::vector<int>({1, 1}), results);
+    coalescer.finish("b", 2);
+    EXPECT_EQ(std::vector<int>({1, 1, 2}), results);
+    EXPECT_EQ(0U, coalescer.getStats().inFlight);
+
+    // Once a query has finished, the next identical one is resolved again.
+    EXPECT_FALSE(coalescer.join("a", waiter));
+    coalescer.finish("a", 3);
+    EXPECT_EQ(std::vector<int>({1, 1, 2}), results);
+}
+
+TEST(QueryCoalescerTest, TestWaiterCanJoinAgain) {
+    // A waiter may issue the same query again when it gets its result, e.g., to retry, without
+    // deadlocking or joining the query that just finished.
+    QueryCoalescer<std::string, int> coalescer("test");
+    bool rejoined = true;
+    EXPECT_FALSE(coalescer.join("a", [](int) {}));
+    EXPECT_TRUE(coalescer.join("a", [&coalescer, &rejoined](int) {
+        rejoined = coalescer.join("a", [](int) {});
+    }));
+    coalescer.finish("a", 0);
+    EXPECT_FALSE(rejoined);
+    EXPECT_EQ(1U, coalescer.getStats().inFlight);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_RING_BUFFER_H
+#define NETD_SERVER_RING_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+// A bounded queue that any number of threads can push to and one thread pops from, without locks.
+// Pushing to a full queue fails instead of blocking, which suits events that can be dropped under
+// load. Each slot carries a sequence number that tells producers when it's free and the consumer
+// when it's filled.
+template <typename T>
+class RingBuffer {
+public:
+    // |capacity| must be a power of two.
+    explicit RingBuffer(size_t capacity) :
+            mMask(capacity - 1), mSlots(new Slot[capacity]), mHead(0), mTail(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // May be called from any thread. Returns false if the buffer is full.
+    bool push(const T& item) {
+        size_t pos = mHead.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &mSlots[pos & mMask];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence - pos);
+            if (diff == 0) {
+                // The slot is free. Claim it, unless another producer got there first.
+                if (mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The consumer hasn't popped the item pushed one lap ago.
+                return false;
+            } else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = item;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Must only be called from one thread at a time. Returns false if the buffer is empty.
+    bool pop(T* item) {
+        const size_t pos = mTail.load(std::memory_order_relaxed);
+        Slot& slot = mSlots[pos & mMask];
+        const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence - (pos + 1)) < 0) {
+            return false;
+        }
+        *item = slot.item;
+        slot.sequence.store(pos + mMask + 1, std::memory_order_release);
+        mTail.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // The number of items in the buffer. Only approximate while other threads push or pop.
+    size_t size() const {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        return head > tail ? head - tail : 0;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    const size_t mMask;
+    std::unique_ptr<Slot[]> mSlots;
+    // The next position that producers will claim, and the next one that the consumer will pop.
+    std::atomic<size_t> mHead;
+    std::atomic<size_t> mTail;
+};
+
+#endif  // NETD_SERVER_RING_BUFFER_H
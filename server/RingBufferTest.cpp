@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "RingBuffer.h"
+
+TEST(RingBufferTest, TestPushPop) {
+    RingBuffer<int> buffer(4);
+    int item;
+    EXPECT_FALSE(buffer.pop(&item));
+
+    // Go round the buffer a few times, filling it up each time.
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < 4; i++) {
+            EXPECT_TRUE(buffer.push(lap * 10 + i));
+        }
+        EXPECT_FALSE(buffer.push(-1));
+        EXPECT_EQ(4U, buffer.size());
+
+        for (int i = 0; i < 4; i++) {
+            ASSERT_TRUE(buffer.pop(&item));
+            EXPECT_EQ(lap * 10 + i, item);
+        }
+        EXPECT_FALSE(buffer.pop(&item));
+        EXPECT_EQ(0U, buffer.size());
+    }
+}
+
+TEST(RingBufferTest, TestConcurrentProducers) {
+    constexpr int kProducers = 4;
+    constexpr int kItemsPerProducer = 100000;
+    RingBuffer<int> buffer(64);
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&buffer, p] {
+            for (int i = 0; i < kItemsPerProducer; i++) {
+                while (!buffer.push(p * kItemsPerProducer + i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // Every item arrives exactly once, and the items of each producer arrive in order.
+    std::vector<int> next(kProducers, 0);
+    for (int popped = 0; popped < kProducers * kItemsPerProducer; ) {
+        int item;
+        if (!buffer.pop(&item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        const int p = item / kItemsPerProducer;
+        ASSERT_EQ(next[p], item % kItemsPerProducer);
+        next[p]++;
+        popped++;
+    }
+
+    for (auto& t : producers) {
+        t.join();
+    }
+    int item;
+    EXPECT_FALSE(buffer.pop(&item));
+}
@@ -21,23 +21,39 @@
 #include <fcntl.h>
 #include <linux/fib_rules.h>
 #include <net/if.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <private/android_filesystem_config.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include "Fwmark.h"
 #include "UidRanges.h"
 #include "DummyNetwork.h"
 
 #include "android-base/file.h"
+#include "android-base/stringprintf.h"
+#include "cutils/properties.h"
 #define LOG_TAG "Netd"
 #include "log/log.h"
-#include "logwrap/logwrap.h"
 #include "netutils/ifc.h"
 #include "resolv_netid.h"
 
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
 using android::base::WriteStringToFile;
 
 namespace {
@@ -90,8 +106,6 @@ const sockaddr_nl NETLINK_ADDRESS = {AF_NETLINK, 0, 0, 0};
 
 const uint8_t AF_FAMILIES[] = {AF_INET, AF_INET6};
 
-const char* const IP_VERSIONS[] = {"-4", "-6"};
-
 const uid_t UID_ROOT = 0;
 const char* const IIF_LOOPBACK = "lo";
 const char* const IIF_NONE = NULL;
@@ -101,8 +115,27 @@ const bool ACTION_DEL = false;
 const bool MODIFY_NON_UID_BASED_RULES = true;
 
 const char* const RT_TABLES_PATH = "/data/misc/net/rt_tables";
+const char* const RT_TABLES_TEMP_PATH = "/data/misc/net/rt_tables.tmp";
 const mode_t RT_TABLES_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;  // mode 0644, rw-r--r--
 
+// The table names file is written at most this often, however many interfaces come and go.
+const std::chrono::milliseconds RT_TABLES_WRITE_INTERVAL(1000);
+
+// Records the boot on which netd last initialized routing. If netd finds the current boot there when
+// it starts, it has been restarted (e.g., after a crash) and the rules and routes in the kernel are
+// the ones the previous instance configured. See RouteController::Init().
+const char* const ROUTE_JOURNAL_PATH = "/data/misc/net/route_journal";
+const mode_t ROUTE_JOURNAL_MODE = S_IRUSR | S_IWUSR;  // mode 0600, rw-------
+const char* const BOOT_ID_PATH = "/proc/sys/kernel/random/boot_id";
+
+// Setting this to 1 turns warm restarts on. The journal only records the boot, not the networks, so
+// a warm restart relies on the framework replaying all of them soon after netd restarts (see
+// RouteController::Init()). Nothing makes the framework do that, so by default netd flushes the
+// rules on every start, as it did before warm restarts.
+const char* const WARM_RESTART_PROPERTY = "persist.netd.route_warm_restart";
+
+// How many times a flush dumps the kernel's rules or routes again if the dump was interrupted by a
+// concurrent change.
 const unsigned ROUTE_FLUSH_ATTEMPTS = 2;
 
 // Avoids "non-constant-expression cannot be narrowed from type 'unsigned int' to 'unsigned short'"
@@ -130,14 +163,80 @@ uint8_t PADDING_BUFFER[RTA_ALIGNTO] = {0, 0, 0, 0};
 // No locks needed because RouteController is accessed only from one thread (in CommandListener).
 std::map<std::string, uint32_t> interfaceToTable;
 
+// Whether interfaceToTable has changed since the table names file was last updated.
+bool interfaceToTableDirty = true;
+
+// Interface indices of the interfaces that currently exist, as reported by link events, so that
+// looking up a table doesn't cost an if_nametoindex() call. Only the NetlinkHandler thread adds
+// entries, using the index in the event itself; the command thread only reads them, and drops
+// entries that turn out to be stale. Unlike everything else in this file, this needs a lock.
+std::mutex interfaceIndexLock;
+std::map<std::string, uint32_t> interfaceIndices;
+
+// During a warm restart, the rules and routes that the previous instance of netd left in the kernel
+// and that haven't been added or deleted again since, as returned by netlinkKey(). Whatever is
+// left when the warm restart finishes is deleted.
+bool warmRestartPending = false;
+std::set<std::string> warmRestartLeftovers;
+
+// When the warm restart started or a rule or route was last requested during it, as a
+// steady_clock time since epoch. Read by the thread that waits to finish the warm restart.
+std::atomic<std::chrono::steady_clock::rep> warmRestartLastRequest(0);
+
+std::string netlinkKey(const nlmsghdr* nlh);
+
+// Returns the interface index of |interface|, or 0 if it doesn't exist.
+uint32_t getInterfaceIndex(const char* interface) {
+    {
+        std::lock_guard<std::mutex> lock(interfaceIndexLock);
+        auto iter = interfaceIndices.find(interface);
+        if (iter != interfaceIndices.end()) {
+            return iter->second;
+        }
+    }
+    // No link event for this interface yet, e.g., because it existed before netd started or the
+    // event hasn't been processed yet. Ask the kernel, but don't cache the answer: if the interface
+    // is deleted and recreated in the meantime, storing it could overwrite the newer index that the
+    // link event just stored.
+    return if_nametoindex(interface);
+}
+
+// Drops |staleIndex| from the cache if it's still the cached index of |interface|, so that the next
+// lookup asks the kernel.
+void dropInterfaceIndex(const char* interface, uint32_t staleIndex) {
+    std::lock_guard<std::mutex> lock(interfaceIndexLock);
+    auto iter = interfaceIndices.find(interface);
+    if (iter != interfaceIndices.end() && iter->second == staleIndex) {
+        interfaceIndices.erase(iter);
+    }
+}
+
 uint32_t getRouteTableForInterface(const char* interface) {
-    uint32_t index = if_nametoindex(interface);
+    uint32_t index = getInterfaceIndex(interface);
+    auto table = interfaceToTable.find(interface);
+    if (index && table != interfaceToTable.end() &&
+            table->second != index + RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX) {
+        // Either the interface was recreated, or the cached index is stale because the link events
+        // haven't been processed yet. Only the kernel knows which.
+        uint32_t current = if_nametoindex(interface);
+        if (current != index) {
+            dropInterfaceIndex(interface, index);
+            index = current;
+        }
+    }
     if (index) {
         index += RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX;
-        interfaceToTable[interface] = index;
+        auto iter = interfaceToTable.find(interface);
+        if (iter == interfaceToTable.end()) {
+            interfaceToTable[interface] = index;
+            interfaceToTableDirty = true;
+        } else if (iter->second != index) {
+            iter->second = index;
+            interfaceToTableDirty = true;
+        }
         return index;
     }
-    // If the interface goes away if_nametoindex() will return 0 but we still need to know
+    // If the interface goes away getInterfaceIndex() will return 0 but we still need to know
     // the index so we can remove the rules and routes.
     auto iter = interfaceToTable.find(interface);
     if (iter == interfaceToTable.end()) {
@@ -156,8 +255,75 @@ void addTableName(uint32_t table, const std::string& name, std::string* contents
     *contents += "\n";
 }
 
-// Doesn't return success/failure as the file is optional; it's okay if we fail to update it.
+// Writes the table names file on a background thread, so that route changes don't wait for flash.
+// If the contents change several times within RT_TABLES_WRITE_INTERVAL, only the last version is
+// written. The file is written to a temporary path and renamed into place, so readers never see a
+// partially written file.
+class TableNamesWriter {
+public:
+    void write(std::string&& contents) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mPending = std::move(contents);
+        mHasPending = true;
+        if (!mStarted) {
+            std::thread(&TableNamesWriter::run, this).detach();
+            mStarted = true;
+        }
+        mCond.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mLock);
+        auto nextWrite = std::chrono::steady_clock::now();
+        while (true) {
+            mCond.wait(lock, [this] { return mHasPending; });
+            // Coalesce any further changes until it's time for the next write.
+            while (std::chrono::steady_clock::now() < nextWrite) {
+                mCond.wait_until(lock, nextWrite);
+            }
+
+            std::string contents = std::move(mPending);
+            mHasPending = false;
+            lock.unlock();
+            writeFile(contents);
+            lock.lock();
+
+            nextWrite = std::chrono::steady_clock::now() + RT_TABLES_WRITE_INTERVAL;
+        }
+    }
+
+    // Doesn't return success/failure as the file is optional; it's okay if we fail to update it.
+    static void writeFile(const std::string& contents) {
+        if (!WriteStringToFile(contents, RT_TABLES_TEMP_PATH, RT_TABLES_MODE, AID_SYSTEM,
+                               AID_WIFI)) {
+            ALOGE("failed to write to %s (%s)", RT_TABLES_TEMP_PATH, strerror(errno));
+            unlink(RT_TABLES_TEMP_PATH);
+            return;
+        }
+        if (rename(RT_TABLES_TEMP_PATH, RT_TABLES_PATH) == -1) {
+            ALOGE("failed to rename %s to %s (%s)", RT_TABLES_TEMP_PATH, RT_TABLES_PATH,
+                  strerror(errno));
+            unlink(RT_TABLES_TEMP_PATH);
+        }
+    }
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::string mPending;
+    bool mHasPending = false;
+    bool mStarted = false;
+};
+
+// Never destroyed, because its thread never exits.
+TableNamesWriter* const tableNamesWriter = new TableNamesWriter();
+
 void updateTableNamesFile() {
+    if (!interfaceToTableDirty) {
+        return;
+    }
+    interfaceToTableDirty = false;
+
     std::string contents;
 
     addTableName(RT_TABLE_LOCAL, ROUTE_TABLE_NAME_LOCAL, &contents);
@@ -171,17 +337,483 @@ void updateTableNamesFile() {
         addTableName(entry.second, entry.first, &contents);
     }
 
-    if (!WriteStringToFile(contents, RT_TABLES_PATH, RT_TABLES_MODE, AID_SYSTEM, AID_WIFI)) {
-        ALOGE("failed to write to %s (%s)", RT_TABLES_PATH, strerror(errno));
+    tableNamesWriter->write(std::move(contents));
+}
+
+// BEGIN NETLINK CHANNEL --------------------------------------------------------------------------
+
+// A NETLINK_ROUTE socket that stays open for the lifetime of the process, so that each request
+// costs one send and one receive instead of socket(), connect(), writev(), recv() and close().
+// Like the rest of this file, it's only accessed from one thread.
+int netlinkSocket = -1;
+
+// If not -1, used instead of |netlinkSocket|. See RouteController::setNetlinkSocketForTest().
+int testNetlinkSocket = -1;
+
+// Replaced in tests and benchmarks that can't modify the device's iptables rules.
+int (*iptablesFunction)(IptablesTarget target, ...) = execIptables;
+
+int noIptables(IptablesTarget, ...) {
+    return 0;
+}
+
+// Sequence number of the last message sent on |netlinkSocket|. Acks carry the sequence number of
+// the message they refer to, so stale acks (e.g., left over from a batch that failed halfway
+// through) can be told apart from the ones we're waiting for.
+uint32_t netlinkSequence = 0;
+
+// Batches larger than this are sent in several chunks, so that neither the request nor the acks
+// can overflow the socket buffers. The kernel processes a whole chunk before we get to read any
+// acks, and each ack takes up most of a kilobyte of receive buffer, so the message limit matters
+// more than the byte limit.
+const size_t NETLINK_BATCH_MAX_BYTES = 32 * 1024;
+const size_t NETLINK_BATCH_MAX_MESSAGES = 64;
+
+// How many acks to read with a single recvmmsg() call, and how much of each to read. We only look
+// at the nlmsgerr at the start of each ack, so it's fine if the kernel truncates error acks that
+// quote the original request.
+const size_t NETLINK_ACKS_PER_RECV = 64;
+const size_t NETLINK_ACK_BUFFER_SIZE = 256;
+
+const size_t NETLINK_DUMP_BUFFER_SIZE = 32 * 1024;
+
+WARN_UNUSED_RESULT int getNetlinkSocket() {
+    if (testNetlinkSocket != -1) {
+        return testNetlinkSocket;
+    }
+    if (netlinkSocket != -1) {
+        return netlinkSocket;
+    }
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock == -1) {
+        ALOGE("netlink socket failed (%s)", strerror(errno));
+        return -errno;
+    }
+    if (connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
+                sizeof(NETLINK_ADDRESS)) == -1) {
+        int ret = -errno;
+        ALOGE("netlink connect failed (%s)", strerror(errno));
+        close(sock);
+        return ret;
+    }
+    netlinkSocket = sock;
+    return netlinkSocket;
+}
+
+// Called when the socket is in an unknown state, e.g., after a failed send or receive. The next
+// request will open a new one.
+void resetNetlinkSocket() {
+    if (netlinkSocket != -1) {
+        close(netlinkSocket);
+        netlinkSocket = -1;
+    }
+}
+
+const char* netlinkActionName(uint16_t action) {
+    switch (action) {
+        case RTM_NEWRULE:  return "RTM_NEWRULE";
+        case RTM_DELRULE:  return "RTM_DELRULE";
+        case RTM_NEWROUTE: return "RTM_NEWROUTE";
+        case RTM_DELROUTE: return "RTM_DELROUTE";
+        default:           return "unknown";
+    }
+}
+
+// A sequence of netlink requests that are written to the kernel in a single buffer, with all their
+// acks read back in one receive loop. Every message gets its own sequence number, so an error can
+// be attributed to the message that caused it.
+//
+// The kernel processes the messages in order and doesn't stop at the first failure, so when a
+// message fails, the ones after it have still been applied.
+class NetlinkBatch {
+public:
+    // Appends a request. |iov| has the same layout as for sendNetlinkRequest().
+    void add(uint16_t action, uint16_t flags, iovec* iov, int iovlen);
+
+    bool empty() const { return mMessages.empty(); }
+    size_t size() const { return mMessages.size(); }
+    void clear();
+
+    // Sends all the requests and waits for all the acks. Returns 0 if all the requests succeeded,
+    // or the error of the first request that failed. If |errors| is not null, it receives the
+    // result of each request, in the order they were added, and the caller is responsible for
+    // logging the errors it cares about. |errors| is left empty if the requests could not be sent
+    // at all.
+    WARN_UNUSED_RESULT int send(std::vector<int>* errors = nullptr);
+
+    // Same as send(), but if any request fails, reverts the ones that succeeded by sending the
+    // opposite requests (e.g., RTM_DELRULE for RTM_NEWRULE) in reverse order. This gets as close as
+    // netlink allows to all of the requests taking effect or none of them.
+    WARN_UNUSED_RESULT int sendOrUndo();
+
+private:
+    struct Message {
+        size_t offset;
+        size_t length;
+        uint16_t action;
+        // Whether this adds or deletes a warm restart leftover.
+        bool leftover;
+    };
+
+    WARN_UNUSED_RESULT int sendChunk(int sock, size_t first, size_t last, std::vector<int>* errors);
+    void updateLeftovers(const std::vector<int>& results, bool succeeded);
+
+    std::vector<uint8_t> mBuffer;
+    std::vector<Message> mMessages;
+
+    // Warm restart leftover rules that this batch would have added, and so didn't send, and the
+    // leftovers that it deletes. warmRestartLeftovers is only updated once the kernel has processed
+    // the batch, so that a batch that is discarded, fails or is undone leaves it as it was.
+    std::vector<std::string> mKeptLeftovers;
+    std::set<std::string> mDeletedLeftovers;
+};
+
+// Disable optimizations in ASan build.
+// ASan reports an out-of-bounds 32-bit(!) access in the first loop of the
+// function (over iov[]).
+#ifdef __clang__
+#if __has_feature(address_sanitizer)
+__attribute__((optnone))
+#endif
+#endif
+void NetlinkBatch::add(uint16_t action, uint16_t flags, iovec* iov, int iovlen) {
+    nlmsghdr nlmsg = {
+        .nlmsg_type = action,
+        .nlmsg_flags = flags,
+    };
+    iov[0].iov_base = &nlmsg;
+    iov[0].iov_len = sizeof(nlmsg);
+    for (int i = 0; i < iovlen; ++i) {
+        nlmsg.nlmsg_len += iov[i].iov_len;
+    }
+
+    // Messages in a multi-message buffer must start on an NLMSG_ALIGNTO boundary. Our messages
+    // are always a multiple of RTA_ALIGNTO (== NLMSG_ALIGNTO) long, so this never adds padding,
+    // but do it anyway in case that changes.
+    const size_t offset = NLMSG_ALIGN(mBuffer.size());
+    mBuffer.resize(offset + NLMSG_ALIGN(nlmsg.nlmsg_len));
+    size_t pos = offset;
+    for (int i = 0; i < iovlen; ++i) {
+        memcpy(&mBuffer[pos], iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    // Don't add back the rules that the previous instance of netd left in place. The kernel already
+    // has them, and adding them again would fail, or on older kernels, duplicate them. Rules stay
+    // until someone deletes them, but the kernel deletes routes by itself, e.g., when their
+    // interface goes down, so leftover routes are still sent, and send() treats EEXIST as success.
+    // Once this batch has deleted a leftover, adding it again is an ordinary request.
+    bool leftover = false;
+    if (warmRestartPending) {
+        warmRestartLastRequest = std::chrono::steady_clock::now().time_since_epoch().count();
+        std::string key = netlinkKey(reinterpret_cast<const nlmsghdr*>(&mBuffer[offset]));
+        if (warmRestartLeftovers.count(key) && !mDeletedLeftovers.count(key)) {
+            if (action == RTM_NEWRULE) {
+                mBuffer.resize(offset);
+                mKeptLeftovers.push_back(key);
+                return;
+            }
+            if (action != RTM_NEWROUTE) {
+                mDeletedLeftovers.insert(key);
+            }
+            leftover = true;
+        }
+    }
+
+    mMessages.push_back({offset, nlmsg.nlmsg_len, action, leftover});
+}
+
+uint16_t oppositeAction(uint16_t action) {
+    switch (action) {
+        case RTM_NEWRULE:  return RTM_DELRULE;
+        case RTM_DELRULE:  return RTM_NEWRULE;
+        case RTM_NEWROUTE: return RTM_DELROUTE;
+        case RTM_DELROUTE: return RTM_NEWROUTE;
+        default:           return 0;
+    }
+}
+
+void NetlinkBatch::clear() {
+    mBuffer.clear();
+    mMessages.clear();
+    mKeptLeftovers.clear();
+    mDeletedLeftovers.clear();
+}
+
+// Called once the kernel has processed the batch. Leftovers that were deleted are no longer
+// leftovers, and if every request succeeded, neither are the ones that the batch added: the
+// framework has asked for them, so finishWarmRestart() must keep them.
+void NetlinkBatch::updateLeftovers(const std::vector<int>& results, bool succeeded) {
+    if (!warmRestartPending) {
         return;
     }
+    for (size_t i = 0; i < mMessages.size(); ++i) {
+        const Message& message = mMessages[i];
+        if (message.leftover && !results[i] && (succeeded || message.action != RTM_NEWROUTE)) {
+            warmRestartLeftovers.erase(
+                    netlinkKey(reinterpret_cast<const nlmsghdr*>(&mBuffer[message.offset])));
+        }
+    }
+    if (succeeded) {
+        for (const std::string& key : mKeptLeftovers) {
+            warmRestartLeftovers.erase(key);
+        }
+    }
+}
+
+int NetlinkBatch::send(std::vector<int>* errors) {
+    if (errors) {
+        errors->clear();
+    }
+    if (mMessages.empty()) {
+        updateLeftovers({}, true);
+        return 0;
+    }
+
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+
+    std::vector<int> results(mMessages.size(), 0);
+    size_t first = 0;
+    while (first < mMessages.size()) {
+        size_t last = first + 1;
+        while (last < mMessages.size() && last - first < NETLINK_BATCH_MAX_MESSAGES &&
+               mMessages[last].offset + mMessages[last].length - mMessages[first].offset <=
+                       NETLINK_BATCH_MAX_BYTES) {
+            ++last;
+        }
+        if (int ret = sendChunk(sock, first, last, &results)) {
+            resetNetlinkSocket();
+            return ret;
+        }
+        first = last;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        // The leftover route is still there.
+        if (mMessages[i].leftover && mMessages[i].action == RTM_NEWROUTE &&
+            results[i] == -EEXIST) {
+            results[i] = 0;
+        }
+        if (results[i] && !errors) {
+            ALOGE("netlink %s request %zu of %zu contains error (%s)",
+                  netlinkActionName(mMessages[i].action), i + 1, mMessages.size(),
+                  strerror(-results[i]));
+        }
+        if (results[i] && !ret) {
+            ret = results[i];
+        }
+    }
+    updateLeftovers(results, ret == 0);
+    if (errors) {
+        *errors = results;
+    }
+    return ret;
+}
+
+int NetlinkBatch::sendOrUndo() {
+    std::vector<int> errors;
+    int ret = send(&errors);
+    if (!ret) {
+        return 0;
+    }
+    if (errors.empty()) {
+        ALOGE("netlink batch failed (%s), state of %zu requests unknown", strerror(-ret), size());
+        return ret;
+    }
+
+    NetlinkBatch undo;
+    // The index in mMessages of the request that each request in |undo| reverts.
+    std::vector<size_t> undone;
+    size_t failed = 0;
+    for (size_t i = mMessages.size(); i-- > 0; ) {
+        const Message& message = mMessages[i];
+        if (errors[i]) {
+            ALOGE("netlink %s request %zu of %zu contains error (%s)",
+                  netlinkActionName(message.action), i + 1, mMessages.size(),
+                  strerror(-errors[i]));
+            ++failed;
+            continue;
+        }
+        uint16_t action = oppositeAction(message.action);
+        // A leftover route was there before the batch, or if the kernel had deleted it, the batch
+        // put it back as a leftover, which finishWarmRestart() deletes unless it is asked for again.
+        if (!action || (message.leftover && message.action == RTM_NEWROUTE)) {
+            continue;
+        }
+        uint16_t flags = (action == RTM_NEWRULE || action == RTM_NEWROUTE) ?
+                NETLINK_CREATE_REQUEST_FLAGS : NETLINK_REQUEST_FLAGS;
+        iovec iov[] = {
+            { NULL,                                     0 },
+            { &mBuffer[message.offset + NLMSG_HDRLEN], message.length - NLMSG_HDRLEN },
+        };
+        const size_t undoSize = undo.size();
+        undo.add(action, flags, iov, ARRAY_SIZE(iov));
+        if (undo.size() > undoSize) {
+            undone.push_back(i);
+        }
+    }
+
+    std::vector<int> undoErrors;
+    int undoRet = undo.send(&undoErrors);
+    // Leftovers that were deleted and then added back are leftovers again.
+    for (size_t i = 0; i < undoErrors.size(); ++i) {
+        const Message& message = mMessages[undone[i]];
+        if (message.leftover && !undoErrors[i]) {
+            warmRestartLeftovers.insert(
+                    netlinkKey(reinterpret_cast<const nlmsghdr*>(&mBuffer[message.offset])));
+        }
+    }
+    if (undoRet && !undoErrors.empty()) {
+        size_t undoFailed = 0;
+        for (int error : undoErrors) {
+            if (error) {
+                ++undoFailed;
+            }
+        }
+        ALOGE("failed to undo %zu of %zu netlink requests", undoFailed, undo.size());
+    }
+    ALOGE("%zu of %zu netlink requests failed, undid the other %zu", failed, size(), undo.size());
+    return ret;
 }
 
+// Sends messages [first, last) in one write and collects their acks into |results|. Returns an
+// error only if the channel itself failed; errors reported by the kernel go into |results|.
+int NetlinkBatch::sendChunk(int sock, size_t first, size_t last, std::vector<int>* results) {
+    const uint32_t firstSeq = netlinkSequence + 1;
+    for (size_t i = first; i < last; ++i) {
+        reinterpret_cast<nlmsghdr*>(&mBuffer[mMessages[i].offset])->nlmsg_seq = ++netlinkSequence;
+    }
+
+    const size_t begin = mMessages[first].offset;
+    const size_t end = mMessages[last - 1].offset + mMessages[last - 1].length;
+    const ssize_t bytes = end - begin;
+    if (::send(sock, &mBuffer[begin], bytes, 0) != bytes) {
+        ALOGE("netlink send failed (%s)", strerror(errno));
+        return -errno;
+    }
+
+    static uint8_t acks[NETLINK_ACKS_PER_RECV][NETLINK_ACK_BUFFER_SIZE];
+    iovec iov[NETLINK_ACKS_PER_RECV];
+    mmsghdr msgs[NETLINK_ACKS_PER_RECV];
+
+    size_t pending = last - first;
+    while (pending > 0) {
+        const size_t count = std::min(pending, NETLINK_ACKS_PER_RECV);
+        for (size_t i = 0; i < count; ++i) {
+            iov[i] = { acks[i], sizeof(acks[i]) };
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // Block until at least one ack arrives, then take whatever else is already queued.
+        int received = recvmmsg(sock, msgs, count, MSG_WAITFORONE, nullptr);
+        if (received == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("netlink recv failed (%s)", strerror(errno));
+            return -errno;
+        }
+        for (int i = 0; i < received; ++i) {
+            const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(acks[i]);
+            if (msgs[i].msg_len < NLMSG_LENGTH(sizeof(nlmsgerr)) ||
+                    nlh->nlmsg_type != NLMSG_ERROR) {
+                ALOGE("bad netlink response message (type %u, size %u)", nlh->nlmsg_type,
+                      msgs[i].msg_len);
+                return -EBADMSG;
+            }
+            const uint32_t index = nlh->nlmsg_seq - firstSeq;
+            if (index >= last - first) {
+                // An ack for a message we're no longer waiting for.
+                continue;
+            }
+            (*results)[first + index] =
+                    reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nlh))->error;
+            --pending;
+        }
+    }
+
+    return 0;
+}
+
+// The batch that requests are currently being added to, if any. See ScopedNetlinkBatch.
+NetlinkBatch* currentBatch = nullptr;
+
+// While an instance of this class is in scope, sendNetlinkRequest() queues requests instead of
+// sending them, and commit() sends them all at once. This allows a function that makes many
+// requests to pay for one round trip to the kernel instead of one per request.
+//
+// Nested instances join the outermost batch, and their commit() does nothing; the requests are sent
+// when the outermost instance is committed. Requests that have not been committed when the
+// outermost instance goes out of scope (e.g., because the caller returned early on error) are
+// discarded.
+//
+// Because sendNetlinkRequest() returns 0 for queued requests, code that needs the result of one
+// request to decide what to do next must not run inside a batch.
+class ScopedNetlinkBatch {
+public:
+    ScopedNetlinkBatch() : mOwner(currentBatch == nullptr) {
+        if (mOwner) {
+            currentBatch = &mBatch;
+        }
+    }
+
+    ~ScopedNetlinkBatch() {
+        if (mOwner) {
+            currentBatch = nullptr;
+        }
+    }
+
+    WARN_UNUSED_RESULT int commit() {
+        if (!mOwner) {
+            return 0;
+        }
+        currentBatch = nullptr;
+        mOwner = false;
+        return mBatch.send();
+    }
+
+    // Like commit(), but if any request fails, undoes the others. See NetlinkBatch::sendOrUndo().
+    WARN_UNUSED_RESULT int commitOrUndo() {
+        if (!mOwner) {
+            return 0;
+        }
+        currentBatch = nullptr;
+        mOwner = false;
+        return mBatch.sendOrUndo();
+    }
+
+private:
+    bool mOwner;
+    NetlinkBatch mBatch;
+};
+
+// END NETLINK CHANNEL ----------------------------------------------------------------------------
+
 // Sends a netlink request and expects an ack.
 // |iov| is an array of struct iovec that contains the netlink message payload.
 // The netlink header is generated by this function based on |action| and |flags|.
 // Returns -errno if there was an error or if the kernel reported an error.
+//
+// If a ScopedNetlinkBatch is in scope, the request is queued and 0 is returned.
+WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen) {
+    if (currentBatch) {
+        currentBatch->add(action, flags, iov, iovlen);
+        return 0;
+    }
+    NetlinkBatch batch;
+    batch.add(action, flags, iov, iovlen);
+    return batch.send();
+}
 
+// Sends a dump request and calls |callback| for each message in the response. |iov| has the same
+// layout as for sendNetlinkRequest(). Sets |*interrupted| if the kernel reports that the contents
+// changed while the dump was in progress, in which case the dump may be incomplete.
+// Returns 0 on success or negative errno on failure.
 // Disable optimizations in ASan build.
 // ASan reports an out-of-bounds 32-bit(!) access in the first loop of the
 // function (over iov[]).
@@ -190,48 +822,220 @@ void updateTableNamesFile() {
 __attribute__((optnone))
 #endif
 #endif
-WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen) {
+WARN_UNUSED_RESULT int dumpNetlink(uint16_t action, iovec* iov, int iovlen,
+                                   const std::function<void(const nlmsghdr*)>& callback,
+                                   bool* interrupted) {
+    *interrupted = false;
+
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+
     nlmsghdr nlmsg = {
         .nlmsg_type = action,
-        .nlmsg_flags = flags,
+        .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+        .nlmsg_seq = ++netlinkSequence,
     };
     iov[0].iov_base = &nlmsg;
     iov[0].iov_len = sizeof(nlmsg);
     for (int i = 0; i < iovlen; ++i) {
         nlmsg.nlmsg_len += iov[i].iov_len;
     }
+    if (writev(sock, iov, iovlen) == -1) {
+        int ret = -errno;
+        ALOGE("netlink dump request failed (%s)", strerror(errno));
+        resetNetlinkSocket();
+        return ret;
+    }
 
-    int ret;
-    struct {
-        nlmsghdr msg;
-        nlmsgerr err;
-    } response;
-
-    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
-    if (sock != -1 &&
-            connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
-                    sizeof(NETLINK_ADDRESS)) != -1 &&
-            writev(sock, iov, iovlen) != -1 &&
-            (ret = recv(sock, &response, sizeof(response), 0)) != -1) {
-        if (ret == sizeof(response)) {
-            ret = response.err.error;  // Netlink errors are negative errno.
-            if (ret) {
-                ALOGE("netlink response contains error (%s)", strerror(-ret));
+    // Large enough for any message the kernel might send us in a dump.
+    static uint8_t buf[NETLINK_DUMP_BUFFER_SIZE];
+    while (true) {
+        ssize_t bytes = recv(sock, buf, sizeof(buf), 0);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            ALOGE("bad netlink response message size (%d != %zu)", ret, sizeof(response));
-            ret = -EBADMSG;
+            int ret = -errno;
+            ALOGE("netlink dump recv failed (%s)", strerror(errno));
+            resetNetlinkSocket();
+            return ret;
+        }
+        for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(buf);
+             NLMSG_OK(nlh, bytes); nlh = NLMSG_NEXT(nlh, bytes)) {
+            if (nlh->nlmsg_seq != nlmsg.nlmsg_seq) {
+                // An ack for a request we're no longer waiting for.
+                continue;
+            }
+            if (nlh->nlmsg_flags & NLM_F_DUMP_INTR) {
+                *interrupted = true;
+            }
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                int ret = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nlh))->error;
+                ALOGE("netlink dump failed (%s)", strerror(-ret));
+                return ret;
+            }
+            callback(nlh);
         }
-    } else {
-        ALOGE("netlink socket/connect/writev/recv failed (%s)", strerror(errno));
-        ret = -errno;
     }
+}
 
-    if (sock != -1) {
-        close(sock);
+// Returns the first attribute of type |type| in |len| bytes of attributes starting at |rta|, or
+// nullptr if there is none.
+const rtattr* findAttribute(const rtattr* rta, int len, uint16_t type) {
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == type) {
+            return rta;
+        }
     }
+    return nullptr;
+}
 
-    return ret;
+uint32_t getU32Attribute(const rtattr* rta, uint32_t defaultValue) {
+    if (!rta || RTA_PAYLOAD(rta) < sizeof(uint32_t)) {
+        return defaultValue;
+    }
+    return *reinterpret_cast<const uint32_t*>(RTA_DATA(rta));
+}
+
+std::string getStringAttribute(const rtattr* rta) {
+    if (!rta) {
+        return "";
+    }
+    const char* data = static_cast<const char*>(RTA_DATA(rta));
+    return std::string(data, strnlen(data, RTA_PAYLOAD(rta)));
+}
+
+std::string getHexAttribute(const rtattr* rta) {
+    std::string hex;
+    if (rta) {
+        const uint8_t* data = static_cast<const uint8_t*>(RTA_DATA(rta));
+        for (size_t i = 0; i < RTA_PAYLOAD(rta); ++i) {
+            hex += StringPrintf("%02x", data[i]);
+        }
+    }
+    return hex;
+}
+
+bool isNetdRouteTable(uint32_t table) {
+    return table == ROUTE_TABLE_LOCAL_NETWORK || table == ROUTE_TABLE_LEGACY_NETWORK ||
+            table == ROUTE_TABLE_LEGACY_SYSTEM ||
+            table >= RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX;
+}
+
+// Returns a string that identifies a rule or route by the fields that netd sets, so that a rule or
+// route dumped from the kernel can be matched with a request to add or delete it. The kernel fills
+// in attributes netd doesn't send, and omits some that are zero, so the messages can't be compared
+// byte by byte. Returns an empty string for rules and routes that netd doesn't manage.
+std::string netlinkKey(const nlmsghdr* nlh) {
+    const uint8_t* payload = static_cast<const uint8_t*>(NLMSG_DATA(nlh));
+    switch (nlh->nlmsg_type) {
+        case RTM_NEWRULE:
+        case RTM_DELRULE: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(fib_rule_hdr))) {
+                return "";
+            }
+            const fib_rule_hdr* rule = reinterpret_cast<const fib_rule_hdr*>(payload);
+            const rtattr* rta = reinterpret_cast<const rtattr*>(
+                    payload + NLMSG_ALIGN(sizeof(fib_rule_hdr)));
+            int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(fib_rule_hdr));
+            // Like flushRules(), leave the rule at priority 0 alone.
+            uint32_t priority = getU32Attribute(findAttribute(rta, len, FRA_PRIORITY), 0);
+            if (!priority) {
+                return "";
+            }
+            return StringPrintf("rule %u %u %u %u %x/%x %u-%u %s %s", rule->family, rule->action,
+                                priority,
+                                getU32Attribute(findAttribute(rta, len, FRA_TABLE), rule->table),
+                                getU32Attribute(findAttribute(rta, len, FRA_FWMARK), 0),
+                                getU32Attribute(findAttribute(rta, len, FRA_FWMASK), 0),
+                                getU32Attribute(findAttribute(rta, len, FRA_UID_START),
+                                                INVALID_UID),
+                                getU32Attribute(findAttribute(rta, len, FRA_UID_END), INVALID_UID),
+                                getStringAttribute(findAttribute(rta, len, FRA_IIFNAME)).c_str(),
+                                getStringAttribute(findAttribute(rta, len, FRA_OIFNAME)).c_str());
+        }
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+                return "";
+            }
+            const rtmsg* route = static_cast<const rtmsg*>(NLMSG_DATA(nlh));
+            const rtattr* rta = RTM_RTA(route);
+            int len = RTM_PAYLOAD(nlh);
+            uint32_t table = getU32Attribute(findAttribute(rta, len, RTA_TABLE), route->rtm_table);
+            // Routes added by the kernel or by router advertisements aren't ours.
+            if (route->rtm_protocol != RTPROT_STATIC || (route->rtm_flags & RTM_F_CLONED) ||
+                    !isNetdRouteTable(table)) {
+                return "";
+            }
+            // The kernel omits the destination of default routes, and gives IPv6 unreachable and
+            // throw routes an interface even though netd doesn't specify one.
+            bool unicast = route->rtm_type == RTN_UNICAST;
+            return StringPrintf("route %u %u %u %s/%u %u %s", route->rtm_family, table,
+                                route->rtm_type,
+                                route->rtm_dst_len ?
+                                        getHexAttribute(findAttribute(rta, len, RTA_DST)).c_str() :
+                                        "",
+                                route->rtm_dst_len,
+                                unicast ? getU32Attribute(findAttribute(rta, len, RTA_OIF), 0) : 0,
+                                getHexAttribute(findAttribute(rta, len, RTA_GATEWAY)).c_str());
+        }
+        default:
+            return "";
+    }
+}
+
+// Dumps rules or routes with |dumpAction| and deletes the ones for which |shouldDelete| returns
+// true, by sending each one back with |deleteAction|, the same way iproute2 does. All the deletes
+// for one dump go out in one batch. Something else may delete a rule or route between the dump and
+// the delete (e.g., the kernel removes an interface's routes when it goes down), so ENOENT and
+// ESRCH are not errors.
+// Returns the number of rules or routes deleted, or negative errno on failure.
+WARN_UNUSED_RESULT int flushNetlink(uint16_t dumpAction, uint16_t deleteAction, iovec* iov,
+                                    int iovlen,
+                                    const std::function<bool(const nlmsghdr*)>& shouldDelete) {
+    int deleted = 0;
+    unsigned attempts = 0;
+    bool interrupted;
+    do {
+        NetlinkBatch deletes;
+        auto addDelete = [&] (const nlmsghdr* nlh) {
+            if (!shouldDelete(nlh)) {
+                return;
+            }
+            iovec deleteIov[] = {
+                { NULL,                                                   0 },
+                { const_cast<void*>(NLMSG_DATA(nlh)), nlh->nlmsg_len - NLMSG_HDRLEN },
+            };
+            deletes.add(deleteAction, NETLINK_REQUEST_FLAGS, deleteIov, ARRAY_SIZE(deleteIov));
+        };
+        if (int ret = dumpNetlink(dumpAction, iov, iovlen, addDelete, &interrupted)) {
+            return ret;
+        }
+
+        std::vector<int> errors;
+        int ret = deletes.send(&errors);
+        if (ret && errors.empty()) {
+            return ret;  // The channel failed, not the deletes.
+        }
+        for (int error : errors) {
+            if (!error) {
+                ++deleted;
+            } else if (error != -ENOENT && error != -ESRCH) {
+                ALOGE("netlink %s request failed (%s)", netlinkActionName(deleteAction),
+                      strerror(-error));
+                return error;
+            }
+        }
+        ++attempts;
+    } while (interrupted && attempts < ROUTE_FLUSH_ATTEMPTS);
+
+    return deleted;
 }
 
 // Returns 0 on success or negative errno on failure.
@@ -332,6 +1136,8 @@ WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint8_t
         { PADDING_BUFFER,    oifPadding },
     };
 
+    // Send the rules for both families in one go.
+    ScopedNetlinkBatch batch;
     uint16_t flags = (action == RTM_NEWRULE) ? NETLINK_CREATE_REQUEST_FLAGS : NETLINK_REQUEST_FLAGS;
     for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
         rule.family = AF_FAMILIES[i];
@@ -340,7 +1146,7 @@ WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint8_t
         }
     }
 
-    return 0;
+    return batch.commit();
 }
 
 WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint32_t table,
@@ -383,7 +1189,7 @@ WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char
     }
 
     uint8_t type = RTN_UNICAST;
-    uint32_t ifindex;
+    uint32_t ifindex = 0;
     uint8_t rawNexthop[sizeof(in6_addr)];
 
     if (nexthop && !strcmp(nexthop, "unreachable")) {
@@ -400,7 +1206,7 @@ WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char
     } else {
         // If an interface was specified, find the ifindex.
         if (interface != OIF_NONE) {
-            ifindex = if_nametoindex(interface);
+            ifindex = getInterfaceIndex(interface);
             if (!ifindex) {
                 ALOGE("cannot find interface %s", interface);
                 return -ENODEV;
@@ -441,7 +1247,12 @@ WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char
 
     uint16_t flags = (action == RTM_NEWROUTE) ? NETLINK_CREATE_REQUEST_FLAGS :
                                                 NETLINK_REQUEST_FLAGS;
-    return sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov));
+    int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov));
+    if (ret == -ENODEV && interface != OIF_NONE) {
+        // The cached index may belong to an interface that no longer exists.
+        dropInterfaceIndex(interface, ifindex);
+    }
+    return ret;
 }
 
 // An iptables rule to mark incoming packets on a network with the netId of the network.
@@ -463,8 +1274,8 @@ WARN_UNUSED_RESULT int modifyIncomingPacketMark(unsigned netId, const char* inte
     char markString[UINT32_HEX_STRLEN];
     snprintf(markString, sizeof(markString), "0x%x", fwmark.intValue);
 
-    if (execIptables(V4V6, "-t", "mangle", add ? "-A" : "-D", "INPUT", "-i", interface, "-j",
-                     "MARK", "--set-mark", markString, NULL)) {
+    if (iptablesFunction(V4V6, "-t", "mangle", add ? "-A" : "-D", "INPUT", "-i", interface,
+                         "-j", "MARK", "--set-mark", markString, NULL)) {
         ALOGE("failed to change iptables rule that sets incoming packet mark");
         return -EREMOTEIO;
     }
@@ -472,6 +1283,14 @@ WARN_UNUSED_RESULT int modifyIncomingPacketMark(unsigned netId, const char* inte
     return 0;
 }
 
+// Reverts a successful modifyIncomingPacketMark() after the rules that went with it failed.
+void undoIncomingPacketMark(unsigned netId, const char* interface, Permission permission,
+                            bool add) {
+    if (modifyIncomingPacketMark(netId, interface, permission, !add)) {
+        ALOGE("failed to undo incoming packet mark for %s", interface);
+    }
+}
+
 // A rule to route responses to the local network forwarded via the VPN.
 //
 // When a VPN is in effect, packets from the local network to upstream networks are forwarded into
@@ -571,6 +1390,8 @@ WARN_UNUSED_RESULT int modifyOutputInterfaceRules(const char* interface, uint32_
     fwmark.permission = permission;
     mask.permission = permission;
 
+    ScopedNetlinkBatch batch;
+
     // If this rule does not specify a UID range, then also add a corresponding high-priority rule
     // for UID. This covers forwarded packets and system daemons such as the tethering DHCP server.
     if (uidStart == INVALID_UID && uidEnd == INVALID_UID) {
@@ -581,8 +1402,13 @@ WARN_UNUSED_RESULT int modifyOutputInterfaceRules(const char* interface, uint32_
         }
     }
 
-    return modifyIpRule(add ? RTM_NEWRULE : RTM_DELRULE, RULE_PRIORITY_OUTPUT_INTERFACE, table,
-                        fwmark.intValue, mask.intValue, IIF_NONE, interface, uidStart, uidEnd);
+    if (int ret = modifyIpRule(add ? RTM_NEWRULE : RTM_DELRULE, RULE_PRIORITY_OUTPUT_INTERFACE,
+                               table, fwmark.intValue, mask.intValue, IIF_NONE, interface,
+                               uidStart, uidEnd)) {
+        return ret;
+    }
+
+    return batch.commit();
 }
 
 // A rule to route traffic based on the chosen network.
@@ -758,15 +1584,25 @@ WARN_UNUSED_RESULT int modifyPhysicalNetwork(unsigned netId, const char* interfa
     if (int ret = modifyIncomingPacketMark(netId, interface, permission, add)) {
         return ret;
     }
-    if (int ret = modifyExplicitNetworkRule(netId, table, permission, INVALID_UID, INVALID_UID,
-                                            add)) {
-        return ret;
+
+    // MARK targets don't stop rule traversal, so a mark left behind by a failed request would
+    // override the marks of the rules before it.
+    ScopedNetlinkBatch batch;
+    int ret = modifyExplicitNetworkRule(netId, table, permission, INVALID_UID, INVALID_UID, add);
+    if (!ret) {
+        ret = modifyOutputInterfaceRules(interface, table, permission, INVALID_UID, INVALID_UID,
+                                         add);
     }
-    if (int ret = modifyOutputInterfaceRules(interface, table, permission, INVALID_UID, INVALID_UID,
-                                            add)) {
-        return ret;
+    if (!ret) {
+        ret = modifyImplicitNetworkRule(netId, table, permission, add);
+    }
+    if (!ret) {
+        ret = batch.commitOrUndo();
     }
-    return modifyImplicitNetworkRule(netId, table, permission, add);
+    if (ret) {
+        undoIncomingPacketMark(netId, interface, permission, add);
+    }
+    return ret;
 }
 
 WARN_UNUSED_RESULT int modifyRejectNonSecureNetworkRule(const UidRanges& uidRanges, bool add) {
@@ -775,6 +1611,8 @@ WARN_UNUSED_RESULT int modifyRejectNonSecureNetworkRule(const UidRanges& uidRang
     fwmark.protectedFromVpn = false;
     mask.protectedFromVpn = true;
 
+    // Either all the ranges are changed, or none of them are.
+    ScopedNetlinkBatch batch;
     for (const UidRanges::Range& range : uidRanges.getRanges()) {
         if (int ret = modifyIpRule(add ? RTM_NEWRULE : RTM_DELRULE,
                                    RULE_PRIORITY_PROHIBIT_NON_VPN, FR_ACT_PROHIBIT, RT_TABLE_UNSPEC,
@@ -784,7 +1622,7 @@ WARN_UNUSED_RESULT int modifyRejectNonSecureNetworkRule(const UidRanges& uidRang
         }
     }
 
-    return 0;
+    return batch.commitOrUndo();
 }
 
 WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interface,
@@ -795,6 +1633,10 @@ WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interfac
         return -ESRCH;
     }
 
+    // All the rules for all the UID ranges go out in one batch. With many ranges, this is much
+    // faster than one round trip per rule. If any rule fails, the batch is undone, so that a VPN
+    // doesn't end up applying to some of its UID ranges but not others.
+    ScopedNetlinkBatch batch;
     for (const UidRanges::Range& range : uidRanges.getRanges()) {
         if (int ret = modifyVpnUidRangeRule(table, range.first, range.second, secure, add)) {
             return ret;
@@ -810,18 +1652,27 @@ WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interfac
     }
 
     if (modifyNonUidBasedRules) {
-        if (int ret = modifyIncomingPacketMark(netId, interface, PERMISSION_NONE, add)) {
-            return ret;
-        }
         if (int ret = modifyVpnOutputToLocalRule(interface, add)) {
             return ret;
         }
         if (int ret = modifyVpnSystemPermissionRule(netId, table, secure, add)) {
             return ret;
         }
-        return modifyExplicitNetworkRule(netId, table, PERMISSION_NONE, UID_ROOT, UID_ROOT, add);
+        if (int ret = modifyExplicitNetworkRule(netId, table, PERMISSION_NONE, UID_ROOT, UID_ROOT,
+                                                add)) {
+            return ret;
+        }
+        if (int ret = modifyIncomingPacketMark(netId, interface, PERMISSION_NONE, add)) {
+            return ret;
+        }
     }
 
+    if (int ret = batch.commitOrUndo()) {
+        if (modifyNonUidBasedRules) {
+            undoIncomingPacketMark(netId, interface, PERMISSION_NONE, add);
+        }
+        return ret;
+    }
     return 0;
 }
 
@@ -856,28 +1707,156 @@ WARN_UNUSED_RESULT int modifyTetheredNetwork(uint16_t action, const char* inputI
                         inputInterface, OIF_NONE, INVALID_UID, INVALID_UID);
 }
 
+// Deletes all rules except the one at priority 0 (which looks up the local table and can't be
+// changed), like "ip rule flush".
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int flushRules() {
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "rule",
-            "flush",
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        fib_rule_hdr rule = {
+            .family = AF_FAMILIES[i],
+        };
+        iovec iov[] = {
+            { NULL,  0 },
+            { &rule, sizeof(rule) },
+        };
+        auto shouldDelete = [] (const nlmsghdr* nlh) {
+            // The kernel omits FRA_PRIORITY for rules at priority 0.
+            const rtattr* rta = findAttribute(
+                    reinterpret_cast<const rtattr*>(
+                            static_cast<const uint8_t*>(NLMSG_DATA(nlh)) +
+                            NLMSG_ALIGN(sizeof(fib_rule_hdr))),
+                    nlh->nlmsg_len - NLMSG_LENGTH(sizeof(fib_rule_hdr)), FRA_PRIORITY);
+            return getU32Attribute(rta, 0) != 0;
         };
-        if (android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv), NULL, false, false)) {
-            ALOGE("failed to flush rules");
-            return -EREMOTEIO;
+        int ret = flushNetlink(RTM_GETRULE, RTM_DELRULE, iov, ARRAY_SIZE(iov), shouldDelete);
+        if (ret < 0) {
+            ALOGE("failed to flush rules (%s)", strerror(-ret));
+            return ret;
         }
+        ALOGI("Flushed %d IPv%d rules", ret, AF_FAMILIES[i] == AF_INET ? 4 : 6);
     }
     return 0;
 }
 
+// Returns the ID of the current boot, or an empty string if it can't be read.
+std::string getBootId() {
+    std::string bootId;
+    if (!ReadFileToString(BOOT_ID_PATH, &bootId)) {
+        ALOGE("failed to read %s (%s)", BOOT_ID_PATH, strerror(errno));
+        return "";
+    }
+    return bootId;
+}
+
+// Returns true if netd already configured routing earlier in this boot, and warm restarts are
+// enabled.
+bool isWarmRestart(const std::string& bootId) {
+    char enabled[PROPERTY_VALUE_MAX];
+    property_get(WARM_RESTART_PROPERTY, enabled, "0");
+    if (strcmp(enabled, "1")) {
+        return false;
+    }
+    std::string journal;
+    return !bootId.empty() && ReadFileToString(ROUTE_JOURNAL_PATH, &journal) && journal == bootId;
+}
+
+void writeRouteJournal(const std::string& bootId) {
+    if (bootId.empty()) {
+        return;
+    }
+    if (!WriteStringToFile(bootId, ROUTE_JOURNAL_PATH, ROUTE_JOURNAL_MODE, AID_ROOT, AID_ROOT)) {
+        ALOGE("failed to write %s (%s)", ROUTE_JOURNAL_PATH, strerror(errno));
+    }
+}
+
+// Reads back the interface tables that the previous instance of netd recorded in the table names
+// file, so that routes can still be flushed from the tables of interfaces that have gone away.
+void loadTableNamesFile() {
+    std::string contents;
+    if (!ReadFileToString(RT_TABLES_PATH, &contents)) {
+        return;
+    }
+    std::istringstream lines(contents);
+    std::string line;
+    while (std::getline(lines, line)) {
+        char name[IFNAMSIZ];
+        uint32_t table;
+        if (sscanf(line.c_str(), "%u %15s", &table, name) == 2 &&
+                table >= RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX) {
+            interfaceToTable.insert({name, table});
+        }
+    }
+}
+
+// Records the netd rules and routes currently in the kernel as leftovers of the previous instance
+// of netd. Returns the number recorded, or negative errno on failure.
+WARN_UNUSED_RESULT int recordWarmRestartLeftovers() {
+    auto record = [] (const nlmsghdr* nlh) {
+        std::string key = netlinkKey(nlh);
+        if (!key.empty()) {
+            warmRestartLeftovers.insert(key);
+        }
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        fib_rule_hdr rule = {
+            .family = AF_FAMILIES[i],
+        };
+        rtmsg route = {
+            .rtm_family = AF_FAMILIES[i],
+        };
+        iovec ruleIov[] = {
+            { NULL,  0 },
+            { &rule, sizeof(rule) },
+        };
+        iovec routeIov[] = {
+            { NULL,   0 },
+            { &route, sizeof(route) },
+        };
+        // If something changed while dumping, the leftovers may be incomplete, and anything
+        // missing would never be cleaned up. Start from scratch instead.
+        bool interrupted;
+        if (int ret = dumpNetlink(RTM_GETRULE, ruleIov, ARRAY_SIZE(ruleIov), record,
+                                  &interrupted)) {
+            return ret;
+        }
+        if (interrupted) {
+            return -EAGAIN;
+        }
+        if (int ret = dumpNetlink(RTM_GETROUTE, routeIov, ARRAY_SIZE(routeIov), record,
+                                  &interrupted)) {
+            return ret;
+        }
+        if (interrupted) {
+            return -EAGAIN;
+        }
+    }
+    return warmRestartLeftovers.size();
+}
+
+// Starts a warm restart, which keeps the rules and routes of the previous instance of netd in
+// place instead of flushing them. Returns 0 on success or negative errno on failure, in which case
+// the caller should fall back to a cold start.
+WARN_UNUSED_RESULT int startWarmRestart() {
+    int leftovers = recordWarmRestartLeftovers();
+    if (leftovers < 0) {
+        ALOGE("failed to dump rules and routes for warm restart (%s)", strerror(-leftovers));
+        warmRestartLeftovers.clear();
+        return leftovers;
+    }
+    warmRestartPending = true;
+    warmRestartLastRequest = std::chrono::steady_clock::now().time_since_epoch().count();
+    loadTableNamesFile();
+    ALOGI("Warm restart: keeping %d rules and routes until the framework replays its state",
+          leftovers);
+    return 0;
+}
+
 // Adds or removes an IPv4 or IPv6 route to the specified table and, if it's a directly-connected
 // route, to the main table as well.
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const char* destination,
-                                   const char* nexthop, RouteController::TableType tableType) {
+                                   const char* nexthop, RouteController::TableType tableType,
+                                   bool retryOnStaleIndex = true) {
     uint32_t table;
     switch (tableType) {
         case RouteController::INTERFACE: {
@@ -902,6 +1881,12 @@ WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const
     }
 
     int ret = modifyIpRoute(action, table, interface, destination, nexthop);
+    // If the interface was recreated under the same name and the link events haven't been
+    // processed yet, the cached index was stale and modifyIpRoute() has dropped it. Try once more,
+    // with the table and index that the kernel reports now.
+    if (ret == -ENODEV && retryOnStaleIndex) {
+        return modifyRoute(action, interface, destination, nexthop, tableType, false);
+    }
     // Trying to add a route that already exists shouldn't cause an error.
     if (ret && !(action == RTM_NEWROUTE && ret == -EEXIST)) {
         return ret;
@@ -912,55 +1897,67 @@ WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const
 
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
+    // The routes are dumped and deleted right away, which would be out of order with the requests
+    // queued in the batch.
+    if (currentBatch) {
+        ALOGE("cannot flush routes in a batch");
+        return -EBUSY;
+    }
+
     uint32_t table = getRouteTableForInterface(interface);
     if (table == RT_TABLE_UNSPEC) {
         return -ESRCH;
     }
 
-    char tableString[UINT32_STRLEN];
-    snprintf(tableString, sizeof(tableString), "%u", table);
-
     int ret = 0;
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "route",
-            "flush",
-            "table",
-            tableString,
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        rtmsg route = {
+            .rtm_family = AF_FAMILIES[i],
         };
-
-        // A flush works by dumping routes and deleting each route as it's returned, and it can
-        // fail if something else deletes the route between the dump and the delete. This can
-        // happen, for example, if an interface goes down while we're trying to flush its routes.
-        // So try multiple times and only return an error if the last attempt fails.
-        //
-        // TODO: replace this with our own netlink code.
-        unsigned attempts = 0;
-        int err;
-        do {
-            err = android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv),
-                                      NULL, false, false);
-            ++attempts;
-        } while (err != 0 && attempts < ROUTE_FLUSH_ATTEMPTS);
-        if (err) {
-            ALOGE("failed to flush %s routes in table %s after %d attempts",
-                  IP_VERSIONS[i], tableString, attempts);
-            ret = -EREMOTEIO;
+        iovec iov[] = {
+            { NULL,   0 },
+            { &route, sizeof(route) },
+        };
+        // Older kernels ignore the filter in a dump request, so look at every route and pick the
+        // ones in our table. Skip cloned (cached) IPv6 routes; they aren't really in the table.
+        auto shouldDelete = [table] (const nlmsghdr* nlh) {
+            const rtmsg* rtm = static_cast<const rtmsg*>(NLMSG_DATA(nlh));
+            if (rtm->rtm_flags & RTM_F_CLONED) {
+                return false;
+            }
+            const rtattr* rta = findAttribute(RTM_RTA(rtm), RTM_PAYLOAD(nlh), RTA_TABLE);
+            return getU32Attribute(rta, rtm->rtm_table) == table;
+        };
+        int flushed = flushNetlink(RTM_GETROUTE, RTM_DELROUTE, iov, ARRAY_SIZE(iov),
+                                   shouldDelete);
+        if (flushed < 0) {
+            ALOGE("failed to flush IPv%d routes in table %u (%s)",
+                  AF_FAMILIES[i] == AF_INET ? 4 : 6, table, strerror(-flushed));
+            ret = flushed;
+        } else {
+            ALOGI("Flushed %d IPv%d routes from table %u", flushed,
+                  AF_FAMILIES[i] == AF_INET ? 4 : 6, table);
         }
     }
 
     // If we failed to flush routes, the caller may elect to keep this interface around, so keep
     // track of its name.
     if (!ret) {
-        interfaceToTable.erase(interface);
+        if (interfaceToTable.erase(interface)) {
+            interfaceToTableDirty = true;
+        }
     }
 
     return ret;
 }
 
 WARN_UNUSED_RESULT int clearTetheringRules(const char* inputInterface) {
+    // Each delete is sent immediately so we can tell when there are no rules left.
+    if (currentBatch) {
+        ALOGE("cannot clear tethering rules in a batch");
+        return -EBUSY;
+    }
+
     int ret = 0;
     while (ret == 0) {
         ret = modifyIpRule(RTM_DELRULE, RULE_PRIORITY_TETHERING, 0, MARK_UNSET, MARK_UNSET,
@@ -976,10 +1973,38 @@ WARN_UNUSED_RESULT int clearTetheringRules(const char* inputInterface) {
 
 }  // namespace
 
+void RouteController::setNetlinkSocketForTest(int fd) {
+    testNetlinkSocket = fd;
+    iptablesFunction = (fd == -1) ? execIptables : noIptables;
+}
+
+void RouteController::setIptablesFunctionForTest(int (*function)(IptablesTarget target, ...)) {
+    iptablesFunction = function;
+}
+
+struct RouteController::Transaction::Batch {
+    ScopedNetlinkBatch batch;
+};
+
+RouteController::Transaction::Transaction() : mBatch(new Batch) {
+}
+
+RouteController::Transaction::~Transaction() {
+}
+
+int RouteController::Transaction::commit() {
+    return mBatch->batch.commitOrUndo();
+}
+
 int RouteController::Init(unsigned localNetId) {
-    if (int ret = flushRules()) {
-        return ret;
+    const std::string bootId = getBootId();
+    if (!isWarmRestart(bootId) || startWarmRestart()) {
+        if (int ret = flushRules()) {
+            return ret;
+        }
     }
+
+    ScopedNetlinkBatch batch;
     if (int ret = addLegacyRouteRules()) {
         return ret;
     }
@@ -992,13 +2017,99 @@ int RouteController::Init(unsigned localNetId) {
     if (int ret = addUnreachableRule()) {
         return ret;
     }
+    if (int ret = batch.commit()) {
+        return ret;
+    }
+
     // Don't complain if we can't add the dummy network, since not all devices support it.
     configureDummyNetwork();
 
     updateTableNamesFile();
+    writeRouteJournal(bootId);
     return 0;
 }
 
+bool RouteController::isWarmRestartPending() {
+    return warmRestartPending;
+}
+
+std::chrono::steady_clock::time_point RouteController::getWarmRestartLastRequest() {
+    return std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(warmRestartLastRequest.load()));
+}
+
+int RouteController::finishWarmRestart() {
+    if (!warmRestartPending) {
+        return 0;
+    }
+    warmRestartPending = false;
+
+    auto isLeftover = [] (const nlmsghdr* nlh) {
+        return warmRestartLeftovers.count(netlinkKey(nlh)) > 0;
+    };
+    int ret = 0;
+    int rules = 0;
+    int routes = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        fib_rule_hdr rule = {
+            .family = AF_FAMILIES[i],
+        };
+        rtmsg route = {
+            .rtm_family = AF_FAMILIES[i],
+        };
+        iovec ruleIov[] = {
+            { NULL,  0 },
+            { &rule, sizeof(rule) },
+        };
+        iovec routeIov[] = {
+            { NULL,   0 },
+            { &route, sizeof(route) },
+        };
+        int flushed = flushNetlink(RTM_GETRULE, RTM_DELRULE, ruleIov, ARRAY_SIZE(ruleIov),
+                                   isLeftover);
+        if (flushed < 0) {
+            ret = flushed;
+        } else {
+            rules += flushed;
+        }
+        flushed = flushNetlink(RTM_GETROUTE, RTM_DELROUTE, routeIov, ARRAY_SIZE(routeIov),
+                               isLeftover);
+        if (flushed < 0) {
+            ret = flushed;
+        } else {
+            routes += flushed;
+        }
+    }
+    warmRestartLeftovers.clear();
+
+    if (ret) {
+        ALOGE("failed to remove stale rules and routes after warm restart (%s)", strerror(-ret));
+        return ret;
+    }
+    ALOGI("Warm restart finished, removed %d stale rules and %d stale routes", rules, routes);
+    return 0;
+}
+
+void RouteController::updateInterfaceIndex(const char* interface, unsigned index) {
+    if (!interface || !interface[0] || !index) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(interfaceIndexLock);
+    interfaceIndices[interface] = index;
+}
+
+void RouteController::removeInterfaceIndex(const char* interface, unsigned index) {
+    if (!interface) {
+        return;
+    }
+    if (index) {
+        dropInterfaceIndex(interface, index);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(interfaceIndexLock);
+    interfaceIndices.erase(interface);
+}
+
 int RouteController::addInterfaceToLocalNetwork(unsigned netId, const char* interface) {
     return modifyLocalNetwork(netId, interface, ACTION_ADD);
 }
@@ -1057,11 +2168,25 @@ int RouteController::removeInterfaceFromVirtualNetwork(unsigned netId, const cha
 int RouteController::modifyPhysicalNetworkPermission(unsigned netId, const char* interface,
                                                      Permission oldPermission,
                                                      Permission newPermission) {
-    // Add the new rules before deleting the old ones, to avoid race conditions.
+    // Add the new rules before deleting the old ones, to avoid race conditions. The kernel applies
+    // the messages in a batch in order, so sending both sets at once preserves this. The kernel
+    // also carries on after a failure, so if any of the new rules can't be added, undo the whole
+    // batch; otherwise the interface would be left without the rules for either permission. The
+    // incoming packet marks are changed right away, so they have to be put back by hand.
+    ScopedNetlinkBatch batch;
     if (int ret = modifyPhysicalNetwork(netId, interface, newPermission, ACTION_ADD)) {
         return ret;
     }
-    return modifyPhysicalNetwork(netId, interface, oldPermission, ACTION_DEL);
+    if (int ret = modifyPhysicalNetwork(netId, interface, oldPermission, ACTION_DEL)) {
+        undoIncomingPacketMark(netId, interface, newPermission, ACTION_ADD);
+        return ret;
+    }
+    if (int ret = batch.commitOrUndo()) {
+        undoIncomingPacketMark(netId, interface, newPermission, ACTION_ADD);
+        undoIncomingPacketMark(netId, interface, oldPermission, ACTION_DEL);
+        return ret;
+    }
+    return 0;
 }
 
 int RouteController::addUsersToRejectNonSecureNetworkRule(const UidRanges& uidRanges) {
@@ -20,6 +20,8 @@
 #include "NetdConstants.h"
 #include "Permission.h"
 
+#include <chrono>
+#include <memory>
 #include <sys/types.h>
 
 class UidRanges;
@@ -36,7 +38,51 @@ public:
 
     static const int ROUTE_TABLE_OFFSET_FROM_INDEX = 1000;
 
+    // While a Transaction is in scope, the rules and routes added or removed by the methods below
+    // are not sent to the kernel right away. Instead, commit() sends them all in one batch, and if
+    // any of them fails, undoes the others. Changes that have not been committed when the
+    // Transaction goes out of scope are discarded. Other side effects, such as iptables changes,
+    // are not deferred.
+    //
+    // Methods that remove interfaces from networks need the result of each request to decide what
+    // to do next, and fail if called inside a Transaction.
+    class Transaction {
+    public:
+        Transaction();
+        ~Transaction();
+
+        int commit() WARN_UNUSED_RESULT;
+
+    private:
+        struct Batch;
+        std::unique_ptr<Batch> mBatch;
+    };
+
+    // If netd already configured routing earlier in this boot (i.e., it was restarted), Init()
+    // keeps the existing rules and routes so that traffic keeps flowing, and only adds what's
+    // missing. Requests to add rules and routes that are already there succeed. finishWarmRestart()
+    // then deletes whatever the framework hasn't asked for again.
+    //
+    // netd doesn't persist its networks, only the fact that it configured routing in this boot.
+    // So this is only correct if the framework replays all of its networks before
+    // finishWarmRestart() is called; anything it replays later has lost its rules by then. The
+    // caller should wait until the framework has stopped making requests, using
+    // getWarmRestartLastRequest(). Warm restarts are off unless turned on with a system property.
     static int Init(unsigned localNetId) WARN_UNUSED_RESULT;
+    static bool isWarmRestartPending();
+    static int finishWarmRestart() WARN_UNUSED_RESULT;
+
+    // When the warm restart started, or a rule or route was last requested during it. Unlike the
+    // rest of RouteController, this may be called from any thread.
+    static std::chrono::steady_clock::time_point getWarmRestartLastRequest();
+
+    // Keep the cache of interface indices used to compute table numbers up to date. Called by
+    // NetlinkHandler when the kernel reports that an interface was added or removed, with the
+    // index from the event (0 if the event didn't have one, in which case adding does nothing and
+    // removing forgets the interface regardless of its index).
+    // Unlike the rest of RouteController, these may be called from any thread.
+    static void updateInterfaceIndex(const char* interface, unsigned index);
+    static void removeInterfaceIndex(const char* interface, unsigned index);
 
     static int addInterfaceToLocalNetwork(unsigned netId, const char* interface) WARN_UNUSED_RESULT;
     static int removeInterfaceFromLocalNetwork(unsigned netId,
@@ -87,6 +133,20 @@ public:
                                             Permission permission) WARN_UNUSED_RESULT;
     static int removeVirtualNetworkFallthrough(unsigned vpnNetId, const char* physicalInterface,
                                                Permission permission) WARN_UNUSED_RESULT;
+
+private:
+    friend class RouteControllerFixture;
+    friend class RouteControllerTest;
+
+    // Sends netlink requests to |fd| instead of the kernel, and doesn't run iptables, so that
+    // tests and benchmarks can run without root and without changing the device's routing. |fd|
+    // must behave like a connected NETLINK_ROUTE socket and is not closed by RouteController.
+    // Passing -1 goes back to using the kernel.
+    static void setNetlinkSocketForTest(int fd);
+
+    // Runs |function| instead of iptables. Must be called after setNetlinkSocketForTest(), which
+    // resets it.
+    static void setIptablesFunctionForTest(int (*function)(IptablesTarget target, ...));
 };
 
 #endif  // NETD_SERVER_ROUTE_CONTROLLER_H
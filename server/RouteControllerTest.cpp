@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * RouteControllerTest.cpp - unit tests for RouteController.cpp
+ */
+
+#include <errno.h>
+#include <linux/rtnetlink.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Permission.h"
+#include "RouteController.h"
+#include "fake_netlink_route.h"
+
+// Every machine has a loopback interface, and RouteController needs a real interface index to
+// pick a routing table.
+constexpr char INTERFACE[] = "lo";
+constexpr unsigned NET_ID = 100;
+
+// The iptables rules that set the incoming packet mark, in order, as "interface mark".
+std::vector<std::string> sIncomingMarks;
+
+// Applies "-t mangle -A|-D INPUT -i <interface> -j MARK --set-mark <mark>" to sIncomingMarks.
+int fakeIptables(IptablesTarget target, ...) {
+    std::vector<std::string> args;
+    va_list ap;
+    va_start(ap, target);
+    while (const char* arg = va_arg(ap, const char*)) {
+        args.push_back(arg);
+    }
+    va_end(ap);
+    if (args.size() != 10 || args[3] != "INPUT") {
+        return 0;
+    }
+
+    const std::string rule = args[5] + " " + args[9];
+    if (args[2] == "-A") {
+        sIncomingMarks.push_back(rule);
+        return 0;
+    }
+    auto it = std::find(sIncomingMarks.begin(), sIncomingMarks.end(), rule);
+    if (it == sIncomingMarks.end()) {
+        return 1;
+    }
+    sIncomingMarks.erase(it);
+    return 0;
+}
+
+// Sends RouteController's netlink requests to a FakeNetlinkRoute, so these tests don't need root
+// and don't change the routing configuration of the machine they run on.
+class RouteControllerTest : public ::testing::Test {
+protected:
+    FakeNetlinkRoute mFake;
+
+    void SetUp() override {
+        ASSERT_EQ(0, mFake.start());
+        RouteController::setNetlinkSocketForTest(mFake.clientSocket());
+        RouteController::setIptablesFunctionForTest(fakeIptables);
+        sIncomingMarks.clear();
+    }
+
+    void TearDown() override {
+        RouteController::setNetlinkSocketForTest(-1);
+        mFake.stop();
+    }
+};
+
+TEST_F(RouteControllerTest, ModifyPhysicalNetworkPermission) {
+    ASSERT_EQ(0, RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE,
+                                                                 PERMISSION_NONE));
+    const std::set<std::string> noneRules = mFake.rules();
+    ASSERT_FALSE(noneRules.empty());
+
+    EXPECT_EQ(0, RouteController::modifyPhysicalNetworkPermission(NET_ID, INTERFACE,
+                                                                  PERMISSION_NONE,
+                                                                  PERMISSION_NETWORK));
+    const std::set<std::string> networkRules = mFake.rules();
+    EXPECT_EQ(noneRules.size(), networkRules.size());
+    EXPECT_NE(noneRules, networkRules);
+
+    EXPECT_EQ(0, RouteController::modifyPhysicalNetworkPermission(NET_ID, INTERFACE,
+                                                                  PERMISSION_NETWORK,
+                                                                  PERMISSION_NONE));
+    EXPECT_EQ(noneRules, mFake.rules());
+}
+
+TEST_F(RouteControllerTest, ModifyPhysicalNetworkPermissionUndoesOnFailure) {
+    ASSERT_EQ(0, RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE,
+                                                                 PERMISSION_NONE));
+    const std::set<std::string> before = mFake.rules();
+    ASSERT_FALSE(before.empty());
+    const std::vector<std::string> marksBefore = sIncomingMarks;
+    ASSERT_EQ(1U, marksBefore.size());
+
+    // The kernel doesn't stop at the first failure in a batch, so without an undo, the other new
+    // rules would stay and the old rules would be deleted. The incoming packet mark for the new
+    // permission, which iptables has already added, must go too.
+    mFake.failNextRequest(RTM_NEWRULE, -ENOBUFS);
+    EXPECT_EQ(-ENOBUFS, RouteController::modifyPhysicalNetworkPermission(NET_ID, INTERFACE,
+                                                                         PERMISSION_NONE,
+                                                                         PERMISSION_NETWORK));
+    EXPECT_EQ(before, mFake.rules());
+    EXPECT_EQ(marksBefore, sIncomingMarks);
+
+    // Retrying leaves exactly one mark, for the new permission.
+    EXPECT_EQ(0, RouteController::modifyPhysicalNetworkPermission(NET_ID, INTERFACE,
+                                                                  PERMISSION_NONE,
+                                                                  PERMISSION_NETWORK));
+    EXPECT_EQ(1U, sIncomingMarks.size());
+    EXPECT_NE(marksBefore, sIncomingMarks);
+}
+
+TEST_F(RouteControllerTest, AddInterfaceToPhysicalNetworkUndoesOnFailure) {
+    mFake.failNextRequest(RTM_NEWRULE, -ENOBUFS);
+    EXPECT_EQ(-ENOBUFS, RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE,
+                                                                       PERMISSION_NONE));
+    EXPECT_EQ(0U, mFake.numRules());
+    EXPECT_TRUE(sIncomingMarks.empty());
+}
+
+TEST_F(RouteControllerTest, IgnoresStaleInterfaceIndex) {
+    ASSERT_EQ(0, RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE,
+                                                                 PERMISSION_NONE));
+    ASSERT_NE(0U, mFake.numRules());
+
+    // Pretend that a link event for an interface that has since been deleted and recreated under
+    // the same name hasn't been superseded yet. The table number computed from the cached index
+    // no longer matches, so RouteController must check with the kernel instead of trusting it.
+    RouteController::updateInterfaceIndex(INTERFACE, 12345);
+    EXPECT_EQ(0, RouteController::removeInterfaceFromPhysicalNetwork(NET_ID, INTERFACE,
+                                                                      PERMISSION_NONE));
+    EXPECT_EQ(0U, mFake.numRules());
+
+    RouteController::removeInterfaceIndex(INTERFACE, 0);
+}
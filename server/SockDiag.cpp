@@ -28,6 +28,7 @@
 
 #define LOG_TAG "Netd"
 
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <cutils/log.h>
 
@@ -38,6 +39,7 @@
 #include "Stopwatch.h"
 
 #include <chrono>
+#include <thread>
 
 #ifndef SOCK_DESTROY
 #define SOCK_DESTROY 21
@@ -45,20 +47,70 @@
 
 #define INET_DIAG_BC_MARK_COND 10
 
+using android::base::StringPrintf;
+
 namespace {
 
-int checkError(int fd) {
+// The protocols that SockDiag::Protocol can select, in the order of mProtocolsDestroyed.
+const struct {
+    uint32_t flag;
+    uint8_t proto;
+    const char *name;
+} kProtocols[] = {
+    { SockDiag::PROTO_TCP,     IPPROTO_TCP,     "TCP" },
+    { SockDiag::PROTO_UDP,     IPPROTO_UDP,     "UDP" },
+    { SockDiag::PROTO_UDPLITE, IPPROTO_UDPLITE, "UDP-lite" },
+};
+
+// The states of sockets that are still carrying traffic. UDP has no handshake, and only connected
+// UDP sockets (which the kernel reports as TCP_ESTABLISHED) are tied to a particular path.
+uint32_t liveStates(uint8_t proto) {
+    if (proto == IPPROTO_TCP) {
+        return (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
+    }
+    return 1 << TCP_ESTABLISHED;
+}
+
+// The states of sockets to destroy when one of their addresses goes away. A TCP socket on the
+// address can't be used any more whatever its state, except TIME_WAIT, which the kernel can't
+// destroy. An unconnected UDP socket, though, has no connection to break, and destroying it would
+// only make a server that's bound to the address fail.
+uint32_t addressStates(uint8_t proto) {
+    if (proto == IPPROTO_TCP) {
+        return ~(1 << TCP_TIME_WAIT);
+    }
+    return liveStates(proto);
+}
+
+// Kernels built without udp_diag fail UDP and UDP-lite dumps with ENOENT. That shouldn't stop us
+// from destroying TCP sockets, so callers skip the protocol if this returns true.
+bool isUnsupportedProtocol(uint8_t proto, int ret) {
+    return proto != IPPROTO_TCP && ret == -ENOENT;
+}
+
+bool skipUnsupportedProtocol(uint8_t proto, const char *name, int ret) {
+    if (!isUnsupportedProtocol(proto, ret)) {
+        return false;
+    }
+    ALOGW("Kernel cannot dump %s sockets, not destroying them", name);
+    return true;
+}
+
+// Adds the number of system calls made to |*syscalls|.
+int checkError(int fd, int *syscalls) {
     struct {
         nlmsghdr h;
         nlmsgerr err;
     } __attribute__((__packed__)) ack;
     ssize_t bytesread = recv(fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_PEEK);
+    (*syscalls)++;
     if (bytesread == -1) {
        // Read failed (error), or nothing to read (good).
        return (errno == EAGAIN) ? 0 : -errno;
     } else if (bytesread == (ssize_t) sizeof(ack) && ack.h.nlmsg_type == NLMSG_ERROR) {
         // We got an error. Consume it.
         recv(fd, &ack, sizeof(ack), 0);
+        (*syscalls)++;
         return ack.err.error;
     } else {
         // The kernel replied with something. Leave it to the caller.
@@ -66,6 +118,91 @@ int checkError(int fd) {
     }
 }
 
+// A source or destination address match in a SOCK_DIAG bytecode program.
+struct HostCondition {
+    uint8_t code;
+    uint8_t family;
+    uint8_t prefixlen;
+    const void *addr;
+    uint8_t addrlen;
+};
+
+// Returns a SOCK_DIAG bytecode program that tries |conditions| in order. If |acceptMatches| is
+// true, the program accepts sockets that match any of the conditions and rejects all others.
+// Otherwise, it rejects sockets that match any of them and accepts all others. An IPv4 condition
+// also matches IPv4-mapped IPv6 addresses.
+//
+// Each condition is followed by a JMP, as in destroySocketsLackingPermission(), so that the "yes"
+// targets form the linear chain the kernel bytecode verifier requires. If a condition matches, it
+// falls through to its JMP, which jumps to the end of the program to accept the socket, or past
+// the end to reject it. Otherwise, it skips the JMP and tries the next condition. If none match,
+// the program runs to the end, through a final JMP that rejects if |acceptMatches| is true.
+std::vector<uint8_t> hostConditionBytecode(const std::vector<HostCondition>& conditions,
+                                           bool acceptMatches) {
+    struct hostmatch {
+        inet_diag_bc_op op;
+        inet_diag_hostcond cond;
+    } __attribute__((packed));
+
+    // The length of the INET_DIAG_BC_JMP instruction.
+    constexpr uint8_t jmplen = sizeof(inet_diag_bc_op);
+    // Jump exactly this far past the end of the program to reject.
+    constexpr uint8_t rejectoffset = sizeof(inet_diag_bc_op);
+
+    size_t bytecodelen = acceptMatches ? jmplen : 0;
+    for (const auto& c : conditions) {
+        bytecodelen += sizeof(hostmatch) + c.addrlen + jmplen;
+    }
+
+    std::vector<uint8_t> bytecode;
+    bytecode.reserve(bytecodelen);
+    auto append = [&bytecode] (const void *data, size_t len) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        bytecode.insert(bytecode.end(), bytes, bytes + len);
+    };
+
+    const uint8_t matchoffset = acceptMatches ? 0 : rejectoffset;
+    for (const auto& c : conditions) {
+        const uint8_t matchlen = sizeof(hostmatch) + c.addrlen;
+        hostmatch match = {
+            { c.code, matchlen, static_cast<unsigned short>(matchlen + jmplen) },
+            { c.family, c.prefixlen, -1 },
+        };
+        append(&match, sizeof(match));
+        append(c.addr, c.addrlen);
+
+        // Distance from this JMP to the end of the program.
+        const size_t remaining = bytecodelen - bytecode.size();
+        inet_diag_bc_op matchJump = {
+            INET_DIAG_BC_JMP, jmplen, static_cast<unsigned short>(remaining + matchoffset)
+        };
+        append(&matchJump, sizeof(matchJump));
+    }
+
+    if (acceptMatches) {
+        inet_diag_bc_op rejectJump = { INET_DIAG_BC_JMP, jmplen, jmplen + rejectoffset };
+        append(&rejectJump, sizeof(rejectJump));
+    }
+
+    return bytecode;
+}
+
+// Returns a SOCK_DIAG bytecode program that rejects sockets with a loopback source or destination
+// address and accepts all others.
+std::vector<uint8_t> excludeLoopbackBytecode() {
+    static const in_addr loopback4 = { htonl(INADDR_LOOPBACK) };
+    static const in6_addr loopback6 = IN6ADDR_LOOPBACK_INIT;
+    const std::vector<HostCondition> conditions = {
+        // 127.0.0.0/8.
+        { INET_DIAG_BC_S_COND, AF_INET,  8,   &loopback4, sizeof(loopback4) },
+        { INET_DIAG_BC_D_COND, AF_INET,  8,   &loopback4, sizeof(loopback4) },
+        // ::1/128.
+        { INET_DIAG_BC_S_COND, AF_INET6, 128, &loopback6, sizeof(loopback6) },
+        { INET_DIAG_BC_D_COND, AF_INET6, 128, &loopback6, sizeof(loopback6) },
+    };
+    return hostConditionBytecode(conditions, false /* acceptMatches */);
+}
+
 }  // namespace
 
 bool SockDiag::open() {
@@ -115,11 +252,12 @@ int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states,
     }
     request.nlh.nlmsg_len = len;
 
+    mSyscalls++;
     if (writev(mSock, iov, iovcnt) != (ssize_t) len) {
         return -errno;
     }
 
-    return checkError(mSock);
+    return checkError(mSock, &mSyscalls);
 }
 
 int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states) {
@@ -200,36 +338,57 @@ int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr
     return sendDumpRequest(proto, family, states, iov, ARRAY_SIZE(iov));
 }
 
+// Sockets to destroy are not destroyed one by one as they are found. Instead, the destroy requests
+// for each read are sent in one write once the read has been processed, which costs one write and
+// one read for up to a few hundred sockets instead of at least two system calls per socket.
 int SockDiag::readDiagMsg(uint8_t proto, SockDiag::DumpCallback callback) {
-    char buf[kBufferSize];
+    std::unique_ptr<char[]> buf(new char[kBufferSize]);
+    std::vector<DestroyRequest> destroys;
 
     ssize_t bytesread;
     do {
-        bytesread = read(mSock, buf, sizeof(buf));
+        bytesread = read(mSock, buf.get(), kBufferSize);
+        mSyscalls++;
 
         if (bytesread < 0) {
             return -errno;
         }
 
         uint32_t len = bytesread;
-        for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(buf);
+        for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(buf.get());
              NLMSG_OK(nlh, len);
              nlh = NLMSG_NEXT(nlh, len)) {
             switch (nlh->nlmsg_type) {
-              case NLMSG_DONE:
+              case NLMSG_DONE: {
                 callback(proto, NULL);
-                return 0;
+                int ret = sendDestroyBatch(&destroys);
+                // If the dump failed after it started (e.g., because there is no sock_diag handler
+                // for the protocol), the error is in the NLMSG_DONE message.
+                if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(int))) {
+                    int error = *reinterpret_cast<int *>(NLMSG_DATA(nlh));
+                    if (error < 0) return error;
+                }
+                return ret;
+              }
               case NLMSG_ERROR: {
                 nlmsgerr *err = reinterpret_cast<nlmsgerr *>(NLMSG_DATA(nlh));
+                sendDestroyBatch(&destroys);
                 return err->error;
               }
               default:
                 inet_diag_msg *msg = reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
                 if (callback(proto, msg)) {
-                    sockDestroy(proto, msg);
+                    destroys.emplace_back();
+                    fillDestroyRequest(proto, msg, &destroys.back());
                 }
             }
         }
+
+        // Send the requests for this read before reading more. This bounds the size of each write,
+        // and of the errors that it can queue on mWriteSock.
+        if (int ret = sendDestroyBatch(&destroys)) {
+            return ret;
+        }
     } while (bytesread > 0);
 
     return 0;
@@ -257,12 +416,9 @@ bool SockDiag::isLoopbackSocket(const inet_diag_msg *msg) {
     }
 }
 
-int SockDiag::sockDestroy(uint8_t proto, const inet_diag_msg *msg) {
-    if (msg == nullptr) {
-       return 0;
-    }
-
-    DestroyRequest request = {
+void SockDiag::fillDestroyRequest(uint8_t proto, const inet_diag_msg *msg,
+                                  DestroyRequest *request) {
+    *request = {
         .nlh = {
             .nlmsg_type = SOCK_DESTROY,
             .nlmsg_flags = NLM_F_REQUEST,
@@ -274,75 +430,287 @@ int SockDiag::sockDestroy(uint8_t proto, const inet_diag_msg *msg) {
             .id = msg->id,
         },
     };
-    request.nlh.nlmsg_len = sizeof(request);
+    request->nlh.nlmsg_len = sizeof(*request);
+}
+
+int SockDiag::sockDestroy(uint8_t proto, const inet_diag_msg *msg) {
+    if (msg == nullptr) {
+       return 0;
+    }
+
+    DestroyRequest request;
+    fillDestroyRequest(proto, msg, &request);
+    request.nlh.nlmsg_seq = ++mSeq;
 
+    mSyscalls++;
     if (write(mWriteSock, &request, sizeof(request)) < (ssize_t) sizeof(request)) {
         return -errno;
     }
 
-    int ret = checkError(mWriteSock);
-    if (!ret) mSocketsDestroyed++;
+    int ret = checkError(mWriteSock, &mSyscalls);
+    if (!ret) countDestroyed(proto, 1);
     return ret;
 }
 
-int SockDiag::destroySockets(uint8_t proto, int family, const char *addrstr) {
+void SockDiag::resetCounts() {
+    static_assert(ARRAY_SIZE(kProtocols) == ARRAY_SIZE(mProtocolsDestroyed),
+                  "Per-protocol counts don't match the protocol list");
+    mSocketsDestroyed = 0;
+    memset(mProtocolsDestroyed, 0, sizeof(mProtocolsDestroyed));
+    mSyscalls = 0;
+}
+
+void SockDiag::countDestroyed(uint8_t proto, int count) {
+    mSocketsDestroyed += count;
+    for (size_t i = 0; i < ARRAY_SIZE(kProtocols); i++) {
+        if (kProtocols[i].proto == proto) {
+            mProtocolsDestroyed[i] += count;
+        }
+    }
+}
+
+// Returns the number of sockets destroyed per protocol for log messages, e.g., "TCP=12 UDP=3".
+std::string SockDiag::destroyedString() const {
+    std::vector<std::string> counts;
+    for (size_t i = 0; i < ARRAY_SIZE(kProtocols); i++) {
+        if (mProtocolsDestroyed[i]) {
+            counts.push_back(StringPrintf("%s=%d", kProtocols[i].name, mProtocolsDestroyed[i]));
+        }
+    }
+    return android::base::Join(counts, " ");
+}
+
+// Sends all the requests in |requests|, which must all be for the same protocol, in one write and
+// clears it. Returns 0 on success, even if
+// some of the sockets could not be destroyed (e.g., because they were closed after the dump), or
+// negative errno if the requests could not be sent.
+int SockDiag::sendDestroyBatch(std::vector<DestroyRequest> *requests) {
+    static_assert(sizeof(DestroyRequest) % NLMSG_ALIGNTO == 0,
+                  "Destroy requests in a batch would not be aligned");
+
+    if (requests->empty()) {
+        return 0;
+    }
+
+    const uint32_t firstSeq = mSeq + 1;
+    for (DestroyRequest& request : *requests) {
+        request.nlh.nlmsg_seq = ++mSeq;
+    }
+
+    const ssize_t len = requests->size() * sizeof(DestroyRequest);
+    mSyscalls++;
+    if (write(mWriteSock, requests->data(), len) < len) {
+        requests->clear();
+        return -errno;
+    }
+
+    // The kernel processes all the requests before write() returns, and only replies to the ones
+    // that fail, so any errors are already queued. We only read their headers; the rest of each
+    // reply (a copy of the request) is discarded.
+    int failed = 0;
+    struct {
+        nlmsghdr h;
+        nlmsgerr err;
+    } __attribute__((__packed__)) ack;
+    while (true) {
+        ssize_t bytesread = recv(mWriteSock, &ack, sizeof(ack), MSG_DONTWAIT);
+        mSyscalls++;
+        if (bytesread == -1) {
+            if (errno == ENOBUFS) {
+                ALOGW("Lost SOCK_DESTROY errors, count of destroyed sockets may be too high");
+                continue;
+            }
+            break;  // EAGAIN: no more errors.
+        }
+        if (bytesread == (ssize_t) sizeof(ack) && ack.h.nlmsg_type == NLMSG_ERROR &&
+                ack.err.error && ack.h.nlmsg_seq >= firstSeq && ack.h.nlmsg_seq <= mSeq) {
+            failed++;
+        }
+    }
+
+    countDestroyed(requests->front().req.sdiag_protocol, requests->size() - failed);
+    requests->clear();
+    return 0;
+}
+
+int SockDiag::destroySockets(const char *addrstr, uint32_t protocols) {
+    return destroySockets(std::vector<std::string>{addrstr}, protocols);
+}
+
+// Matches all the addresses in one bytecode program, so that the cost of the sweep depends on the
+// number of sockets, not on the number of addresses.
+int SockDiag::destroySockets(const std::vector<std::string>& addrs, uint32_t protocols) {
     if (!hasSocks()) {
         return -EBADFD;
     }
 
-    if (int ret = sendDumpRequest(proto, family, addrstr)) {
-        return ret;
+    Stopwatch s;
+    resetCounts();
+
+    // The address of each condition, which must outlive the conditions.
+    std::vector<in6_addr> addrStorage(addrs.size());
+    std::vector<HostCondition> v4conditions;
+    std::vector<HostCondition> allConditions;
+    for (size_t i = 0; i < addrs.size(); i++) {
+        // TODO: refactor the netlink parsing code out of system/core, bring it into netd, and stop
+        // doing string conversions when they're not necessary.
+        addrinfo hints = { .ai_flags = AI_NUMERICHOST };
+        addrinfo *res;
+        if (getaddrinfo(addrs[i].c_str(), nullptr, &hints, &res) != 0) {
+            return -EINVAL;
+        }
+        ScopedAddrinfo resP(res);
+
+        HostCondition c = { INET_DIAG_BC_S_COND, static_cast<uint8_t>(res->ai_family), 0,
+                            &addrStorage[i], 0 };
+        if (res->ai_family == AF_INET) {
+            const in_addr& ina = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+            memcpy(&addrStorage[i], &ina, sizeof(ina));
+            c.addrlen = sizeof(ina);
+            c.prefixlen = c.addrlen * 8;
+            v4conditions.push_back(c);
+        } else if (res->ai_family == AF_INET6) {
+            addrStorage[i] = reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
+            c.addrlen = sizeof(in6_addr);
+            c.prefixlen = c.addrlen * 8;
+        } else {
+            return -EAFNOSUPPORT;
+        }
+        // IPv4 addresses can also be used by IPv6 sockets, as IPv4-mapped addresses, and IPv4
+        // conditions match those.
+        allConditions.push_back(c);
     }
 
+    const std::string what = android::base::Join(addrs, " ");
     auto destroyAll = [] (uint8_t, const inet_diag_msg*) { return true; };
 
-    return readDiagMsg(proto, destroyAll);
-}
+    for (const auto& p : kProtocols) {
+        if (!(protocols & p.flag)) continue;
 
-int SockDiag::destroySockets(const char *addrstr) {
-    Stopwatch s;
-    mSocketsDestroyed = 0;
+        for (const int family : {AF_INET, AF_INET6}) {
+            const auto& conditions = (family == AF_INET) ? v4conditions : allConditions;
+            if (conditions.empty()) continue;
 
-    if (!strchr(addrstr, ':')) {
-        if (int ret = destroySockets(IPPROTO_TCP, AF_INET, addrstr)) {
-            ALOGE("Failed to destroy IPv4 sockets on %s: %s", addrstr, strerror(-ret));
-            return ret;
+            const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
+            std::vector<uint8_t> bytecode = hostConditionBytecode(conditions,
+                                                                  true /* acceptMatches */);
+            if (sizeof(nlattr) + bytecode.size() > UINT16_MAX) {
+                return -E2BIG;
+            }
+            nlattr nla = {
+                .nla_type = INET_DIAG_REQ_BYTECODE,
+                .nla_len = static_cast<uint16_t>(sizeof(nla) + bytecode.size()),
+            };
+            iovec iov[] = {
+                { nullptr,          0 },
+                { &nla,             sizeof(nla) },
+                { bytecode.data(),  bytecode.size() },
+            };
+
+            int ret = sendDumpRequest(p.proto, family, addressStates(p.proto), iov,
+                                      ARRAY_SIZE(iov));
+            if (!ret) {
+                ret = readDiagMsg(p.proto, destroyAll);
+            }
+            if (ret) {
+                if (skipUnsupportedProtocol(p.proto, p.name, ret)) break;
+                ALOGE("Failed to destroy %s %s sockets on %s: %s",
+                      familyName, p.name, what.c_str(), strerror(-ret));
+                return ret;
+            }
         }
     }
-    if (int ret = destroySockets(IPPROTO_TCP, AF_INET6, addrstr)) {
-        ALOGE("Failed to destroy IPv6 sockets on %s: %s", addrstr, strerror(-ret));
-        return ret;
-    }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets on %s in %.1f ms", mSocketsDestroyed, addrstr, s.timeTaken());
+        ALOGI("Destroyed %d sockets (%s) on %s in %.1f ms",
+              mSocketsDestroyed, destroyedString().c_str(), what.c_str(), s.timeTaken());
     }
 
     return mSocketsDestroyed;
 }
 
-int SockDiag::destroyLiveSockets(DumpCallback destroyFilter, const char *what,
-                                 iovec *iov, int iovcnt) {
-    int proto = IPPROTO_TCP;
-
-    for (const int family : {AF_INET, AF_INET6}) {
-        const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
-        uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
-        if (int ret = sendDumpRequest(proto, family, states, iov, iovcnt)) {
-            ALOGE("Failed to dump %s sockets for %s: %s", familyName, what, strerror(-ret));
-            return ret;
+// Returns the SockDiag that parallel sweeps use for IPv4, opening it if this is the first parallel
+// sweep, or null if it can't be opened.
+SockDiag* SockDiag::getIpv4SockDiag() {
+    if (!mIpv4SockDiag) {
+        std::unique_ptr<SockDiag> sd(new SockDiag());
+        sd->setParallel(false);
+        if (!sd->open()) {
+            return nullptr;
         }
-        if (int ret = readDiagMsg(proto, destroyFilter)) {
-            ALOGE("Failed to destroy %s sockets for %s: %s", familyName, what, strerror(-ret));
-            return ret;
+        mIpv4SockDiag = std::move(sd);
+    }
+    return mIpv4SockDiag.get();
+}
+
+// Runs |sweep| once for each address family and returns the first error, or 0. If parallel sweeps
+// are enabled, the IPv4 sweep runs in a separate thread, on a SockDiag with its own socket pair,
+// while the IPv6 sweep runs on this one. The kernel walks the IPv4 and IPv6 socket tables
+// independently, so this takes about as long as the slower of the two. The other SockDiag's counts
+// are added to ours.
+int SockDiag::sweepFamilies(const FamilySweep& sweep) {
+    SockDiag* v4 = mParallel ? getIpv4SockDiag() : nullptr;
+    if (!v4) {
+        for (const int family : {AF_INET, AF_INET6}) {
+            if (int ret = sweep(this, family)) {
+                return ret;
+            }
         }
+        return 0;
     }
 
-    return 0;
+    v4->resetCounts();
+    int v4ret = 0;
+    std::thread v4thread([&sweep, v4, &v4ret] { v4ret = sweep(v4, AF_INET); });
+    int v6ret = sweep(this, AF_INET6);
+    v4thread.join();
+
+    mSocketsDestroyed += v4->mSocketsDestroyed;
+    mSyscalls += v4->mSyscalls;
+    for (size_t i = 0; i < ARRAY_SIZE(mProtocolsDestroyed); i++) {
+        mProtocolsDestroyed[i] += v4->mProtocolsDestroyed[i];
+    }
+    return v4ret ? v4ret : v6ret;
+}
+
+// Sweeps all of |protocols| in each address family, so that a parallel sweep starts one thread,
+// not one per protocol.
+int SockDiag::destroyLiveSockets(DumpCallback destroyFilter, const char *what,
+                                 uint32_t protocols, iovec *iov, int iovcnt) {
+    return sweepFamilies([&] (SockDiag *sd, int family) {
+        const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
+        for (const auto& p : kProtocols) {
+            if (!(protocols & p.flag)) continue;
+
+            // sendDumpRequest() writes the request header into iov[0], so each sweep needs its own
+            // copy.
+            std::vector<iovec> familyIov(iov, iov + iovcnt);
+            int ret = sd->sendDumpRequest(p.proto, family, liveStates(p.proto), familyIov.data(),
+                                          iovcnt);
+            const char *failed = "dump";
+            if (!ret) {
+                ret = sd->readDiagMsg(p.proto, destroyFilter);
+                failed = "destroy";
+            }
+            if (isUnsupportedProtocol(p.proto, ret)) {
+                // Both families fail the same way, so only warn once.
+                if (family == AF_INET6) {
+                    skipUnsupportedProtocol(p.proto, p.name, ret);
+                }
+                continue;
+            }
+            if (ret) {
+                ALOGE("Failed to %s %s %s sockets for %s: %s",
+                      failed, familyName, p.name, what, strerror(-ret));
+                return ret;
+            }
+        }
+        return 0;
+    });
 }
 
 int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopback) {
-    mSocketsDestroyed = 0;
+    resetCounts();
     Stopwatch s;
 
     auto shouldDestroy = [uid, excludeLoopback] (uint8_t, const inet_diag_msg *msg) {
@@ -351,29 +719,33 @@ int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopbac
                !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    for (const int family : {AF_INET, AF_INET6}) {
+    int ret = sweepFamilies([&] (SockDiag *sd, int family) {
         const char *familyName = family == AF_INET ? "IPv4" : "IPv6";
-        uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
-        if (int ret = sendDumpRequest(proto, family, states)) {
+        if (int ret = sd->sendDumpRequest(proto, family, liveStates(proto))) {
             ALOGE("Failed to dump %s sockets for UID: %s", familyName, strerror(-ret));
             return ret;
         }
-        if (int ret = readDiagMsg(proto, shouldDestroy)) {
+        if (int ret = sd->readDiagMsg(proto, shouldDestroy)) {
             ALOGE("Failed to destroy %s sockets for UID: %s", familyName, strerror(-ret));
             return ret;
         }
+        return 0;
+    });
+    if (ret) {
+        return ret;
     }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for UID in %.1f ms", mSocketsDestroyed, s.timeTaken());
+        ALOGI("Destroyed %d sockets (%s) for UID in %.1f ms",
+              mSocketsDestroyed, destroyedString().c_str(), s.timeTaken());
     }
 
     return 0;
 }
 
 int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>& skipUids,
-                             bool excludeLoopback) {
-    mSocketsDestroyed = 0;
+                             bool excludeLoopback, uint32_t protocols) {
+    resetCounts();
     Stopwatch s;
 
     auto shouldDestroy = [&] (uint8_t, const inet_diag_msg *msg) {
@@ -383,11 +755,32 @@ int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>&
                !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    iovec iov[] = {
-        { nullptr, 0 },
+    // SOCK_DIAG bytecode can't match UIDs, but if loopback sockets are to be left alone, the
+    // kernel can at least skip those instead of copying them to us.
+    std::vector<uint8_t> bytecode;
+    if (excludeLoopback) {
+        bytecode = excludeLoopbackBytecode();
+    }
+    struct nlattr nla = {
+        .nla_type = INET_DIAG_REQ_BYTECODE,
+        .nla_len = static_cast<uint16_t>(sizeof(struct nlattr) + bytecode.size()),
     };
 
-    if (int ret = destroyLiveSockets(shouldDestroy, "UID", iov, ARRAY_SIZE(iov))) {
+    iovec iov[] = {
+        { nullptr,          0 },
+        { &nla,             sizeof(nla) },
+        { bytecode.data(),  bytecode.size() },
+    };
+    const int iovcnt = bytecode.empty() ? 1 : ARRAY_SIZE(iov);
+
+    int ret = destroyLiveSockets(shouldDestroy, "UID", protocols, iov, iovcnt);
+    if (ret == -EINVAL && iovcnt > 1) {
+        // The kernel didn't accept the program. shouldDestroy doesn't depend on it, so look at
+        // every socket instead.
+        ALOGW("Kernel rejected SOCK_DIAG bytecode, filtering sockets in userspace");
+        ret = destroyLiveSockets(shouldDestroy, "UID", protocols, iov, 1);
+    }
+    if (ret) {
         return ret;
     }
 
@@ -398,15 +791,16 @@ int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>&
     std::sort(skipUidStrings.begin(), skipUidStrings.end());
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for %s skip={%s} in %.1f ms",
-              mSocketsDestroyed, uidRanges.toString().c_str(),
+        ALOGI("Destroyed %d sockets (%s) for %s skip={%s} in %.1f ms",
+              mSocketsDestroyed, destroyedString().c_str(), uidRanges.toString().c_str(),
               android::base::Join(skipUidStrings, " ").c_str(), s.timeTaken());
     }
 
     return 0;
 }
 
-// Destroys all "live" (CONNECTED, SYN_SENT, SYN_RECV) TCP sockets on the specified netId where:
+// Destroys all "live" (TCP: CONNECTED, SYN_SENT, SYN_RECV; UDP: connected) sockets of the specified
+// protocols on the specified netId where:
 // 1. The opening app no longer has permission to use this network, or:
 // 2. The opening app does have permission, but did not explicitly select this network.
 //
@@ -416,7 +810,20 @@ int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>&
 // time. If we don't kill these sockets, those apps could continue to use them without realizing
 // that they are now sending and receiving traffic on a network that is now restricted.
 int SockDiag::destroySocketsLackingPermission(unsigned netId, Permission permission,
-                                              bool excludeLoopback) {
+                                              bool excludeLoopback, uint32_t protocols) {
+    return destroySocketsLackingPermission(std::set<unsigned>{netId}, permission, excludeLoopback,
+                                           protocols);
+}
+
+// Same as above, but matches sockets on any of the specified netIds, so that changing the
+// permission of several networks costs a single dump per protocol and address family.
+int SockDiag::destroySocketsLackingPermission(const std::set<unsigned>& netIds,
+                                              Permission permission, bool excludeLoopback,
+                                              uint32_t protocols) {
+    if (netIds.empty()) {
+        return 0;
+    }
+
     struct markmatch {
         inet_diag_bc_op op;
         // TODO: switch to inet_diag_markcond
@@ -425,74 +832,113 @@ int SockDiag::destroySocketsLackingPermission(unsigned netId, Permission permiss
     } __attribute__((packed));
     constexpr uint8_t matchlen = sizeof(markmatch);
 
-    Fwmark netIdMark, netIdMask;
-    netIdMark.netId = netId;
+    // The length of the INET_DIAG_BC_JMP instruction.
+    constexpr uint8_t jmplen = sizeof(inet_diag_bc_op);
+    // Jump exactly this far past the end of the program to reject.
+    constexpr uint8_t rejectoffset = sizeof(inet_diag_bc_op);
+
+    // A SOCK_DIAG bytecode program that accepts the sockets we intend to destroy. It consists of
+    // one netId match per netId, each followed (except the last) by a JMP to the control match,
+    // then the control match itself and a final JMP that rejects.
+    //
+    // The kernel bytecode verifier requires that the "yes" targets of all instructions form a
+    // linear chain that ends exactly at the end of the program, and that every "no" target be on
+    // that chain. That is why each netId match jumps to the control match via a separate JMP
+    // instruction instead of jumping there directly.
+    const size_t numNetIds = netIds.size();
+    const size_t bytecodelen = numNetIds * matchlen + (numNetIds - 1) * jmplen +
+                               matchlen + jmplen;
+    if (bytecodelen + rejectoffset > UINT16_MAX) {
+        return -E2BIG;
+    }
+    std::vector<uint8_t> bytecode(bytecodelen);
+    uint8_t *pos = bytecode.data();
+    // Offset of the control match from the start of the program.
+    const uint16_t controloffset = bytecodelen - matchlen - jmplen;
+
+    Fwmark netIdMask;
     netIdMask.netId = 0xffff;
 
+    size_t i = 0;
+    for (unsigned netId : netIds) {
+        Fwmark netIdMark;
+        netIdMark.netId = netId;
+        const bool last = (++i == numNetIds);
+        const uint16_t offset = pos - bytecode.data();
+
+        // If netId matches, continue to the JMP below, which goes to the control match. Otherwise,
+        // skip the JMP and try the next netId. If this is the last netId, go straight to the
+        // control match if it matches, and reject (i.e., leave socket alone) if it does not.
+        markmatch netIdMatch = {
+            { INET_DIAG_BC_MARK_COND, matchlen,
+              static_cast<unsigned short>(last ? bytecodelen - offset + rejectoffset
+                                               : matchlen + jmplen) },
+            netIdMark.intValue, netIdMask.intValue
+        };
+        memcpy(pos, &netIdMatch, sizeof(netIdMatch));
+        pos += sizeof(netIdMatch);
+
+        if (!last) {
+            inet_diag_bc_op toControl = {
+                INET_DIAG_BC_JMP, jmplen,
+                static_cast<unsigned short>(controloffset - (offset + matchlen))
+            };
+            memcpy(pos, &toControl, sizeof(toControl));
+            pos += sizeof(toControl);
+        }
+    }
+
     Fwmark controlMark;
     controlMark.explicitlySelected = true;
     controlMark.permission = permission;
 
-    // A SOCK_DIAG bytecode program that accepts the sockets we intend to destroy.
-    struct bytecode {
-        markmatch netIdMatch;
-        markmatch controlMatch;
-        inet_diag_bc_op controlJump;
-    } __attribute__((packed)) bytecode;
-
-    // The length of the INET_DIAG_BC_JMP instruction.
-    constexpr uint8_t jmplen = sizeof(inet_diag_bc_op);
-    // Jump exactly this far past the end of the program to reject.
-    constexpr uint8_t rejectoffset = sizeof(inet_diag_bc_op);
-    // Total length of the program.
-    constexpr uint8_t bytecodelen = sizeof(bytecode);
-
-    bytecode = (struct bytecode) {
-        // If netId matches, continue, otherwise, reject (i.e., leave socket alone).
-        { { INET_DIAG_BC_MARK_COND, matchlen, bytecodelen + rejectoffset },
-          netIdMark.intValue, netIdMask.intValue },
-
-        // If explicit and permission bits match, go to the JMP below which rejects the socket
-        // (i.e., we leave it alone). Otherwise, jump to the end of the program, which accepts the
-        // socket (so we destroy it).
-        { { INET_DIAG_BC_MARK_COND, matchlen, matchlen + jmplen },
-          controlMark.intValue, controlMark.intValue },
-
-        // This JMP unconditionally rejects the packet by jumping to the reject target. It is
-        // necessary to keep the kernel bytecode verifier happy. If we don't have a JMP the bytecode
-        // is invalid because the target of every no jump must always be reachable by yes jumps.
-        // Without this JMP, the accept target is not reachable by yes jumps and the program will
-        // be rejected by the validator.
-        { INET_DIAG_BC_JMP, jmplen, jmplen + rejectoffset },
-
-        // We have reached the end of the program. Accept the socket, and destroy it below.
+    // If explicit and permission bits match, go to the JMP below which rejects the socket
+    // (i.e., we leave it alone). Otherwise, jump to the end of the program, which accepts the
+    // socket (so we destroy it).
+    markmatch controlMatch = {
+        { INET_DIAG_BC_MARK_COND, matchlen, matchlen + jmplen },
+        controlMark.intValue, controlMark.intValue
     };
+    memcpy(pos, &controlMatch, sizeof(controlMatch));
+    pos += sizeof(controlMatch);
+
+    // This JMP unconditionally rejects the packet by jumping to the reject target. It is
+    // necessary to keep the kernel bytecode verifier happy. If we don't have a JMP the bytecode
+    // is invalid because the target of every no jump must always be reachable by yes jumps.
+    // Without this JMP, the accept target is not reachable by yes jumps and the program will
+    // be rejected by the validator.
+    inet_diag_bc_op rejectJump = { INET_DIAG_BC_JMP, jmplen, jmplen + rejectoffset };
+    memcpy(pos, &rejectJump, sizeof(rejectJump));
+
+    // We have reached the end of the program. Accept the socket, and destroy it below.
 
     struct nlattr nla = {
         .nla_type = INET_DIAG_REQ_BYTECODE,
-        .nla_len = sizeof(struct nlattr) + bytecodelen,
+        .nla_len = static_cast<uint16_t>(sizeof(struct nlattr) + bytecodelen),
     };
 
     iovec iov[] = {
-        { nullptr,   0 },
-        { &nla,      sizeof(nla) },
-        { &bytecode, bytecodelen },
+        { nullptr,          0 },
+        { &nla,             sizeof(nla) },
+        { bytecode.data(),  bytecodelen },
     };
 
-    mSocketsDestroyed = 0;
+    resetCounts();
     Stopwatch s;
 
     auto shouldDestroy = [&] (uint8_t, const inet_diag_msg *msg) {
         return msg != nullptr && !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    if (int ret = destroyLiveSockets(shouldDestroy, "permission change", iov, ARRAY_SIZE(iov))) {
+    if (int ret = destroyLiveSockets(shouldDestroy, "permission change", protocols,
+                                     iov, ARRAY_SIZE(iov))) {
         return ret;
     }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for netId %d permission=%d in %.1f ms",
-              mSocketsDestroyed, netId, permission, s.timeTaken());
+        ALOGI("Destroyed %d sockets (%s) for netIds {%s} permission=%d in %.1f ms",
+              mSocketsDestroyed, destroyedString().c_str(),
+              android::base::Join(netIds, " ").c_str(), permission, s.timeTaken());
     }
 
     return 0;
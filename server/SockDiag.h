@@ -25,58 +25,115 @@
 #include <linux/inet_diag.h>
 
 #include <functional>
+#include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "Permission.h"
 #include "UidRanges.h"
 
 struct inet_diag_msg;
 class SockDiagTest;
+class SockDiagFixture;
 
 class SockDiag {
 
   public:
-    static const int kBufferSize = 4096;
+    // Large enough for the kernel to return a few hundred sockets per read.
+    static const int kBufferSize = 32 * 1024;
 
     // Callback function that is called once for every socket in the dump. A return value of true
     // means destroy the socket.
     typedef std::function<bool(uint8_t proto, const inet_diag_msg *)> DumpCallback;
 
+    // Transport protocols that the destroy methods below act on, as a bitmask. UDP and UDP-lite
+    // sockets are only considered live if they are connected, e.g., QUIC flows.
+    enum Protocol : uint32_t {
+        PROTO_TCP     = 1 << 0,
+        PROTO_UDP     = 1 << 1,
+        PROTO_UDPLITE = 1 << 2,
+        PROTO_ALL     = PROTO_TCP | PROTO_UDP | PROTO_UDPLITE,
+    };
+
     struct DestroyRequest {
         nlmsghdr nlh;
         inet_diag_req_v2 req;
     } __attribute__((__packed__));
 
-    SockDiag() : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0) {}
+    SockDiag() : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0), mSeq(0), mParallel(true) {
+        resetCounts();
+    }
     bool open();
     virtual ~SockDiag() { closeSocks(); }
 
+    // Whether the live socket sweeps below dump IPv4 and IPv6 sockets concurrently, on a separate
+    // socket pair and thread for IPv4 (the default), or one after the other on this object's
+    // sockets. The IPv4 socket pair is opened by the first parallel sweep and kept until this
+    // object is closed. The sweep falls back to serial if the separate sockets can't be opened.
+    void setParallel(bool parallel) { mParallel = parallel; }
+
     int sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states);
     int sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr);
     int readDiagMsg(uint8_t proto, DumpCallback callback);
     int sockDestroy(uint8_t proto, const inet_diag_msg *);
-    // Destroys all sockets on the given IPv4 or IPv6 address.
-    int destroySockets(const char *addrstr);
-    // Destroys all sockets for the given protocol and UID.
+    // Destroys all sockets of the given protocols on the given IPv4 or IPv6 address. Returns the
+    // number of sockets destroyed, or negative errno.
+    int destroySockets(const char *addrstr, uint32_t protocols = PROTO_TCP);
+    // Same as above, but for several addresses at once. Performs one dump per protocol and address
+    // family regardless of the number of addresses. Returns -E2BIG if there are too many addresses
+    // to match in one dump (about 2000 IPv6 addresses).
+    int destroySockets(const std::vector<std::string>& addrs, uint32_t protocols = PROTO_TCP);
+    // Destroys all live sockets for the given protocol (e.g., IPPROTO_TCP) and UID.
     int destroySockets(uint8_t proto, uid_t uid, bool excludeLoopback);
-    // Destroys all "live" (CONNECTED, SYN_SENT, SYN_RECV) TCP sockets for the given UID ranges.
+    // Destroys all "live" (TCP: CONNECTED, SYN_SENT, SYN_RECV; UDP: connected) sockets of the
+    // given protocols for the given UID ranges.
     int destroySockets(const UidRanges& uidRanges, const std::set<uid_t>& skipUids,
-                       bool excludeLoopback);
-    // Destroys all "live" (CONNECTED, SYN_SENT, SYN_RECV) TCP sockets that no longer have
-    // the permissions required by the specified network.
+                       bool excludeLoopback, uint32_t protocols = PROTO_TCP);
+    // Destroys all "live" sockets of the given protocols that no longer have the permissions
+    // required by the specified network.
     int destroySocketsLackingPermission(unsigned netId, Permission permission,
-                                        bool excludeLoopback);
+                                        bool excludeLoopback, uint32_t protocols = PROTO_TCP);
+    // Same as above, but for several networks at once. Performs one dump per protocol and address
+    // family regardless of the number of networks.
+    int destroySocketsLackingPermission(const std::set<unsigned>& netIds, Permission permission,
+                                        bool excludeLoopback, uint32_t protocols = PROTO_TCP);
 
   private:
     friend class SockDiagTest;
+    friend class SockDiagFixture;
     int mSock;
     int mWriteSock;
     int mSocketsDestroyed;
+    // Sockets destroyed since the last resetCounts(), by protocol: TCP, UDP, UDP-lite.
+    int mProtocolsDestroyed[3];
+    // Netlink system calls made since the last resetCounts(), so that benchmarks can measure how
+    // many it takes to destroy a socket.
+    int mSyscalls;
+    uint32_t mSeq;
+    bool mParallel;
+    // The SockDiag that parallel sweeps use for IPv4, if it has been opened.
+    std::unique_ptr<SockDiag> mIpv4SockDiag;
+    // Dumps and destroys the sockets of one address family using the specified SockDiag.
+    typedef std::function<int(SockDiag *sd, int family)> FamilySweep;
+    int sweepFamilies(const FamilySweep& sweep);
+    SockDiag* getIpv4SockDiag();
     int sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states, iovec *iov, int iovcnt);
-    int destroySockets(uint8_t proto, int family, const char *addrstr);
-    int destroyLiveSockets(DumpCallback destroy, const char *what, iovec *iov, int iovcnt);
+    int destroyLiveSockets(DumpCallback destroy, const char *what, uint32_t protocols,
+                           iovec *iov, int iovcnt);
+    void resetCounts();
+    void countDestroyed(uint8_t proto, int count);
+    std::string destroyedString() const;
+    int sendDestroyBatch(std::vector<DestroyRequest> *requests);
+    static void fillDestroyRequest(uint8_t proto, const inet_diag_msg *msg,
+                                   DestroyRequest *request);
     bool hasSocks() { return mSock != -1 && mWriteSock != -1; }
-    void closeSocks() { close(mSock); close(mWriteSock); mSock = mWriteSock = -1; }
+    void closeSocks() {
+        close(mSock);
+        close(mWriteSock);
+        mSock = mWriteSock = -1;
+        mIpv4SockDiag.reset();
+    }
     static bool isLoopbackSocket(const inet_diag_msg *msg);
 };
 
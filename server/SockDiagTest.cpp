@@ -273,13 +273,96 @@ TEST_F(SockDiagTest, TestIsLoopbackSocket) {
     EXPECT_TRUE(isLoopbackSocket(&msg));
 }
 
+TEST_F(SockDiagTest, TestDestroyUdpSockets) {
+    constexpr uid_t TEST_UID = 10042;
+    const sockaddr_in6 peer = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(53),
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+
+    int connected = socket(AF_INET6, SOCK_DGRAM, 0);
+    ASSERT_NE(-1, connected) << "Failed to open UDP socket: " << strerror(errno);
+    ASSERT_EQ(0, connect(connected, (sockaddr *) &peer, sizeof(peer)));
+    int unconnected = socket(AF_INET6, SOCK_DGRAM, 0);
+    ASSERT_NE(-1, unconnected) << "Failed to open UDP socket: " << strerror(errno);
+    ASSERT_EQ(0, fchown(connected, TEST_UID, -1));
+    ASSERT_EQ(0, fchown(unconnected, TEST_UID, -1));
+
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+    const UidRanges uidRanges(std::vector<android::net::UidRange>{
+            android::net::UidRange(TEST_UID, TEST_UID)});
+
+    // By default, only TCP sockets are destroyed.
+    EXPECT_EQ(0, sd.destroySockets(uidRanges, {}, false));
+    int err;
+    socklen_t errlen = sizeof(err);
+    ASSERT_EQ(0, getsockopt(connected, SOL_SOCKET, SO_ERROR, &err, &errlen));
+    EXPECT_EQ(0, err);
+
+    // Only the connected UDP socket is live, so the unconnected one is left alone.
+    EXPECT_EQ(0, sd.destroySockets(uidRanges, {}, false, SockDiag::PROTO_ALL));
+    ASSERT_EQ(0, getsockopt(connected, SOL_SOCKET, SO_ERROR, &err, &errlen));
+    EXPECT_EQ(ECONNABORTED, err);
+    ASSERT_EQ(0, getsockopt(unconnected, SOL_SOCKET, SO_ERROR, &err, &errlen));
+    EXPECT_EQ(0, err);
+
+    close(connected);
+    close(unconnected);
+}
+
+TEST_F(SockDiagTest, TestDestroyMultipleAddresses) {
+    // Connected UDP sockets bound to 127.0.0.{5,6,7}, plus an IPv6 socket on ::ffff:127.0.0.6 and
+    // an unconnected socket on 127.0.0.5.
+    auto udpSocket = [] (int family, const char *src, bool connected) {
+        sockaddr_in6 sin6 = { .sin6_family = AF_INET6, .sin6_port = 0 };
+        sockaddr_in sin = { .sin_family = AF_INET, .sin_port = 0 };
+        sockaddr *sa = (family == AF_INET) ? (sockaddr *) &sin : (sockaddr *) &sin6;
+        socklen_t len = (family == AF_INET) ? sizeof(sin) : sizeof(sin6);
+        void *addr = (family == AF_INET) ? (void *) &sin.sin_addr : (void *) &sin6.sin6_addr;
+        int s = socket(family, SOCK_DGRAM, 0);
+        EXPECT_EQ(1, inet_pton(family, src, addr));
+        EXPECT_EQ(0, bind(s, sa, len)) << "bind to " << src << ": " << strerror(errno);
+        if (connected) {
+            sin.sin_port = sin6.sin6_port = htons(53);
+            EXPECT_EQ(0, connect(s, sa, len)) << "connect to " << src << ": " << strerror(errno);
+        }
+        return s;
+    };
+    int sockets[] = {
+        udpSocket(AF_INET, "127.0.0.5", true),
+        udpSocket(AF_INET, "127.0.0.6", true),
+        udpSocket(AF_INET6, "::ffff:127.0.0.6", true),
+        udpSocket(AF_INET, "127.0.0.7", true),
+        udpSocket(AF_INET, "127.0.0.5", false),
+    };
+    // Unconnected UDP sockets aren't tied to the address, so they're left alone.
+    const bool shouldDestroy[] = { true, true, true, false, false };
+
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+    std::vector<std::string> addrs = { "127.0.0.5", "127.0.0.6", "2001:db8::1" };
+    EXPECT_EQ(3, sd.destroySockets(addrs, SockDiag::PROTO_UDP));
+
+    for (size_t i = 0; i < ARRAY_SIZE(sockets); i++) {
+        int err;
+        socklen_t errlen = sizeof(err);
+        ASSERT_EQ(0, getsockopt(sockets[i], SOL_SOCKET, SO_ERROR, &err, &errlen));
+        EXPECT_EQ(shouldDestroy[i] ? ECONNABORTED : 0, err) << "socket " << i;
+        close(sockets[i]);
+    }
+}
+
 enum MicroBenchmarkTestType {
     ADDRESS,
     UID,
     UID_EXCLUDE_LOOPBACK,
     UIDRANGE,
     UIDRANGE_EXCLUDE_LOOPBACK,
+    UIDRANGE_SERIAL,
     PERMISSION,
+    PERMISSION_MULTI,
 };
 
 const char *testTypeName(MicroBenchmarkTestType mode) {
@@ -290,7 +373,9 @@ const char *testTypeName(MicroBenchmarkTestType mode) {
         TO_STRING_TYPE(UID_EXCLUDE_LOOPBACK);
         TO_STRING_TYPE(UIDRANGE);
         TO_STRING_TYPE(UIDRANGE_EXCLUDE_LOOPBACK);
+        TO_STRING_TYPE(UIDRANGE_SERIAL);
         TO_STRING_TYPE(PERMISSION);
+        TO_STRING_TYPE(PERMISSION_MULTI);
     }
 #undef TO_STRING_TYPE
 }
@@ -345,8 +430,10 @@ protected:
         case UID_EXCLUDE_LOOPBACK:
         case UIDRANGE:
         case UIDRANGE_EXCLUDE_LOOPBACK:
+        case UIDRANGE_SERIAL:
             return UID_SOCKETS;
         case PERMISSION:
+        case PERMISSION_MULTI:
             return ARRAY_SIZE(permissionTestcases);
         }
     }
@@ -357,11 +444,13 @@ protected:
         case UID:
         case UID_EXCLUDE_LOOPBACK:
         case UIDRANGE:
-        case UIDRANGE_EXCLUDE_LOOPBACK: {
+        case UIDRANGE_EXCLUDE_LOOPBACK:
+        case UIDRANGE_SERIAL: {
             uid_t uid = START_UID + i;
             return fchown(s, uid, -1);
         }
-        case PERMISSION: {
+        case PERMISSION:
+        case PERMISSION_MULTI: {
             Fwmark fwmark;
             fwmark.netId = permissionTestcases[i].netId;
             fwmark.explicitlySelected = permissionTestcases[i].explicitlySelected;
@@ -390,8 +479,10 @@ protected:
                 break;
             }
             case UIDRANGE:
-            case UIDRANGE_EXCLUDE_LOOPBACK: {
+            case UIDRANGE_EXCLUDE_LOOPBACK:
+            case UIDRANGE_SERIAL: {
                 bool excludeLoopback = (mode == UIDRANGE_EXCLUDE_LOOPBACK);
+                mSd.setParallel(mode != UIDRANGE_SERIAL);
                 const char *uidRangeStrings[] = { "8005-8012", "8042", "8043", "8090-8099" };
                 std::set<uid_t> skipUids { 8007, 8043, 8098, 8099 };
                 UidRanges uidRanges;
@@ -403,6 +494,11 @@ protected:
                 ret = mSd.destroySocketsLackingPermission(TEST_NETID, PERMISSION_NETWORK, false);
                 break;
             }
+            case PERMISSION_MULTI: {
+                std::set<unsigned> netIds { TEST_NETID, TEST_NETID + 1 };
+                ret = mSd.destroySocketsLackingPermission(netIds, PERMISSION_NETWORK, false);
+                break;
+            }
         }
         return ret;
     }
@@ -414,7 +510,8 @@ protected:
                 return true;
             case UID:
                 return i == CLOSE_UID - START_UID;
-            case UIDRANGE: {
+            case UIDRANGE:
+            case UIDRANGE_SERIAL: {
                 uid_t uid = i + START_UID;
                 // Skip UIDs in skipUids.
                 if (uid == 8007 || uid == 8043 || uid == 8098 || uid == 8099) {
@@ -430,10 +527,12 @@ protected:
             case UIDRANGE_EXCLUDE_LOOPBACK:
                 return false;
             case PERMISSION:
-                if (permissionTestcases[i].netId != 42) return false;
+            case PERMISSION_MULTI: {
+                if (mode == PERMISSION && permissionTestcases[i].netId != 42) return false;
                 if (permissionTestcases[i].explicitlySelected != 1) return true;
                 Permission permission = permissionTestcases[i].permission;
                 return permission != PERMISSION_NETWORK && permission != PERMISSION_SYSTEM;
+            }
         }
     }
 
@@ -533,4 +632,5 @@ constexpr int SockDiagMicroBenchmarkTest::CLOSE_UID;
 INSTANTIATE_TEST_CASE_P(Address, SockDiagMicroBenchmarkTest,
                         testing::Values(ADDRESS, UID, UIDRANGE,
                                         UID_EXCLUDE_LOOPBACK, UIDRANGE_EXCLUDE_LOOPBACK,
-                                        PERMISSION));
+                                        UIDRANGE_SERIAL,
+                                        PERMISSION, PERMISSION_MULTI));
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define LOG_TAG "ThreadPool"
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+#include <cutils/log.h>
+
+#include "DumpWriter.h"
+
+ThreadPool::ThreadPool(const std::string& name, size_t maxThreads, size_t maxQueueDepth) :
+        mName(name), mMaxThreads(std::max<size_t>(maxThreads, 1)), mMaxQueueDepth(maxQueueDepth),
+        mIdleThreads(0), mStopping(false), mPeakQueueDepth(0), mExecuted(0), mRejected(0),
+        mTotalWaitMs(0), mMaxWaitMs(0) {
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+        mTaskQueued.notify_all();
+    }
+    for (std::thread& thread : mThreads) {
+        thread.join();
+    }
+}
+
+bool ThreadPool::enqueue(const Task& task) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mQueue.size() >= mMaxQueueDepth) {
+        mRejected++;
+        // Log the first rejection and then ever more rarely, so that an overload doesn't also
+        // flood the log.
+        if ((mRejected & (mRejected - 1)) == 0) {
+            ALOGW("%s thread pool overloaded: %zu threads busy, %zu tasks queued, %llu rejected",
+                  mName.c_str(), mThreads.size() - mIdleThreads, mQueue.size(),
+                  (unsigned long long) mRejected);
+        }
+        return false;
+    }
+
+    mQueue.push_back({task, Clock::now()});
+    mPeakQueueDepth = std::max(mPeakQueueDepth, mQueue.size());
+    if (mIdleThreads < mQueue.size() && mThreads.size() < mMaxThreads) {
+        mThreads.emplace_back(&ThreadPool::run, this);
+    } else {
+        mTaskQueued.notify_one();
+    }
+    return true;
+}
+
+void ThreadPool::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mIdleThreads++;
+        while (mQueue.empty() && !mStopping) {
+            mTaskQueued.wait(lock);
+        }
+        mIdleThreads--;
+        if (mQueue.empty()) {
+            return;
+        }
+
+        Entry entry = std::move(mQueue.front());
+        mQueue.pop_front();
+        const double waitMs = std::chrono::duration<double, std::milli>(
+                Clock::now() - entry.queued).count();
+        mExecuted++;
+        mTotalWaitMs += waitMs;
+        mMaxWaitMs = std::max(mMaxWaitMs, waitMs);
+
+        lock.unlock();
+        entry.task();
+        // Destroy the task, and whatever it holds on to, before waiting for the next one.
+        entry.task = nullptr;
+        lock.lock();
+    }
+}
+
+ThreadPool::Stats ThreadPool::getStats() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return {
+        mThreads.size(), mMaxThreads, mQueue.size(), mMaxQueueDepth, mPeakQueueDepth,
+        mExecuted, mRejected, mTotalWaitMs, mMaxWaitMs,
+    };
+}
+
+void ThreadPool::dump(DumpWriter& dw) const {
+    const Stats stats = getStats();
+
+    dw.incIndent();
+    dw.println("%s thread pool", mName.c_str());
+
+    dw.incIndent();
+    dw.println("Threads: %zu of %zu", stats.threads, stats.maxThreads);
+    dw.println("Queued tasks: %zu of %zu, peak %zu", stats.queueDepth, stats.maxQueueDepth,
+               stats.peakQueueDepth);
+    dw.println("Executed tasks: %llu, rejected tasks: %llu", (unsigned long long) stats.executed,
+               (unsigned long long) stats.rejected);
+    dw.println("Queue wait: %.1f ms average, %.1f ms max",
+               stats.executed ? stats.totalWaitMs / stats.executed : 0.0, stats.maxWaitMs);
+    dw.decIndent();
+
+    dw.decIndent();
+}
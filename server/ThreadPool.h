@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef NETD_SERVER_THREAD_POOL_H
+#define NETD_SERVER_THREAD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NetdConstants.h"
+
+class DumpWriter;
+
+// Runs tasks on up to a fixed number of threads, taking them from a bounded queue in order. Used
+// instead of a thread per task for work that comes in bursts, such as DNS queries, so that the
+// number of threads (and their stacks) stays bounded however many tasks arrive at once. Threads
+// are started as they are needed and then kept. Tasks that don't fit in the queue are rejected
+// right away, so that callers can fail fast instead of waiting behind a backlog.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    struct Stats {
+        size_t threads;
+        size_t maxThreads;
+        size_t queueDepth;
+        size_t maxQueueDepth;
+        // The most tasks that were ever waiting at once.
+        size_t peakQueueDepth;
+        uint64_t executed;
+        uint64_t rejected;
+        // Time that the executed tasks spent in the queue before a thread picked them up.
+        double totalWaitMs;
+        double maxWaitMs;
+    };
+
+    ThreadPool(const std::string& name, size_t maxThreads, size_t maxQueueDepth);
+    // Runs the tasks that are still queued, and waits for all of them to finish.
+    ~ThreadPool();
+
+    // Queues |task| to run on one of the threads. Returns false, without queueing it, if there
+    // are already as many tasks waiting as the queue can hold.
+    bool enqueue(const Task& task) WARN_UNUSED_RESULT;
+
+    Stats getStats() const;
+    void dump(DumpWriter& dw) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        Task task;
+        Clock::time_point queued;
+    };
+
+    void run();
+
+    const std::string mName;
+    const size_t mMaxThreads;
+    const size_t mMaxQueueDepth;
+
+    // Guards all the members below.
+    mutable std::mutex mLock;
+    std::condition_variable mTaskQueued;
+    std::deque<Entry> mQueue;
+    std::vector<std::thread> mThreads;
+    size_t mIdleThreads;
+    bool mStopping;
+    size_t mPeakQueueDepth;
+    uint64_t mExecuted;
+    uint64_t mRejected;
+    double mTotalWaitMs;
+    double mMaxWaitMs;
+};
+
+#endif  // NETD_SERVER_THREAD_POOL_H
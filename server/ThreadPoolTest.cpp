@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include <gtest/gtest.h>
+
+#include "ThreadPool.h"
+
+namespace {
+
+// Keeps the tasks that wait on it running until release() is called.
+class Gate {
+public:
+    void wait() {
+        std::unique_lock<std::mutex> lock(mLock);
+        mWaiting++;
+        mChanged.notify_all();
+        mChanged.wait(lock, [this] { return mOpen; });
+    }
+
+    void waitForWaiters(int n) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mChanged.wait(lock, [this, n] { return mWaiting >= n; });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOpen = true;
+        mChanged.notify_all();
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    int mWaiting = 0;
+    bool mOpen = false;
+};
+
+}  // namespace
+
+TEST(ThreadPoolTest, TestRunsAllTasks) {
+    constexpr int kTasks = 1000;
+    std::atomic<int> count(0);
+    {
+        ThreadPool pool("test", 4, kTasks);
+        for (int i = 0; i < kTasks; i++) {
+            EXPECT_TRUE(pool.enqueue([&count] { count++; }));
+        }
+        // Destroying the pool waits for the queued tasks.
+    }
+    EXPECT_EQ(kTasks, count);
+}
+
+TEST(ThreadPoolTest, TestStartsThreadsOnDemand) {
+    ThreadPool pool("test", 8, 8);
+    Gate gate;
+    EXPECT_TRUE(pool.enqueue([&gate] { gate.wait(); }));
+    EXPECT_TRUE(pool.enqueue([&gate] { gate.wait(); }));
+    gate.waitForWaiters(2);
+    EXPECT_EQ(2U, pool.getStats().threads);
+    gate.release();
+}
+
+TEST(ThreadPoolTest, TestRejectsWhenQueueIsFull) {
+    ThreadPool pool("test", 1, 2);
+    Gate gate;
+    std::atomic<int> count(0);
+
+    // Keep the only thread busy, so that further tasks have to wait in the queue.
+    EXPECT_TRUE(pool.enqueue([&gate] { gate.wait(); }));
+    gate.waitForWaiters(1);
+    EXPECT_TRUE(pool.enqueue([&count] { count++; }));
+    EXPECT_TRUE(pool.enqueue([&count] { count++; }));
+    EXPECT_FALSE(pool.enqueue([&count] { count++; }));
+
+    ThreadPool::Stats stats = pool.getStats();
+    EXPECT_EQ(1U, stats.threads);
+    EXPECT_EQ(2U, stats.queueDepth);
+    EXPECT_EQ(2U, stats.peakQueueDepth);
+    EXPECT_EQ(1U, stats.rejected);
+
+    gate.release();
+    while (pool.getStats().queueDepth) {
+        std::this_thread::yield();
+    }
+    EXPECT_TRUE(pool.enqueue([&count] { count++; }));
+    while (count < 3) {
+        std::this_thread::yield();
+    }
+
+    stats = pool.getStats();
+    EXPECT_EQ(4U, stats.executed);
+    EXPECT_EQ(1U, stats.rejected);
+    EXPECT_GE(stats.maxWaitMs, 0.0);
+    EXPECT_GE(stats.totalWaitMs, stats.maxWaitMs);
+}
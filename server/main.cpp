@@ -87,7 +87,8 @@ int main() {
     // Set local DNS mode, to prevent bionic from proxying
     // back to this service, recursively.
     setenv("ANDROID_DNS_MODE", "local", 1);
-    DnsProxyListener dpl(&gCtls->netCtrl, &gCtls->eventReporter);
+    DnsProxyListener dpl(&gCtls->netCtrl, &gCtls->eventReporter, &gCtls->dnsQueryPool,
+                         &gCtls->getAddrInfoCoalescer);
     if (dpl.startListener()) {
         ALOGE("Unable to start DnsProxyListener (%s)", strerror(errno));
         exit(1);
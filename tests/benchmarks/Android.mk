@@ -15,10 +15,12 @@
 #
 #
 # Note: netd benchmark can't build on nyc-mr2-dev, because google-benchmark project is out of date
-#       and won't be backported, and thus the content of this file is commented out to disable it.
-#       In order to run netd benchmark locally you can uncomment the content of this file and follow
-#       instructions in ag/1673408 (checkout that commit and build external/google-benchmark and
-#       system/netd locally and then run the benchmark locally)
+#       and won't be backported, and thus the benchmarks in this file are disabled. netd_benchmark
+#       is commented out; in order to run it locally you can uncomment it and follow instructions
+#       in ag/1673408 (checkout that commit and build external/google-benchmark and system/netd
+#       locally and then run the benchmark locally). The other benchmarks are only built when
+#       NETD_BUILD_BENCHMARKS is true, e.g. "NETD_BUILD_BENCHMARKS=true mmm system/netd/tests",
+#       which also needs an up to date external/google-benchmark.
 #
 #
 #LOCAL_PATH := $(call my-dir)
@@ -52,3 +54,104 @@
 #LOCAL_MODULE_TAGS := eng tests
 
 #include $(BUILD_NATIVE_BENCHMARK)
+
+LOCAL_PATH := $(call my-dir)
+
+ifeq ($(NETD_BUILD_BENCHMARKS),true)
+
+# NetworkController lookup benchmarks. These link the network selection code against a fake
+# RouteController, so they do not need root or a running netd.
+include $(CLEAR_VARS)
+LOCAL_MODULE := netd_network_controller_benchmark
+LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
+EXTRA_LDLIBS := -lpthread
+LOCAL_SHARED_LIBRARIES += libbase libbinder libcutils liblog liblogwrap libnetdaidl libutils
+LOCAL_AIDL_INCLUDES := system/netd/server/binder
+LOCAL_C_INCLUDES += system/netd/include \
+                    system/netd/server \
+                    system/netd/server/binder \
+                    system/core/logwrapper/include \
+                    bionic/libc/dns/include
+LOCAL_SRC_FILES := main.cpp \
+                   fake_route_controller.cpp \
+                   network_controller_benchmark.cpp \
+                   ../../server/DummyNetwork.cpp \
+                   ../../server/DumpWriter.cpp \
+                   ../../server/LocalNetwork.cpp \
+                   ../../server/NetdConstants.cpp \
+                   ../../server/Network.cpp \
+                   ../../server/NetworkController.cpp \
+                   ../../server/PhysicalNetwork.cpp \
+                   ../../server/ResolverController.cpp \
+                   ../../server/SockDiag.cpp \
+                   ../../server/UidRanges.cpp \
+                   ../../server/VirtualNetwork.cpp \
+                   ../../server/binder/android/net/metrics/INetdEventListener.aidl
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_NATIVE_BENCHMARK)
+
+# RouteController benchmarks. These send RouteController's netlink requests to an in-process fake
+# kernel instead of the real one, so they do not need root and do not change the routing
+# configuration of the machine they run on.
+include $(CLEAR_VARS)
+LOCAL_MODULE := netd_route_controller_benchmark
+LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
+EXTRA_LDLIBS := -lpthread
+LOCAL_SHARED_LIBRARIES += libbase libbinder libcutils liblog liblogwrap libnetdaidl libnetutils \
+                          libutils
+LOCAL_AIDL_INCLUDES := system/netd/server/binder
+LOCAL_C_INCLUDES += system/netd/include \
+                    system/netd/server \
+                    system/netd/server/binder \
+                    system/core/logwrapper/include \
+                    bionic/libc/dns/include
+LOCAL_SRC_FILES := main.cpp \
+                   fake_netlink_route.cpp \
+                   route_controller_benchmark.cpp \
+                   ../../server/DummyNetwork.cpp \
+                   ../../server/NetdConstants.cpp \
+                   ../../server/Network.cpp \
+                   ../../server/RouteController.cpp \
+                   ../../server/UidRanges.cpp
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_NATIVE_BENCHMARK)
+
+# SOCK_DIAG benchmarks. These open thousands of loopback TCP connections and time the sweeps that
+# netd uses to destroy sockets. Destroying sockets needs root; unprivileged runs only time dumps.
+include $(CLEAR_VARS)
+LOCAL_MODULE := netd_sock_diag_benchmark
+LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
+EXTRA_LDLIBS := -lpthread
+LOCAL_SHARED_LIBRARIES += libbase libbinder libcutils liblog libnetdaidl libutils
+LOCAL_AIDL_INCLUDES := system/netd/server/binder
+LOCAL_C_INCLUDES += system/netd/include \
+                    system/netd/server \
+                    system/netd/server/binder \
+                    bionic/libc/dns/include
+LOCAL_SRC_FILES := main.cpp \
+                   sock_diag_benchmark.cpp \
+                   ../../server/SockDiag.cpp \
+                   ../../server/UidRanges.cpp
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_NATIVE_BENCHMARK)
+
+# connect() benchmarks, including the cost of reporting each connect to fwmarkd. These run against
+# the netd on the device, so unlike the benchmarks above they need a running netd.
+include $(CLEAR_VARS)
+LOCAL_MODULE := netd_connect_benchmark
+LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
+EXTRA_LDLIBS := -lpthread
+LOCAL_SHARED_LIBRARIES += libbase libbinder libcutils liblog libnetd_client libutils
+LOCAL_AIDL_INCLUDES := system/netd/server/binder
+LOCAL_C_INCLUDES += system/netd/include \
+                    system/netd/client \
+                    system/netd/server \
+                    system/netd/server/binder \
+                    bionic/libc/dns/include
+LOCAL_SRC_FILES := main.cpp \
+                   connect_benchmark.cpp \
+                   ../../server/binder/android/net/metrics/INetdEventListener.aidl
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_NATIVE_BENCHMARK)
+
+endif  # NETD_BUILD_BENCHMARKS
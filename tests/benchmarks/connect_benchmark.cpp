@@ -19,6 +19,7 @@
 #include <arpa/inet.h>
 #include <cutils/sockets.h>
 #include <errno.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <time.h>
 
@@ -32,6 +33,7 @@
 #include <utils/StrongPointer.h>
 
 #include "FwmarkClient.h"
+#include "FwmarkCommand.h"
 #include "SockDiag.h"
 #include "Stopwatch.h"
 #include "android/net/metrics/INetdEventListener.h"
@@ -170,6 +172,77 @@ static void ipv6_loopback(benchmark::State& state, const bool waitBetweenRuns) {
     }
 }
 
+// Sets the label to the 50th, 90th and 99th percentiles of |latencies|, in nanoseconds.
+static void setLatencyPercentilesLabel(benchmark::State& state, std::vector<uint64_t>* latencies) {
+    if (latencies->empty()) {
+        return;
+    }
+    sort(latencies->begin(), latencies->end());
+    const size_t n = latencies->size();
+    state.SetLabel(StringPrintf("p50=%lld p90=%lld p99=%lld",
+                                (long long) (*latencies)[n * 50 / 100],
+                                (long long) (*latencies)[n * 90 / 100],
+                                (long long) (*latencies)[n * 99 / 100]));
+}
+
+// Times connect() together with the ON_CONNECT_COMPLETE report that follows it. netdClientConnect()
+// sends the report without waiting for fwmarkd to process it. If |waitForReport| is true, the
+// report is instead sent the way netdClientConnect() used to send it, waiting for fwmarkd's
+// response; this must run with metrics-only reporting, so that netdClientConnect() doesn't also
+// send it. The difference between the two shows in the tail latencies more than in the mean,
+// because fwmarkd serves one client at a time.
+static void ipv4_loopback_report(benchmark::State& state, const bool waitForReport) {
+    const int listensocket = socket(AF_INET6, SOCK_STREAM, 0);
+    const int port = bindAndListen(listensocket);
+    if (port == -1) {
+        state.SkipWithError("Unable to bind server socket");
+        return;
+    }
+
+    std::vector<uint64_t> latencies;
+
+    while (state.KeepRunning()) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            state.SkipWithError(StringPrintf("socket() failed with errno=%d", errno).c_str());
+            break;
+        }
+
+        const Stopwatch stopwatch;
+
+        sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(port) };
+        if (connect(sock, (sockaddr*) &server, sizeof(server))) {
+            state.SkipWithError(StringPrintf("connect() failed with errno=%d", errno).c_str());
+            close(sock);
+            break;
+        }
+
+        if (waitForReport) {
+            FwmarkConnectInfo connectInfo(0, lround(stopwatch.timeTaken()), (sockaddr*) &server);
+            FwmarkCommand command = {FwmarkCommand::ON_CONNECT_COMPLETE, 0, 0};
+            FwmarkClient().send(&command, sock, &connectInfo);
+        }
+
+        latencies.push_back(stopwatch.timeTaken() * 1e6L);
+        state.SetIterationTime(latencies.back() / 1e9L);
+
+        sockaddr_in6 client;
+        socklen_t clientlen = sizeof(client);
+        int accepted = accept(listensocket, (sockaddr *) &client, &clientlen);
+        if (accepted < 0) {
+            state.SkipWithError(StringPrintf("accept() failed with errno=%d", errno).c_str());
+            close(sock);
+            break;
+        }
+
+        close(accepted);
+        close(sock);
+    }
+    close(listensocket);
+
+    setLatencyPercentilesLabel(state, &latencies);
+}
+
 static void run_at_reporting_level(decltype(ipv4_loopback) benchmarkFunction,
                                    ::benchmark::State& state, const int reportingLevel,
                                    const bool waitBetweenRuns) {
@@ -255,6 +328,19 @@ static void ipv4_full_reporting_high_load(::benchmark::State& state) {
 BENCHMARK(ipv4_full_reporting_high_load)
     ->ThreadRange(MIN_THREADS, MAX_THREADS)->MinTime(MIN_TIME)->UseRealTime();
 
+// IPv4 connect() latency with full reporting, with and without waiting for ON_CONNECT_COMPLETE
+static void ipv4_full_reporting_one_way(::benchmark::State& state) {
+    run_at_reporting_level(ipv4_loopback_report, state, INetdEventListener::REPORTING_LEVEL_FULL,
+            false);
+}
+BENCHMARK(ipv4_full_reporting_one_way)->MinTime(MIN_TIME)->UseManualTime();
+
+static void ipv4_full_reporting_blocking(::benchmark::State& state) {
+    run_at_reporting_level(ipv4_loopback_report, state,
+            INetdEventListener::REPORTING_LEVEL_METRICS, true);
+}
+BENCHMARK(ipv4_full_reporting_blocking)->MinTime(MIN_TIME)->UseManualTime();
+
 // IPv6 raw connect() without using fwmark
 static void ipv6_metrics_reporting_no_fwmark(::benchmark::State& state) {
     run_at_reporting_level(ipv6_loopback, state, INetdEventListener::REPORTING_LEVEL_NONE, true);
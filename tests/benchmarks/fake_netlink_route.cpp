@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_netlink_route"
+
+#include "fake_netlink_route.h"
+
+#include <errno.h>
+#include <linux/fib_rules.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include <log/log.h>
+
+namespace {
+
+// The kernel doesn't put more than about this much into one dump datagram.
+constexpr size_t DUMP_DATAGRAM_SIZE = 8192;
+
+constexpr size_t RECV_BUFFER_SIZE = 64 * 1024;
+
+// Returns true if the |len| bytes at |rta| are a well-formed sequence of attributes.
+bool validAttributes(const rtattr* rta, int len) {
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    }
+    return len == 0;
+}
+
+bool validFamily(uint8_t family) {
+    return family == AF_INET || family == AF_INET6;
+}
+
+}  // namespace
+
+FakeNetlinkRoute::FakeNetlinkRoute() :
+        mClientSocket(-1), mServerSocket(-1), mLatency(std::chrono::microseconds(0)),
+        mMessagesProcessed(0), mErrorInterval(0), mError(0), mFailNextType(0), mFailNextError(0) {
+}
+
+FakeNetlinkRoute::~FakeNetlinkRoute() {
+    stop();
+}
+
+int FakeNetlinkRoute::start() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        return -errno;
+    }
+    mClientSocket = fds[0];
+    mServerSocket = fds[1];
+    mThread = std::thread(&FakeNetlinkRoute::serve, this);
+    return 0;
+}
+
+void FakeNetlinkRoute::stop() {
+    if (!mThread.joinable()) {
+        return;
+    }
+    // Makes the server's recv() return 0.
+    shutdown(mServerSocket, SHUT_RDWR);
+    mThread.join();
+    close(mServerSocket);
+    close(mClientSocket);
+    mServerSocket = mClientSocket = -1;
+}
+
+void FakeNetlinkRoute::setErrorInjection(unsigned interval, int error) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mErrorInterval = interval;
+    mError = error;
+}
+
+void FakeNetlinkRoute::failNextRequest(uint16_t type, int error) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mFailNextType = type;
+    mFailNextError = error;
+}
+
+void FakeNetlinkRoute::addRoute(uint8_t family, uint32_t table, uint32_t destination,
+                                uint8_t prefixLength) {
+    struct {
+        rtmsg route;
+        rtattr rtaTable;
+        uint32_t table;
+        rtattr rtaDst;
+        uint8_t dst[16];
+    } __attribute__((packed)) request;
+    memset(&request, 0, sizeof(request));
+
+    const size_t addressLength = (family == AF_INET) ? 4 : 16;
+    request.route.rtm_family = family;
+    request.route.rtm_dst_len = prefixLength;
+    request.route.rtm_table = RT_TABLE_UNSPEC;
+    request.route.rtm_protocol = RTPROT_STATIC;
+    request.route.rtm_scope = RT_SCOPE_LINK;
+    request.route.rtm_type = RTN_UNICAST;
+    request.rtaTable.rta_len = RTA_LENGTH(sizeof(uint32_t));
+    request.rtaTable.rta_type = RTA_TABLE;
+    request.table = table;
+    request.rtaDst.rta_len = RTA_LENGTH(addressLength);
+    request.rtaDst.rta_type = RTA_DST;
+    memcpy(request.dst, &destination, sizeof(destination));
+
+    const size_t length = sizeof(request) - sizeof(request.dst) + addressLength;
+    std::lock_guard<std::mutex> lock(mLock);
+    mRoutes.insert(std::string(reinterpret_cast<const char*>(&request), length));
+}
+
+void FakeNetlinkRoute::reset() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mRules.clear();
+    mRoutes.clear();
+}
+
+size_t FakeNetlinkRoute::numRules() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRules.size();
+}
+
+size_t FakeNetlinkRoute::numRoutes() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRoutes.size();
+}
+
+std::set<std::string> FakeNetlinkRoute::rules() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRules;
+}
+
+void FakeNetlinkRoute::serve() {
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[RECV_BUFFER_SIZE]);
+    while (true) {
+        ssize_t bytes = recv(mServerSocket, buf.get(), RECV_BUFFER_SIZE, 0);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        int len = bytes;
+        for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(buf.get());
+             NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            processRequest(nlh);
+        }
+    }
+}
+
+void FakeNetlinkRoute::processRequest(const nlmsghdr* nlh) {
+    const auto latency = mLatency.load();
+    if (latency.count()) {
+        std::this_thread::sleep_for(latency);
+    }
+    ++mMessagesProcessed;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!(nlh->nlmsg_flags & NLM_F_REQUEST)) {
+        sendAck(nlh, -EINVAL);
+        return;
+    }
+    switch (nlh->nlmsg_type) {
+        case RTM_NEWRULE:
+        case RTM_DELRULE:
+            sendAck(nlh, modify(nlh, sizeof(fib_rule_hdr), &mRules));
+            return;
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+            sendAck(nlh, modify(nlh, sizeof(rtmsg), &mRoutes));
+            return;
+        case RTM_GETRULE:
+            dump(nlh, mRules, RTM_NEWRULE);
+            return;
+        case RTM_GETROUTE:
+            dump(nlh, mRoutes, RTM_NEWROUTE);
+            return;
+        default:
+            sendAck(nlh, -EOPNOTSUPP);
+            return;
+    }
+}
+
+// Validates an add or delete request and applies it to |entries|. |headerSize| is the size of the
+// fib_rule_hdr or rtmsg that precedes the attributes. Returns 0 or negative errno, as the kernel
+// would.
+int FakeNetlinkRoute::modify(const nlmsghdr* nlh, size_t headerSize,
+                             std::set<std::string>* entries) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(headerSize)) {
+        return -EINVAL;
+    }
+    const uint8_t* payload = static_cast<const uint8_t*>(NLMSG_DATA(nlh));
+    // The family is the first byte of both fib_rule_hdr and rtmsg.
+    if (!validFamily(payload[0])) {
+        return -EAFNOSUPPORT;
+    }
+    if (!validAttributes(reinterpret_cast<const rtattr*>(payload + NLMSG_ALIGN(headerSize)),
+                         nlh->nlmsg_len - NLMSG_LENGTH(headerSize))) {
+        return -EINVAL;
+    }
+
+    if (mErrorInterval && mMessagesProcessed % mErrorInterval == 0) {
+        return mError;
+    }
+    if (mFailNextType && mFailNextType == nlh->nlmsg_type) {
+        mFailNextType = 0;
+        return mFailNextError;
+    }
+
+    std::string entry(reinterpret_cast<const char*>(payload), nlh->nlmsg_len - NLMSG_HDRLEN);
+    if (nlh->nlmsg_type == RTM_NEWRULE || nlh->nlmsg_type == RTM_NEWROUTE) {
+        if (!entries->insert(entry).second && (nlh->nlmsg_flags & NLM_F_EXCL)) {
+            return -EEXIST;
+        }
+        return 0;
+    }
+    if (!entries->erase(entry)) {
+        return (nlh->nlmsg_type == RTM_DELROUTE) ? -ESRCH : -ENOENT;
+    }
+    return 0;
+}
+
+// Sends every entry of the requested family as a |type| message, several to a datagram, followed
+// by NLMSG_DONE.
+void FakeNetlinkRoute::dump(const nlmsghdr* nlh, const std::set<std::string>& entries,
+                            uint16_t type) {
+    if (!(nlh->nlmsg_flags & NLM_F_DUMP) || nlh->nlmsg_len < NLMSG_LENGTH(1)) {
+        sendAck(nlh, -EINVAL);
+        return;
+    }
+    const uint8_t family = *static_cast<const uint8_t*>(NLMSG_DATA(nlh));
+
+    std::string datagram;
+    auto append = [&] (uint16_t msgType, const void* data, size_t len) {
+        const nlmsghdr header = {
+            .nlmsg_len = static_cast<uint32_t>(NLMSG_LENGTH(len)),
+            .nlmsg_type = msgType,
+            .nlmsg_flags = NLM_F_MULTI,
+            .nlmsg_seq = nlh->nlmsg_seq,
+        };
+        if (datagram.size() + NLMSG_SPACE(len) > DUMP_DATAGRAM_SIZE) {
+            send(mServerSocket, datagram.data(), datagram.size(), 0);
+            datagram.clear();
+        }
+        datagram.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        datagram.append(static_cast<const char*>(data), len);
+        datagram.resize(datagram.size() + NLMSG_ALIGN(len) - len, '\0');
+    };
+
+    for (const std::string& entry : entries) {
+        if (family == AF_UNSPEC || static_cast<uint8_t>(entry[0]) == family) {
+            append(type, entry.data(), entry.size());
+        }
+    }
+    const int done = 0;
+    append(NLMSG_DONE, &done, sizeof(done));
+    send(mServerSocket, datagram.data(), datagram.size(), 0);
+}
+
+void FakeNetlinkRoute::sendAck(const nlmsghdr* nlh, int error) {
+    if (!error && !(nlh->nlmsg_flags & NLM_F_ACK)) {
+        return;
+    }
+    struct {
+        nlmsghdr header;
+        nlmsgerr err;
+    } ack = {
+        .header = {
+            .nlmsg_len = sizeof(ack),
+            .nlmsg_type = NLMSG_ERROR,
+            .nlmsg_seq = nlh->nlmsg_seq,
+        },
+        .err = {
+            .error = error,
+            .msg = *nlh,
+        },
+    };
+    if (send(mServerSocket, &ack, sizeof(ack), 0) == -1) {
+        ALOGE("Failed to send ack: %s", strerror(errno));
+    }
+}
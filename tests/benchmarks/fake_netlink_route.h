@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_TESTS_BENCHMARKS_FAKE_NETLINK_ROUTE_H
+#define NETD_TESTS_BENCHMARKS_FAKE_NETLINK_ROUTE_H
+
+#include <linux/netlink.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+// An in-process stand-in for the kernel's NETLINK_ROUTE socket, so that RouteController can be
+// benchmarked without root and without touching the routing configuration of the machine.
+//
+// The fake serves one end of an AF_UNIX datagram socketpair on its own thread, and the other end
+// is handed to RouteController. It understands RTM_{NEW,DEL}RULE and RTM_{NEW,DEL}ROUTE requests,
+// which it validates and stores, and RTM_GETRULE and RTM_GETROUTE dumps. Like the kernel, it sends
+// one ack per request, fails to add something that already exists (NLM_F_EXCL) and fails to
+// delete something that doesn't. Unlike the kernel, a delete must match an add exactly; wildcard
+// deletes are not supported.
+class FakeNetlinkRoute {
+public:
+    FakeNetlinkRoute();
+    ~FakeNetlinkRoute();
+
+    // Creates the socketpair and starts serving. Returns 0 on success or negative errno on failure.
+    int start();
+    void stop();
+
+    // The socket to pass to RouteController.
+    int clientSocket() const { return mClientSocket; }
+
+    // Delays each request by |latency|, to model a loaded kernel.
+    void setLatency(std::chrono::microseconds latency) { mLatency = latency; }
+
+    // Fails every |interval|th request with |error| (a negative errno). 0 disables this.
+    void setErrorInjection(unsigned interval, int error);
+
+    // Fails the next request of type |type| (e.g., RTM_NEWRULE) with |error|.
+    void failNextRequest(uint16_t type, int error);
+
+    // Adds a route directly to the fake's state, e.g., to have something to flush.
+    void addRoute(uint8_t family, uint32_t table, uint32_t destination, uint8_t prefixLength);
+
+    // Forgets all the rules and routes.
+    void reset();
+
+    size_t numRules() const;
+    size_t numRoutes() const;
+
+    // A copy of the rules, in the format described below.
+    std::set<std::string> rules() const;
+
+    // The number of requests processed so far, including dump requests but not dump replies.
+    uint64_t messagesProcessed() const { return mMessagesProcessed; }
+
+private:
+    void serve();
+    void processRequest(const nlmsghdr* nlh);
+    int modify(const nlmsghdr* nlh, size_t headerSize, std::set<std::string>* entries);
+    void dump(const nlmsghdr* nlh, const std::set<std::string>& entries, uint16_t type);
+    void sendAck(const nlmsghdr* nlh, int error);
+
+    int mClientSocket;
+    int mServerSocket;
+    std::thread mThread;
+
+    std::atomic<std::chrono::microseconds> mLatency;
+    std::atomic<uint64_t> mMessagesProcessed;
+
+    // Guards everything below.
+    mutable std::mutex mLock;
+    unsigned mErrorInterval;
+    int mError;
+    uint16_t mFailNextType;
+    int mFailNextError;
+    // Rules and routes are stored as the payload of the request that added them, which is also
+    // what a delete or dump has to produce.
+    std::set<std::string> mRules;
+    std::set<std::string> mRoutes;
+};
+
+#endif  // NETD_TESTS_BENCHMARKS_FAKE_NETLINK_ROUTE_H
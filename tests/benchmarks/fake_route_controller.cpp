@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A RouteController that doesn't touch the kernel. Linking this instead of RouteController.cpp
+// allows NetworkController and the Network classes to run without root and without modifying the
+// routing configuration of the device, so their lookup cost can be measured in isolation.
+
+#include "Controllers.h"
+#include "RouteController.h"
+
+namespace android {
+namespace net {
+
+// NetworkController::dump() refers to this. The benchmarks never call dump().
+Controllers* gCtls = nullptr;
+
+}  // namespace net
+}  // namespace android
+
+struct RouteController::Transaction::Batch {
+};
+
+RouteController::Transaction::Transaction() {
+}
+
+RouteController::Transaction::~Transaction() {
+}
+
+int RouteController::Transaction::commit() {
+    return 0;
+}
+
+int RouteController::Init(unsigned) {
+    return 0;
+}
+
+int RouteController::addInterfaceToLocalNetwork(unsigned, const char*) {
+    return 0;
+}
+
+int RouteController::removeInterfaceFromLocalNetwork(unsigned, const char*) {
+    return 0;
+}
+
+int RouteController::addInterfaceToPhysicalNetwork(unsigned, const char*, Permission) {
+    return 0;
+}
+
+int RouteController::removeInterfaceFromPhysicalNetwork(unsigned, const char*, Permission) {
+    return 0;
+}
+
+int RouteController::addInterfaceToVirtualNetwork(unsigned, const char*, bool, const UidRanges&) {
+    return 0;
+}
+
+int RouteController::removeInterfaceFromVirtualNetwork(unsigned, const char*, bool,
+                                                       const UidRanges&) {
+    return 0;
+}
+
+int RouteController::modifyPhysicalNetworkPermission(unsigned, const char*, Permission,
+                                                     Permission) {
+    return 0;
+}
+
+int RouteController::addUsersToVirtualNetwork(unsigned, const char*, bool, const UidRanges&) {
+    return 0;
+}
+
+int RouteController::removeUsersFromVirtualNetwork(unsigned, const char*, bool,
+                                                   const UidRanges&) {
+    return 0;
+}
+
+int RouteController::addUsersToRejectNonSecureNetworkRule(const UidRanges&) {
+    return 0;
+}
+
+int RouteController::removeUsersFromRejectNonSecureNetworkRule(const UidRanges&) {
+    return 0;
+}
+
+int RouteController::addInterfaceToDefaultNetwork(const char*, Permission) {
+    return 0;
+}
+
+int RouteController::removeInterfaceFromDefaultNetwork(const char*, Permission) {
+    return 0;
+}
+
+int RouteController::addRoute(const char*, const char*, const char*, TableType) {
+    return 0;
+}
+
+int RouteController::removeRoute(const char*, const char*, const char*, TableType) {
+    return 0;
+}
+
+int RouteController::enableTethering(const char*, const char*) {
+    return 0;
+}
+
+int RouteController::disableTethering(const char*, const char*) {
+    return 0;
+}
+
+int RouteController::addVirtualNetworkFallthrough(unsigned, const char*, Permission) {
+    return 0;
+}
+
+int RouteController::removeVirtualNetworkFallthrough(unsigned, const char*, Permission) {
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "network_controller_benchmark"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <log/log.h>
+#include <private/android_filesystem_config.h>
+
+#include "NetworkController.h"
+#include "Permission.h"
+#include "UidRanges.h"
+#include "android/net/UidRange.h"
+#include "resolv_netid.h"
+
+using android::base::StringPrintf;
+using android::net::UidRange;
+
+constexpr int MIN_THREADS = 1;
+constexpr int MAX_THREADS = 64;
+
+// Keep these in sync with NetworkController.cpp.
+constexpr unsigned FIRST_NET_ID = 100;
+
+constexpr uid_t FIRST_UID = AID_APP;
+constexpr unsigned NUM_UIDS = 10000;
+// Prime, so that consecutive lookups from one thread don't hit the same cache lines.
+constexpr unsigned UID_STRIDE = 7919;
+
+// How often the writer thread switches the default network.
+constexpr auto WRITER_INTERVAL = std::chrono::microseconds(100);
+
+// Populates a NetworkController with range_x() physical networks, a bypassable VPN and a secure
+// VPN, and NUM_UIDS apps with a mix of permissions. If range_y() is non-zero, a writer thread
+// keeps switching the default network while the benchmark runs, so the cost of contending with
+// the write lock is included in the results.
+//
+// RouteController is replaced by a fake, so this runs as an unprivileged process and does not
+// require netd.
+class NetworkControllerFixture : public ::benchmark::Fixture {
+protected:
+    std::unique_ptr<NetworkController> mNetCtrl;
+    std::vector<unsigned> mNetIds;
+    unsigned mBypassableVpnNetId;
+    unsigned mSecureVpnNetId;
+
+    std::thread mWriter;
+    std::atomic<bool> mStopWriter;
+
+public:
+    void SetUp(const ::benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            createNetworks(state.range_x());
+            if (state.range_y()) {
+                startWriter();
+            }
+        }
+    }
+
+    void TearDown(const ::benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            stopWriter();
+            destroyNetworks();
+        }
+    }
+
+    void createNetworks(unsigned numNetworks) {
+        mNetCtrl.reset(new NetworkController());
+        mNetIds.clear();
+
+        // Every other physical network is restricted to apps with PERMISSION_NETWORK.
+        for (unsigned i = 0; i < numNetworks; i++) {
+            const unsigned netId = FIRST_NET_ID + i;
+            const Permission permission = (i % 2) ? PERMISSION_NETWORK : PERMISSION_NONE;
+            if (mNetCtrl->createPhysicalNetwork(netId, permission) ||
+                    mNetCtrl->addInterfaceToNetwork(netId, StringPrintf("fake%u", i).c_str())) {
+                ALOGE("Failed to create physical network %u", netId);
+            }
+            mNetIds.push_back(netId);
+        }
+        if (mNetCtrl->setDefaultNetwork(mNetIds[0])) {
+            ALOGE("Failed to set default network %u", mNetIds[0]);
+        }
+
+        // The first tenth of the apps use a bypassable VPN, the second tenth a secure VPN.
+        mBypassableVpnNetId = FIRST_NET_ID + numNetworks;
+        mSecureVpnNetId = mBypassableVpnNetId + 1;
+        createVpn(mBypassableVpnNetId, false, "tun0", FIRST_UID, FIRST_UID + NUM_UIDS / 10 - 1);
+        createVpn(mSecureVpnNetId, true, "tun1", FIRST_UID + NUM_UIDS / 10,
+                  FIRST_UID + NUM_UIDS / 5 - 1);
+
+        // One app in ten has PERMISSION_NETWORK, and one in a hundred has PERMISSION_SYSTEM.
+        std::vector<uid_t> networkUids, systemUids;
+        for (uid_t uid = FIRST_UID; uid < FIRST_UID + NUM_UIDS; uid++) {
+            if (uid % 100 == 0) {
+                systemUids.push_back(uid);
+            } else if (uid % 10 == 0) {
+                networkUids.push_back(uid);
+            }
+        }
+        mNetCtrl->setPermissionForUsers(PERMISSION_NETWORK, networkUids);
+        mNetCtrl->setPermissionForUsers(PERMISSION_SYSTEM, systemUids);
+    }
+
+    void createVpn(unsigned netId, bool secure, const char* interface, uid_t start, uid_t stop) {
+        UidRanges uidRanges(std::vector<UidRange>{ UidRange(start, stop) });
+        if (mNetCtrl->createVirtualNetwork(netId, true /* hasDns */, secure) ||
+                mNetCtrl->addInterfaceToNetwork(netId, interface) ||
+                mNetCtrl->addUsersToNetwork(netId, uidRanges)) {
+            ALOGE("Failed to create VPN %u", netId);
+        }
+    }
+
+    void destroyNetworks() {
+        for (unsigned netId : mNetIds) {
+            if (mNetCtrl->destroyNetwork(netId)) {
+                ALOGE("Failed to destroy network %u", netId);
+            }
+        }
+        if (mNetCtrl->destroyNetwork(mBypassableVpnNetId) ||
+                mNetCtrl->destroyNetwork(mSecureVpnNetId)) {
+            ALOGE("Failed to destroy VPNs");
+        }
+        mNetIds.clear();
+        mNetCtrl.reset();
+    }
+
+    void startWriter() {
+        mStopWriter = false;
+        mWriter = std::thread([this] () {
+            unsigned i = 0;
+            while (!mStopWriter) {
+                if (mNetCtrl->setDefaultNetwork(mNetIds[++i % mNetIds.size()])) {
+                    ALOGE("Failed to switch default network");
+                }
+                std::this_thread::sleep_for(WRITER_INTERVAL);
+            }
+        });
+    }
+
+    void stopWriter() {
+        if (mWriter.joinable()) {
+            mStopWriter = true;
+            mWriter.join();
+        }
+    }
+
+    // Returns a different UID on every call, spreading consecutive calls over all the apps.
+    static uid_t nextUid(unsigned* i) {
+        *i += UID_STRIDE;
+        return FIRST_UID + *i % NUM_UIDS;
+    }
+
+    // Returns a different netId on every call, including the VPNs.
+    unsigned nextNetId(unsigned* i) const {
+        ++*i;
+        const unsigned numNetIds = mNetIds.size() + 2;
+        return FIRST_NET_ID + *i % numNetIds;
+    }
+};
+
+// range_x is the number of physical networks; range_y is whether the writer thread is running.
+static void NetworkControllerArgs(benchmark::internal::Benchmark* b) {
+    for (int writer : {0, 1}) {
+        for (int networks : {10, 50, 200}) {
+            b->ArgPair(networks, writer);
+        }
+    }
+}
+
+BENCHMARK_DEFINE_F(NetworkControllerFixture, getNetworkForConnect)(benchmark::State& state) {
+    unsigned i = state.thread_index;
+    while (state.KeepRunning()) {
+        mNetCtrl->getNetworkForConnect(nextUid(&i));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(NetworkControllerFixture, getNetworkForConnect)
+    ->Apply(NetworkControllerArgs)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
+
+BENCHMARK_DEFINE_F(NetworkControllerFixture, getNetworkForDns)(benchmark::State& state) {
+    unsigned i = state.thread_index;
+    unsigned j = state.thread_index;
+    while (state.KeepRunning()) {
+        // Half the lookups explicitly select a network, as android_getaddrinfofornet() would.
+        unsigned netId = (i & 1) ? nextNetId(&j) : NETID_UNSET;
+        mNetCtrl->getNetworkForDns(&netId, nextUid(&i));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(NetworkControllerFixture, getNetworkForDns)
+    ->Apply(NetworkControllerArgs)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
+
+BENCHMARK_DEFINE_F(NetworkControllerFixture, checkUserNetworkAccess)(benchmark::State& state) {
+    unsigned i = state.thread_index;
+    unsigned j = state.thread_index;
+    while (state.KeepRunning()) {
+        mNetCtrl->checkUserNetworkAccess(nextUid(&i), nextNetId(&j));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(NetworkControllerFixture, checkUserNetworkAccess)
+    ->Apply(NetworkControllerArgs)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
+
+BENCHMARK_DEFINE_F(NetworkControllerFixture, getPermissionForUser)(benchmark::State& state) {
+    unsigned i = state.thread_index;
+    while (state.KeepRunning()) {
+        mNetCtrl->getPermissionForUser(nextUid(&i));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(NetworkControllerFixture, getPermissionForUser)
+    ->Apply(NetworkControllerArgs)
+    ->ThreadRange(MIN_THREADS, MAX_THREADS)
+    ->UseRealTime();
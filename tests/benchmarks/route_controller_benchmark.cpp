@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "route_controller_benchmark"
+
+#include <net/if.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <log/log.h>
+#include <private/android_filesystem_config.h>
+
+#include "Permission.h"
+#include "RouteController.h"
+#include "UidRanges.h"
+#include "android/net/UidRange.h"
+#include "fake_netlink_route.h"
+
+using android::net::UidRange;
+
+constexpr unsigned NET_ID = 100;
+
+// Every machine has a loopback interface, and RouteController needs a real interface index to
+// pick a routing table.
+constexpr char INTERFACE[] = "lo";
+
+// Keep in sync with RouteController.cpp.
+constexpr uint32_t ROUTE_TABLE_OFFSET_FROM_INDEX = 1000;
+
+constexpr uid_t FIRST_UID = AID_APP;
+// Leave gaps between the ranges so that they aren't merged.
+constexpr uid_t UID_RANGE_STRIDE = 10;
+constexpr uid_t UID_RANGE_SIZE = 5;
+
+// Runs RouteController against a FakeNetlinkRoute instead of the kernel, so this runs as an
+// unprivileged process and leaves the machine's routing alone. Benchmarks report the number of
+// netlink requests per second, which is the control-plane cost of bringing networks up and down.
+class RouteControllerFixture : public ::benchmark::Fixture {
+protected:
+    FakeNetlinkRoute mFake;
+
+public:
+    void SetUp(const ::benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            if (int ret = mFake.start()) {
+                ALOGE("Failed to start fake netlink endpoint: %s", strerror(-ret));
+            }
+            RouteController::setNetlinkSocketForTest(mFake.clientSocket());
+        }
+    }
+
+    void TearDown(const ::benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            RouteController::setNetlinkSocketForTest(-1);
+            mFake.stop();
+            mFake.setLatency(std::chrono::microseconds(0));
+        }
+    }
+
+    // Adds |numRoutes| IPv4 routes to the table that RouteController uses for INTERFACE.
+    void addRoutes(unsigned numRoutes) {
+        const uint32_t table = if_nametoindex(INTERFACE) + ROUTE_TABLE_OFFSET_FROM_INDEX;
+        for (unsigned i = 0; i < numRoutes; i++) {
+            // 10.x.y.0/24, in network byte order.
+            const uint32_t destination = 10 | (((i >> 8) & 0xff) << 8) | ((i & 0xff) << 16);
+            mFake.addRoute(AF_INET, table, destination, 24);
+        }
+    }
+
+    static UidRanges makeUidRanges(unsigned numRanges) {
+        std::vector<UidRange> ranges;
+        for (unsigned i = 0; i < numRanges; i++) {
+            const uid_t start = FIRST_UID + i * UID_RANGE_STRIDE;
+            ranges.push_back(UidRange(start, start + UID_RANGE_SIZE - 1));
+        }
+        return UidRanges(ranges);
+    }
+};
+
+// range_x is the latency of each netlink request, in microseconds.
+BENCHMARK_DEFINE_F(RouteControllerFixture, addInterfaceToPhysicalNetwork)(
+        benchmark::State& state) {
+    mFake.setLatency(std::chrono::microseconds(state.range_x()));
+    uint64_t messages = 0;
+    while (state.KeepRunning()) {
+        const uint64_t before = mFake.messagesProcessed();
+        if (RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE, PERMISSION_NONE)) {
+            ALOGE("addInterfaceToPhysicalNetwork failed");
+        }
+        messages += mFake.messagesProcessed() - before;
+
+        state.PauseTiming();
+        mFake.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(messages);
+}
+BENCHMARK_REGISTER_F(RouteControllerFixture, addInterfaceToPhysicalNetwork)
+    ->Arg(0)
+    ->Arg(10)
+    ->Arg(100)
+    ->UseRealTime();
+
+// range_x is the number of UID ranges.
+BENCHMARK_DEFINE_F(RouteControllerFixture, addUsersToVirtualNetwork)(benchmark::State& state) {
+    const UidRanges uidRanges = makeUidRanges(state.range_x());
+    uint64_t messages = 0;
+    while (state.KeepRunning()) {
+        const uint64_t before = mFake.messagesProcessed();
+        if (RouteController::addUsersToVirtualNetwork(NET_ID, INTERFACE, true /* secure */,
+                                                      uidRanges)) {
+            ALOGE("addUsersToVirtualNetwork failed");
+        }
+        messages += mFake.messagesProcessed() - before;
+
+        state.PauseTiming();
+        mFake.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(messages);
+}
+BENCHMARK_REGISTER_F(RouteControllerFixture, addUsersToVirtualNetwork)
+    ->Arg(1)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->UseRealTime();
+
+// range_x is the number of routes in the interface's table. Flushing them is most of the cost of
+// removing an interface from a network.
+BENCHMARK_DEFINE_F(RouteControllerFixture, flushRoutes)(benchmark::State& state) {
+    uint64_t messages = 0;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        mFake.reset();
+        if (RouteController::addInterfaceToPhysicalNetwork(NET_ID, INTERFACE, PERMISSION_NONE)) {
+            ALOGE("addInterfaceToPhysicalNetwork failed");
+        }
+        addRoutes(state.range_x());
+        const uint64_t before = mFake.messagesProcessed();
+        state.ResumeTiming();
+
+        if (RouteController::removeInterfaceFromPhysicalNetwork(NET_ID, INTERFACE,
+                                                                PERMISSION_NONE)) {
+            ALOGE("removeInterfaceFromPhysicalNetwork failed");
+        }
+        messages += mFake.messagesProcessed() - before;
+        if (mFake.numRoutes()) {
+            ALOGE("routes left over after flush");
+        }
+    }
+    state.SetItemsProcessed(messages);
+}
+BENCHMARK_REGISTER_F(RouteControllerFixture, flushRoutes)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->UseRealTime();
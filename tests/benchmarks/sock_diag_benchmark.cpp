@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sock_diag_benchmark"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <set>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <log/log.h>
+#include <private/android_filesystem_config.h>
+
+#include "Fwmark.h"
+#include "Permission.h"
+#include "SockDiag.h"
+#include "Stopwatch.h"
+#include "UidRanges.h"
+#include "android/net/UidRange.h"
+
+using android::base::StringPrintf;
+using android::net::UidRange;
+
+constexpr uid_t FIRST_UID = AID_APP;
+constexpr unsigned NUM_UIDS = 1000;
+
+// Connection i belongs to group i % NUM_GROUPS, and its client socket is bound to
+// FIRST_SOURCE_ADDRESS + group. The client sockets of group 0 are the ones that each benchmark
+// destroys: they have the UIDs in victimUidRanges(), are bound to VICTIM_ADDRESS, and are on
+// TEST_NET_ID without having explicitly selected it.
+constexpr unsigned NUM_GROUPS = 10;
+constexpr unsigned VICTIM_GROUP = 0;
+constexpr uint32_t FIRST_SOURCE_ADDRESS = 0x7f00000a;  // 127.0.0.10.
+constexpr char VICTIM_ADDRESS[] = "127.0.0.10";
+constexpr unsigned TEST_NET_ID = 4242;
+constexpr unsigned OTHER_NET_ID = 4243;
+
+// File descriptors needed besides the two for each connection.
+constexpr rlim_t SPARE_FDS = 64;
+
+// Opens range_x() loopback TCP connections, i.e., twice as many sockets, and times sweeps that
+// destroy the client sockets of one connection in NUM_GROUPS. Before each sweep, the connections
+// destroyed by the previous one are reopened, outside the timed region.
+//
+// The client sockets are spread over NUM_UIDS UIDs, NUM_GROUPS source addresses in 127.0.0.0/8
+// and several fwmarks. Changing the UID and fwmark of a socket needs CAP_CHOWN and
+// CAP_NET_ADMIN, and destroying it needs CAP_NET_ADMIN. Without them, the benchmarks still time
+// the dumps, but destroy nothing.
+//
+// Reports sockets scanned per second as the items processed, and sockets destroyed per second and
+// netlink system calls per destroyed socket in the label.
+class SockDiagFixture : public ::benchmark::Fixture {
+protected:
+    struct Connection {
+        int client;
+        int server;
+    };
+
+    int mListenSocket;
+    sockaddr_in mServerAddress;
+    std::vector<Connection> mConnections;
+    bool mPrivileged;
+
+    // Totals over all the sweeps of one benchmark.
+    double mSweepMs;
+    uint64_t mSweeps;
+    uint64_t mDestroyed;
+    uint64_t mSyscalls;
+
+public:
+    void SetUp(const ::benchmark::State& state) override {
+        if (state.thread_index != 0) {
+            return;
+        }
+        mPrivileged = true;
+        mSweepMs = 0;
+        mSweeps = mDestroyed = mSyscalls = 0;
+
+        unsigned numConnections = state.range_x();
+        rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (2 * numConnections + SPARE_FDS > limit.rlim_cur) {
+            ALOGE("RLIMIT_NOFILE is %llu, only opening %llu connections",
+                  (unsigned long long) limit.rlim_cur,
+                  (unsigned long long) (limit.rlim_cur - SPARE_FDS) / 2);
+            numConnections = (limit.rlim_cur - SPARE_FDS) / 2;
+        }
+
+        mListenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        mServerAddress = { .sin_family = AF_INET, .sin_addr = { htonl(INADDR_LOOPBACK) } };
+        socklen_t len = sizeof(mServerAddress);
+        if (bind(mListenSocket, (sockaddr *) &mServerAddress, len) == -1 ||
+                listen(mListenSocket, SOMAXCONN) == -1 ||
+                getsockname(mListenSocket, (sockaddr *) &mServerAddress, &len) == -1) {
+            ALOGE("Failed to set up listening socket: %s", strerror(errno));
+            return;
+        }
+
+        mConnections.resize(numConnections, { -1, -1 });
+        for (unsigned i = 0; i < numConnections; i++) {
+            if (!openConnection(i)) {
+                return;
+            }
+        }
+    }
+
+    void TearDown(const ::benchmark::State& state) override {
+        if (state.thread_index != 0) {
+            return;
+        }
+        for (unsigned i = 0; i < mConnections.size(); i++) {
+            closeConnection(i);
+        }
+        mConnections.clear();
+        close(mListenSocket);
+    }
+
+    static unsigned group(unsigned i) { return i % NUM_GROUPS; }
+    static uid_t uid(unsigned i) { return FIRST_UID + i % NUM_UIDS; }
+
+    // The UIDs of the victim group, as one range per UID.
+    static UidRanges victimUidRanges() {
+        std::vector<UidRange> ranges;
+        for (unsigned i = VICTIM_GROUP; i < NUM_UIDS; i += NUM_GROUPS) {
+            ranges.push_back(UidRange(uid(i), uid(i)));
+        }
+        return UidRanges(ranges);
+    }
+
+    static Fwmark fwmark(unsigned i) {
+        Fwmark mark;
+        if (group(i) == VICTIM_GROUP) {
+            // Lacks PERMISSION_NETWORK.
+            mark.netId = TEST_NET_ID;
+        } else if (group(i) % 2) {
+            mark.netId = OTHER_NET_ID;
+        } else {
+            mark.netId = TEST_NET_ID;
+            mark.explicitlySelected = true;
+            mark.permission = PERMISSION_NETWORK;
+        }
+        return mark;
+    }
+
+    bool openConnection(unsigned i) {
+        Connection& c = mConnections[i];
+        c.client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c.client == -1) {
+            ALOGE("Failed to open socket %u: %s", i, strerror(errno));
+            return false;
+        }
+
+        sockaddr_in src = { .sin_family = AF_INET };
+        src.sin_addr.s_addr = htonl(FIRST_SOURCE_ADDRESS + group(i));
+        if (bind(c.client, (sockaddr *) &src, sizeof(src)) == -1) {
+            ALOGE("Failed to bind socket %u: %s", i, strerror(errno));
+            return false;
+        }
+
+        if (mPrivileged) {
+            const uint32_t mark = fwmark(i).intValue;
+            if (fchown(c.client, uid(i), -1) == -1 ||
+                    setsockopt(c.client, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1) {
+                ALOGW("Can't set socket UID or mark (%s), sweeps will not destroy sockets",
+                      strerror(errno));
+                mPrivileged = false;
+            }
+        }
+
+        if (connect(c.client, (sockaddr *) &mServerAddress, sizeof(mServerAddress)) == -1) {
+            ALOGE("Failed to connect socket %u: %s", i, strerror(errno));
+            return false;
+        }
+        c.server = accept4(mListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (c.server == -1) {
+            ALOGE("Failed to accept connection %u: %s", i, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void closeConnection(unsigned i) {
+        close(mConnections[i].client);
+        close(mConnections[i].server);
+        mConnections[i] = { -1, -1 };
+    }
+
+    // Reopens the connections that the previous sweep destroyed.
+    void reopenVictims() {
+        for (unsigned i = VICTIM_GROUP; i < mConnections.size(); i += NUM_GROUPS) {
+            closeConnection(i);
+            openConnection(i);
+        }
+    }
+
+    void recordSweep(const SockDiag& sd, const Stopwatch& s) {
+        mSweepMs += s.timeTaken();
+        mSweeps++;
+        mDestroyed += sd.mSocketsDestroyed;
+        mSyscalls += sd.mSyscalls;
+    }
+
+    void report(benchmark::State& state) {
+        state.SetItemsProcessed(mSweeps * 2 * mConnections.size());
+        const double destroyedPerSecond = mSweepMs ? mDestroyed * 1000.0 / mSweepMs : 0;
+        std::string syscallsPerSocket = mDestroyed ?
+                StringPrintf("%.2f", (double) mSyscalls / mDestroyed) : "n/a";
+        state.SetLabel(StringPrintf("destroyed/s=%.0f syscalls/destroyed=%s",
+                                    destroyedPerSecond, syscallsPerSocket.c_str()));
+    }
+};
+
+BENCHMARK_DEFINE_F(SockDiagFixture, destroySocketsForUidRanges)(benchmark::State& state) {
+    SockDiag sd;
+    if (!sd.open()) {
+        ALOGE("Failed to open SOCK_DIAG socket");
+    }
+    const UidRanges uidRanges = victimUidRanges();
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        reopenVictims();
+        state.ResumeTiming();
+
+        Stopwatch s;
+        if (int ret = sd.destroySockets(uidRanges, {}, false /* excludeLoopback */)) {
+            ALOGE("destroySockets failed: %s", strerror(-ret));
+        }
+        recordSweep(sd, s);
+    }
+    report(state);
+}
+
+BENCHMARK_DEFINE_F(SockDiagFixture, destroySocketsLackingPermission)(benchmark::State& state) {
+    SockDiag sd;
+    if (!sd.open()) {
+        ALOGE("Failed to open SOCK_DIAG socket");
+    }
+    const std::set<unsigned> netIds = { TEST_NET_ID };
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        reopenVictims();
+        state.ResumeTiming();
+
+        Stopwatch s;
+        if (int ret = sd.destroySocketsLackingPermission(netIds, PERMISSION_NETWORK,
+                                                         false /* excludeLoopback */)) {
+            ALOGE("destroySocketsLackingPermission failed: %s", strerror(-ret));
+        }
+        recordSweep(sd, s);
+    }
+    report(state);
+}
+
+BENCHMARK_DEFINE_F(SockDiagFixture, destroySocketsOnAddress)(benchmark::State& state) {
+    SockDiag sd;
+    if (!sd.open()) {
+        ALOGE("Failed to open SOCK_DIAG socket");
+    }
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        reopenVictims();
+        state.ResumeTiming();
+
+        Stopwatch s;
+        int ret = sd.destroySockets(VICTIM_ADDRESS);
+        if (ret < 0) {
+            ALOGE("destroySockets failed: %s", strerror(-ret));
+        }
+        recordSweep(sd, s);
+    }
+    report(state);
+}
+
+// range_x is the number of connections.
+#define SOCK_DIAG_BENCHMARK(name)                    \
+    BENCHMARK_REGISTER_F(SockDiagFixture, name)      \
+        ->Arg(100)                                   \
+        ->Arg(1000)                                  \
+        ->Arg(10000)                                 \
+        ->Arg(20000)                                 \
+        ->UseRealTime();
+
+SOCK_DIAG_BENCHMARK(destroySocketsForUidRanges)
+SOCK_DIAG_BENCHMARK(destroySocketsLackingPermission)
+SOCK_DIAG_BENCHMARK(destroySocketsOnAddress)
@@ -687,3 +687,27 @@ TEST_F(ResolverTest, MaxServerPrune_Binder) {
 
     ASSERT_NO_FATAL_FAILURE(ShutdownDNSServers(&dns));
 }
+
+TEST_F(ResolverTest, SetNetworkForSockets) {
+    // More than fit in one batch, with one invalid socket in the middle.
+    const size_t kNumSockets = 100;
+    const size_t kInvalid = 42;
+    std::vector<int> fds(kNumSockets);
+    for (size_t i = 0; i < kNumSockets; i++) {
+        fds[i] = (i == kInvalid) ? -1 : socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+
+    std::vector<int> errors(kNumSockets);
+    EXPECT_EQ(-EBADF, setNetworkForSockets(mOemNetId, fds.data(), kNumSockets, errors.data()));
+    for (size_t i = 0; i < kNumSockets; i++) {
+        if (i == kInvalid) {
+            EXPECT_EQ(-EBADF, errors[i]);
+            continue;
+        }
+        EXPECT_EQ(0, errors[i]);
+        unsigned netId = 0;
+        EXPECT_EQ(0, getNetworkForSocket(&netId, fds[i]));
+        EXPECT_EQ(static_cast<unsigned>(mOemNetId), netId);
+        close(fds[i]);
+    }
+}